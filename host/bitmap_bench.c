@@ -0,0 +1,203 @@
+/*
+ * microbenchmark: word-parallel bitmap vs the per-bit code mmcfs.c used to
+ * have, on a full size (MMCFS_MAX_BITARRAY_SIZE) bitmap.
+ *
+ * - set/clear: range set then clear, range lengths like mp3/pcm files
+ * - scan: walk all free runs, as mount does to build the free extent index
+ * - count: used blocks
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#define NBITS (16 * 1024 * 8)
+#define RANGES 4096
+
+static uint8_t old_array[NBITS / 8] __attribute__((aligned(4)));
+static uint32_t words[BITMAP_WORDS(NBITS)];
+static bitmap_t bm;
+
+static uint32_t range_start[RANGES], range_end[RANGES];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the per-bit code, as it was */
+static bool old_test_bit(int i) {
+  return !!(old_array[i / 8] & ((uint8_t)1 << (i % 8)));
+}
+static void old_set_bit(int i) { old_array[i / 8] |= (1 << (i % 8)); }
+static void old_clear_bit(int i) { old_array[i / 8] &= ~(1 << (i % 8)); }
+
+static esp_err_t old_set_bits(uint32_t start, uint32_t end,
+                              uint32_t *conflict) {
+  if (start > end || end > NBITS)
+    return ESP_ERR_INVALID_ARG;
+  for (uint32_t i = start; i < end; i++) {
+    if (old_test_bit(i)) {
+      *conflict = i;
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+  for (uint32_t i = start; i < end; i++)
+    old_set_bit(i);
+  return ESP_OK;
+}
+
+static esp_err_t old_clear_bits(uint32_t start, uint32_t end,
+                                uint32_t *conflict) {
+  if (start > end || end > NBITS)
+    return ESP_ERR_INVALID_ARG;
+  for (uint32_t i = start; i < end; i++) {
+    if (!old_test_bit(i)) {
+      *conflict = i;
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+  for (uint32_t i = start; i < end; i++)
+    old_clear_bit(i);
+  return ESP_OK;
+}
+
+static uint32_t old_scan() {
+  uint32_t runs = 0, start = 0;
+  while (start < NBITS) {
+    while (start < NBITS && old_test_bit(start))
+      start++;
+    uint32_t end = start;
+    while (end < NBITS && !old_test_bit(end))
+      end++;
+    if (end > start)
+      runs++;
+    start = end;
+  }
+  return runs;
+}
+
+static uint32_t old_count() {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < NBITS; i++)
+    n += old_test_bit(i);
+  return n;
+}
+
+static uint32_t new_scan() {
+  uint32_t runs = 0, start = 0;
+  while (start < NBITS) {
+    start = bitmap_find_clear(&bm, start, NBITS);
+    uint32_t end = bitmap_find_set(&bm, start, NBITS);
+    if (end > start)
+      runs++;
+    start = end;
+  }
+  return runs;
+}
+
+/*
+ * non-overlapping ranges with gaps, 2..600 blocks each, shuffled
+ */
+static void make_ranges() {
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  uint32_t pos = 0, n = 0;
+  while (n < RANGES) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    uint32_t len = 2 + x % 599;
+    uint32_t gap = (x >> 20) % 8;
+    if (pos + gap + len > NBITS)
+      pos = 0;
+    range_start[n] = pos + gap;
+    range_end[n] = pos + gap + len;
+    pos += gap + len;
+    n++;
+  }
+  // ranges wrap, keep only the first lap so they never overlap
+  for (n = 1; n < RANGES && range_start[n] > range_start[n - 1]; n++)
+    ;
+  for (uint32_t i = n; i < RANGES; i++) {
+    range_start[i] = range_start[i % n];
+    range_end[i] = range_end[i % n];
+  }
+}
+
+static void report(const char *what, uint64_t old_ns, uint64_t new_ns,
+                   uint32_t ops) {
+  printf("%-10s %12.1f %12.1f %8.1fx\n", what, (double)old_ns / ops,
+         (double)new_ns / ops, (double)old_ns / (new_ns ? new_ns : 1));
+}
+
+int main() {
+  uint32_t conflict;
+  uint64_t t, old_ns, new_ns;
+  volatile uint32_t sink = 0;
+  const int reps = 20;
+
+  make_ranges();
+  bitmap_init(&bm, words, NBITS);
+
+  printf("%-10s %12s %12s %9s\n", "op", "old(ns/op)", "new(ns/op)", "speedup");
+
+  // set/clear: every range is set then cleared
+  t = now_ns();
+  for (int r = 0; r < reps; r++) {
+    for (int i = 0; i < RANGES; i++) {
+      if (old_set_bits(range_start[i], range_end[i], &conflict) == ESP_OK)
+        old_clear_bits(range_start[i], range_end[i], &conflict);
+    }
+  }
+  old_ns = now_ns() - t;
+
+  t = now_ns();
+  for (int r = 0; r < reps; r++) {
+    for (int i = 0; i < RANGES; i++) {
+      if (bitmap_set_range(&bm, range_start[i], range_end[i], &conflict) ==
+          ESP_OK)
+        bitmap_clear_range(&bm, range_start[i], range_end[i], &conflict);
+    }
+  }
+  new_ns = now_ns() - t;
+  report("set+clear", old_ns, new_ns, reps * RANGES);
+
+  // fill half the ranges to get a fragmented map for scan and count
+  for (int i = 0; i < RANGES; i += 2) {
+    old_set_bits(range_start[i], range_end[i], &conflict);
+    bitmap_set_range(&bm, range_start[i], range_end[i], &conflict);
+  }
+
+  t = now_ns();
+  for (int r = 0; r < reps; r++)
+    sink += old_scan();
+  old_ns = now_ns() - t;
+
+  t = now_ns();
+  for (int r = 0; r < reps; r++)
+    sink += new_scan();
+  new_ns = now_ns() - t;
+  report("scan", old_ns, new_ns, reps);
+
+  if (old_scan() != new_scan() || old_count() != bitmap_used(&bm)) {
+    fprintf(stderr, "old and new bitmap disagree\n");
+    return 1;
+  }
+
+  t = now_ns();
+  for (int r = 0; r < reps; r++)
+    sink += old_count();
+  old_ns = now_ns() - t;
+
+  t = now_ns();
+  for (int r = 0; r < reps; r++)
+    sink += bitmap_count(&bm, 0, NBITS);
+  new_ns = now_ns() - t;
+  report("count", old_ns, new_ns, reps);
+
+  (void)sink;
+  return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * blkdev backend on a plain image file, for running mmcfs on a linux pc.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "blkdev_file.h"
+
+static const char *TAG = "blkdev_file";
+
+typedef struct {
+  int fd;
+  pthread_mutex_t lock;
+  blkdev_file_model_t model;
+  blkdev_file_stats_t stats;
+  bool erase_fill;
+} file_ctx_t;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t deadline) {
+  struct timespec ts = {
+      .tv_sec = deadline / 1000000,
+      .tv_nsec = (deadline % 1000000) * 1000,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static uint64_t model_cost_us(uint32_t latency_us, uint32_t kib_per_sec,
+                              size_t sector_count) {
+  uint64_t cost = latency_us;
+  if (kib_per_sec) {
+    cost += (uint64_t)sector_count * 512 * 1000000 / 1024 / kib_per_sec;
+  }
+  return cost;
+}
+
+static esp_err_t file_read(blkdev_t *dev, void *dst, size_t start_sector,
+                           size_t sector_count) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  esp_err_t err = ESP_OK;
+
+  if (start_sector + sector_count > dev->capacity)
+    return ESP_ERR_INVALID_SIZE;
+
+  pthread_mutex_lock(&ctx->lock);
+  uint64_t start = now_us();
+  uint64_t cost = model_cost_us(ctx->model.read_latency_us,
+                                ctx->model.read_kib_per_sec, sector_count);
+
+  size_t len = sector_count * 512;
+  ssize_t n = pread(ctx->fd, dst, len, (off_t)start_sector * 512);
+  if (n < 0) {
+    ESP_LOGE(TAG, "pread failed, %s", strerror(errno));
+    err = ESP_FAIL;
+  } else if ((size_t)n < len) {
+    // sparse tail, reads as zero
+    memset((uint8_t *)dst + n, 0, len - n);
+  }
+
+  if (cost)
+    sleep_until_us(start + cost);
+
+  ctx->stats.read_cmds++;
+  ctx->stats.sectors_read += sector_count;
+  ctx->stats.busy_us += cost ? cost : now_us() - start;
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+static esp_err_t file_write(blkdev_t *dev, const void *src,
+                            size_t start_sector, size_t sector_count) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  esp_err_t err = ESP_OK;
+
+  if (start_sector + sector_count > dev->capacity)
+    return ESP_ERR_INVALID_SIZE;
+
+  pthread_mutex_lock(&ctx->lock);
+  uint64_t start = now_us();
+  uint64_t cost = model_cost_us(ctx->model.write_latency_us,
+                                ctx->model.write_kib_per_sec, sector_count);
+
+  size_t len = sector_count * 512;
+  ssize_t n = pwrite(ctx->fd, src, len, (off_t)start_sector * 512);
+  if (n < 0 || (size_t)n != len) {
+    ESP_LOGE(TAG, "pwrite failed, %s", strerror(errno));
+    err = ESP_FAIL;
+  }
+
+  if (cost)
+    sleep_until_us(start + cost);
+
+  ctx->stats.write_cmds++;
+  ctx->stats.sectors_written += sector_count;
+  ctx->stats.busy_us += cost ? cost : now_us() - start;
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+/*
+ * costs time, the image is untouched unless erase_fill is set
+ */
+static esp_err_t file_erase(blkdev_t *dev, size_t start_sector,
+                            size_t sector_count) {
+  static uint8_t ones[64 * 1024];
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  esp_err_t err = ESP_OK;
+
+  if (start_sector + sector_count > dev->capacity)
+    return ESP_ERR_INVALID_SIZE;
+
+  pthread_mutex_lock(&ctx->lock);
+  uint64_t start = now_us();
+  uint64_t cost = model_cost_us(ctx->model.erase_latency_us,
+                                ctx->model.erase_kib_per_sec, sector_count);
+
+  if (ctx->erase_fill) {
+    memset(ones, 0xff, sizeof(ones));
+    for (size_t done = 0; done < sector_count && err == ESP_OK;) {
+      size_t n = sector_count - done < sizeof(ones) / 512
+                     ? sector_count - done
+                     : sizeof(ones) / 512;
+      off_t off = (off_t)(start_sector + done) * 512;
+      if (pwrite(ctx->fd, ones, n * 512, off) != (ssize_t)(n * 512)) {
+        ESP_LOGE(TAG, "pwrite failed, %s", strerror(errno));
+        err = ESP_FAIL;
+      }
+      done += n;
+    }
+  }
+
+  if (cost)
+    sleep_until_us(start + cost);
+
+  ctx->stats.erase_cmds++;
+  ctx->stats.sectors_erased += sector_count;
+  ctx->stats.busy_us += cost ? cost : now_us() - start;
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
+}
+
+blkdev_t *blkdev_file_open(const char *path, uint64_t capacity,
+                           const blkdev_file_model_t *model) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    ESP_LOGE(TAG, "failed to open %s, %s", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  if (capacity == 0) {
+    capacity = st.st_size / 512;
+  } else if ((uint64_t)st.st_size < capacity * 512) {
+    if (ftruncate(fd, capacity * 512) < 0) {
+      ESP_LOGE(TAG, "failed to grow %s, %s", path, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+  }
+
+  if (capacity == 0) {
+    ESP_LOGE(TAG, "%s is empty", path);
+    close(fd);
+    return NULL;
+  }
+
+  blkdev_t *dev = (blkdev_t *)calloc(1, sizeof(blkdev_t));
+  file_ctx_t *ctx = (file_ctx_t *)calloc(1, sizeof(file_ctx_t));
+  if (dev == NULL || ctx == NULL) {
+    free(dev);
+    free(ctx);
+    close(fd);
+    return NULL;
+  }
+
+  ctx->fd = fd;
+  pthread_mutex_init(&ctx->lock, NULL);
+  if (model)
+    ctx->model = *model;
+
+  dev->name = "file";
+  dev->capacity = capacity;
+  dev->read = file_read;
+  dev->write = file_write;
+  dev->erase = file_erase;
+  dev->ctx = ctx;
+
+  ESP_LOGI(TAG, "%s opened, %llu sectors (%lluMiB)", path,
+           (unsigned long long)capacity,
+           (unsigned long long)capacity / 2048);
+  return dev;
+}
+
+void blkdev_file_close(blkdev_t *dev) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  close(ctx->fd);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+  free(dev);
+}
+
+void blkdev_file_set_model(blkdev_t *dev, const blkdev_file_model_t *model) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  if (model) {
+    ctx->model = *model;
+  } else {
+    memset(&ctx->model, 0, sizeof(ctx->model));
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+void blkdev_file_get_stats(blkdev_t *dev, blkdev_file_stats_t *stats) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  *stats = ctx->stats;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+void blkdev_file_reset_stats(blkdev_t *dev) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+void blkdev_file_set_erase_fill(blkdev_t *dev, bool fill) {
+  file_ctx_t *ctx = (file_ctx_t *)dev->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  ctx->erase_fill = fill;
+  pthread_mutex_unlock(&ctx->lock);
+}
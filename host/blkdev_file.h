@@ -0,0 +1,58 @@
+#ifndef HOST_BLKDEV_FILE_H
+#define HOST_BLKDEV_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blkdev.h"
+
+/*
+ * timing model of the emulated card. Each command costs
+ *
+ *   latency_us + bytes / bandwidth
+ *
+ * and commands are serialized, as they are on the sdmmc bus. Zeros mean
+ * "as fast as the image file allows".
+ */
+typedef struct {
+  uint32_t read_latency_us;
+  uint32_t write_latency_us;
+  uint32_t read_kib_per_sec;
+  uint32_t write_kib_per_sec;
+  uint32_t erase_latency_us;
+  uint32_t erase_kib_per_sec;
+} blkdev_file_model_t;
+
+typedef struct {
+  uint64_t read_cmds;
+  uint64_t write_cmds;
+  uint64_t sectors_read;
+  uint64_t sectors_written;
+  uint64_t erase_cmds;
+  uint64_t sectors_erased;
+
+  /* time the emulated card is busy, in microseconds */
+  uint64_t busy_us;
+} blkdev_file_stats_t;
+
+/*
+ * open (or create) an image file. If capacity (in sectors) is non-zero, the
+ * file is grown (sparse) to that size, otherwise file size is used.
+ * model could be NULL.
+ */
+blkdev_t *blkdev_file_open(const char *path, uint64_t capacity,
+                           const blkdev_file_model_t *model);
+void blkdev_file_close(blkdev_t *dev);
+
+void blkdev_file_set_model(blkdev_t *dev, const blkdev_file_model_t *model);
+void blkdev_file_get_stats(blkdev_t *dev, blkdev_file_stats_t *stats);
+void blkdev_file_reset_stats(blkdev_t *dev);
+
+/*
+ * erase only costs time and is counted. With fill set, erased sectors are
+ * overwritten with 0xff (as some cards read them back), so a test can tell
+ * if live data was erased.
+ */
+void blkdev_file_set_erase_fill(blkdev_t *dev, bool fill);
+
+#endif
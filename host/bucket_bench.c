@@ -0,0 +1,194 @@
+/*
+ * bucket table benchmark: how full the table gets before a file has to be
+ * poured out of a full bucket, and what lookups cost, with files placed in
+ * their first choice bucket only (as older firmware did) and in the emptier
+ * of two, and with and without the digest filter. Then a PLAY tracklist is
+ * looked up track by track and in one batch, with a cold bucket cache.
+ *
+ * Tracks are tiny (a few bytes of mp3, one pcm frame), so the card never
+ * fills and only the bucket table limits what is cached.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+
+#define IMAGE "/tmp/mmcfs_bucket_bench.img"
+#define IMAGE_MIB 512
+
+#define BUCKETS 4096
+#define LOOKUPS 20000
+#define TRACKLIST 200
+
+// a typical card, for the tracklist
+static const blkdev_file_model_t card = {.read_latency_us = 300,
+                                         .read_kib_per_sec = 20000};
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void track_digest(uint32_t id, md5_digest_t *digest) {
+  md5_context_t ctx;
+  esp_rom_md5_init(&ctx);
+  esp_rom_md5_update(&ctx, (uint8_t *)&id, sizeof(id));
+  esp_rom_md5_final(digest->bytes, &ctx);
+}
+
+static void cache_track(uint32_t id) {
+  static uint32_t frame[FRAME_BUF_SIZE / 4];
+  mmcfs_file_handle_t file;
+  md5_digest_t digest;
+
+  track_digest(id, &digest);
+  assert(mmcfs_create_file(&digest, sizeof(id), &file) == 0);
+  assert(mmcfs_write_mp3(file, (char *)&id, sizeof(id)) == 0);
+  frame[0] = id; // pcm digests differ too
+  assert(mmcfs_write_pcm(file, (char *)frame, FRAME_BUF_SIZE) == 0);
+  assert(mmcfs_commit_file(file) == 0);
+}
+
+/*
+ * LOOKUPS stats of tracks in [first, first + span), per lookup cost
+ */
+static void lookups(uint32_t first, uint32_t span, bool hit, const char *name) {
+  mmcfs_stats_t before, after;
+  uint64_t rng = 0x2545f4914f6cdd1dULL;
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+
+  mmcfs_get_stats(&before);
+  uint64_t t = now_us();
+  for (int i = 0; i < LOOKUPS; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    track_digest(first + rng % span, &digest);
+    int ret = mmcfs_stat(&digest, &finfo);
+    assert(hit ? ret == 0 : ret < 0);
+  }
+  uint64_t us = now_us() - t;
+  mmcfs_get_stats(&after);
+
+  // a stat looks up the mp3, and the pcm if found
+  uint32_t n = after.bucket_lookups - before.bucket_lookups;
+  printf("  %s: %.1f us per stat, %.2f buckets searched and %.2f read from "
+         "card per lookup, %.2f%% false positives\n",
+         name, (double)us / LOOKUPS,
+         (double)(after.bucket_probes - before.bucket_probes) / n,
+         (double)(after.bucket_cache_misses - before.bucket_cache_misses) / n,
+         100.0 * (after.filter_false - before.filter_false) / n);
+}
+
+/*
+ * remount (bucket cache cold), wait for the filter if there is one
+ */
+static void remount(blkdev_t *dev, bool no_filter) {
+  mmcfs_stats_t ms;
+
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+  do {
+    usleep(1000);
+    mmcfs_get_stats(&ms);
+  } while (!no_filter && !ms.filter_ready);
+}
+
+/*
+ * tracklist of TRACKLIST tracks, every other one cached
+ */
+static void tracklist(blkdev_t *dev, uint32_t tracks, bool no_filter,
+                      bool batch) {
+  static md5_digest_t digests[TRACKLIST];
+  static mmcfs_finfo_t finfo[TRACKLIST];
+  blkdev_file_stats_t before, after;
+
+  for (int i = 0; i < TRACKLIST; i++) {
+    uint32_t id = i * 7919u % (tracks / 2);
+    track_digest(i % 2 ? id : id + tracks + 1000000, &digests[i]);
+  }
+
+  remount(dev, no_filter);
+  blkdev_file_set_model(dev, &card);
+  blkdev_file_get_stats(dev, &before);
+  int cached = 0;
+  if (batch) {
+    cached = mmcfs_stat_many(digests, TRACKLIST, finfo);
+  } else {
+    for (int i = 0; i < TRACKLIST; i++) {
+      if (mmcfs_stat(&digests[i], &finfo[i]) == 0)
+        cached++;
+    }
+  }
+  blkdev_file_get_stats(dev, &after);
+  blkdev_file_set_model(dev, NULL);
+
+  assert(cached == TRACKLIST / 2);
+  for (int i = 0; i < TRACKLIST; i++) {
+    assert(finfo[i].mp3_state == (i % 2 ? 2 : 0));
+    assert(finfo[i].pcm_state == (i % 2 ? 2 : 0));
+  }
+  printf("  tracklist %s: %llu reads, %llu sectors, %.1f ms card busy\n",
+         batch ? "batch" : "stat ",
+         (unsigned long long)(after.read_cmds - before.read_cmds),
+         (unsigned long long)(after.sectors_read - before.sectors_read),
+         (after.busy_us - before.busy_us) / 1000.0);
+}
+
+static void run(bool one_choice, bool no_filter) {
+  mmcfs_stats_t ms;
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  mmcfs_mount_opts_t opts = {.one_choice = one_choice,
+                            .no_filter = no_filter};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+
+  // till the first pour
+  uint32_t tracks = 0;
+  do {
+    cache_track(tracks++);
+    mmcfs_get_stats(&ms);
+  } while (ms.bucket_pours == 0);
+
+  int max_files = sizeof(mmcfs_bucket_t) / sizeof(mmcfs_file_t);
+  uint32_t files = 2 * (tracks - 1);
+  printf("%s, %s: first pour at %u tracks, %u files, %.1f%% of %u slots; "
+         "%.1f%% in second choice\n",
+         one_choice ? "one choice" : "two choices",
+         no_filter ? "no filter" : "filter", tracks, files,
+         100.0 * files / (BUCKETS * max_files), BUCKETS * max_files,
+         100.0 * ms.bucket_second / (2 * tracks));
+
+  // tracks cached before the pour are all there, bar the one poured
+  lookups(0, tracks / 2, true, "hit ");
+  lookups(tracks + 1000000, 1000000, false, "miss");
+  tracklist(dev, tracks, no_filter, false);
+  tracklist(dev, tracks, no_filter, true);
+
+  mmcfs_unmount();
+  mmcfs_set_mount_opts(NULL);
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+  run(true, true);
+  run(false, true);
+  run(false, false);
+  return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * FreeRTOS on pthreads, for the host build. Only what mmcfs uses: tasks
+ * that delete themselves, queues and semaphores with timeouts.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+struct host_task {
+  pthread_t thread;
+  TaskFunction_t fn;
+  void *param;
+  UBaseType_t priority;
+  char name[16];
+};
+
+/*
+ * task blocked on a semaphore. As on FreeRTOS, a semaphore given while tasks
+ * wait is handed to the highest priority one (the longest waiting among
+ * equals), a running task can't take it back first.
+ */
+struct sem_waiter {
+  pthread_cond_t cond;
+  UBaseType_t priority;
+  bool granted;
+  struct sem_waiter *next;
+};
+
+/*
+ * semaphores are queues with item_size 0, only count matters
+ */
+struct host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t count;
+  UBaseType_t head;
+  uint8_t *items;
+  struct sem_waiter *waiters; // by priority, semaphores only
+};
+
+static __thread struct host_task *current_task = NULL;
+
+int64_t esp_timer_get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *task_entry(void *arg) {
+  current_task = (struct host_task *)arg;
+  current_task->fn(current_task->param);
+  // returning from a task function is a bug in FreeRTOS, tolerated here
+  vTaskDelete(NULL);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name,
+                       const uint32_t stack_depth, void *const param,
+                       UBaseType_t priority, TaskHandle_t *const created) {
+  (void)stack_depth;
+
+  struct host_task *task =
+      (struct host_task *)calloc(1, sizeof(struct host_task));
+  if (task == NULL)
+    return pdFAIL;
+
+  task->fn = fn;
+  task->param = param;
+  task->priority = priority;
+  strncpy(task->name, name ? name : "", sizeof(task->name) - 1);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&task->thread, &attr, task_entry, task);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    free(task);
+    return pdFAIL;
+  }
+
+  if (created)
+    *created = task;
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task != NULL && task != current_task)
+    abort();
+
+  free(current_task);
+  current_task = NULL;
+  pthread_exit(NULL);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+  if (task == NULL)
+    task = current_task;
+  return task ? task->priority : 1;
+}
+
+void vTaskDelay(const TickType_t ticks) {
+  struct timespec ts = {
+      .tv_sec = ticks * portTICK_PERIOD_MS / 1000,
+      .tv_nsec = (long)(ticks * portTICK_PERIOD_MS % 1000) * 1000000,
+  };
+  nanosleep(&ts, NULL);
+}
+
+char *pcTaskGetName(TaskHandle_t task) {
+  if (task == NULL)
+    task = current_task;
+  return task ? task->name : "host";
+}
+
+QueueHandle_t xQueueGenericCreate(UBaseType_t length, UBaseType_t item_size,
+                                  UBaseType_t initial_count) {
+  struct host_queue *q =
+      (struct host_queue *)calloc(1, sizeof(struct host_queue));
+  if (q == NULL)
+    return NULL;
+
+  if (item_size) {
+    q->items = (uint8_t *)malloc(length * item_size);
+    if (q->items == NULL) {
+      free(q);
+      return NULL;
+    }
+  }
+
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&q->not_empty, &attr);
+  pthread_cond_init(&q->not_full, &attr);
+  pthread_condattr_destroy(&attr);
+
+  q->length = length;
+  q->item_size = item_size;
+  q->count = initial_count;
+  return q;
+}
+
+void vQueueDelete(QueueHandle_t q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q->items);
+  free(q);
+}
+
+/*
+ * wait on cond until pred holds or ticks run out, q->lock held. Returns
+ * false on timeout.
+ */
+static bool wait_until(struct host_queue *q, pthread_cond_t *cond,
+                       TickType_t ticks, bool (*pred)(struct host_queue *)) {
+  if (pred(q))
+    return true;
+  if (ticks == 0)
+    return false;
+
+  if (ticks == portMAX_DELAY) {
+    while (!pred(q))
+      pthread_cond_wait(cond, &q->lock);
+    return true;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t ns = (uint64_t)ticks * portTICK_PERIOD_MS * 1000000 + ts.tv_nsec;
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+
+  while (!pred(q)) {
+    if (pthread_cond_timedwait(cond, &q->lock, &ts) == ETIMEDOUT)
+      return pred(q);
+  }
+  return true;
+}
+
+static bool has_space(struct host_queue *q) { return q->count < q->length; }
+static bool has_item(struct host_queue *q) { return q->count > 0; }
+
+BaseType_t xQueueGenericSend(QueueHandle_t q, const void *item,
+                             TickType_t ticks, BaseType_t front) {
+  pthread_mutex_lock(&q->lock);
+  if (q->waiters) {
+    struct sem_waiter *w = q->waiters;
+    q->waiters = w->next;
+    w->granted = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+  }
+
+  if (!wait_until(q, &q->not_full, ticks, has_space)) {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+
+  if (q->item_size) {
+    UBaseType_t slot;
+    if (front) {
+      q->head = (q->head + q->length - 1) % q->length;
+      slot = q->head;
+    } else {
+      slot = (q->head + q->count) % q->length;
+    }
+    memcpy(&q->items[slot * q->item_size], item, q->item_size);
+  }
+  q->count++;
+
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+static BaseType_t sem_take(struct host_queue *q, TickType_t ticks) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0 || ticks == 0) {
+    BaseType_t ret = q->count > 0 ? pdTRUE : pdFALSE;
+    if (ret) {
+      q->count--;
+      pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+  }
+
+  struct sem_waiter w = {.priority = uxTaskPriorityGet(NULL)};
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w.cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  struct sem_waiter **p = &q->waiters;
+  while (*p && (*p)->priority >= w.priority)
+    p = &(*p)->next;
+  w.next = *p;
+  *p = &w;
+
+  struct timespec ts;
+  if (ticks != portMAX_DELAY) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ticks * portTICK_PERIOD_MS * 1000000 + ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+  }
+
+  while (!w.granted) {
+    if (ticks == portMAX_DELAY) {
+      pthread_cond_wait(&w.cond, &q->lock);
+    } else if (pthread_cond_timedwait(&w.cond, &q->lock, &ts) == ETIMEDOUT) {
+      break;
+    }
+  }
+
+  if (!w.granted) {
+    for (p = &q->waiters; *p != &w; p = &(*p)->next)
+      ;
+    *p = w.next;
+  }
+
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_unlock(&q->lock);
+  return w.granted ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *buf, TickType_t ticks) {
+  if (q->item_size == 0)
+    return sem_take(q, ticks);
+
+  pthread_mutex_lock(&q->lock);
+  if (!wait_until(q, &q->not_empty, ticks, has_item)) {
+    pthread_mutex_unlock(&q->lock);
+    return pdFALSE;
+  }
+
+  if (q->item_size) {
+    memcpy(buf, &q->items[q->head * q->item_size], q->item_size);
+    q->head = (q->head + 1) % q->length;
+  }
+  q->count--;
+
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+  pthread_mutex_lock(&q->lock);
+  UBaseType_t count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
@@ -0,0 +1,69 @@
+/*
+ * host port glue: the bits of esp-idf and the rest of the firmware that
+ * mmcfs.c links against. FreeRTOS is in freertos_port.c.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "roadhill.h"
+
+esp_log_level_t host_log_level = ESP_LOG_INFO;
+bool host_dma_exhausted = false;
+
+const char hex_char[16] = "0123456789abcdef";
+
+void host_log(esp_log_level_t level, const char *tag, const char *fmt, ...) {
+  static const char letter[] = "NEWIDV";
+  va_list ap;
+
+  if (level > host_log_level)
+    return;
+
+  fprintf(stderr, "%c (%s) ", letter[level], tag);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_INVALID_RESPONSE:
+    return "ESP_ERR_INVALID_RESPONSE";
+  case ESP_ERR_INVALID_CRC:
+    return "ESP_ERR_INVALID_CRC";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+void sprint_md5_digest(const md5_digest_t *digest, char *buf, int trunc) {
+  int i;
+  for (i = 0; i < (trunc == 0 ? 16 : trunc); i++) {
+    buf[2 * i + 0] = hex_char[digest->bytes[i] / 16];
+    buf[2 * i + 1] = hex_char[digest->bytes[i] % 16];
+  }
+  buf[2 * i] = '\0';
+}
@@ -0,0 +1,10 @@
+#ifndef HOST_AUDIO_COMMON_H
+#define HOST_AUDIO_COMMON_H
+
+/*
+ * host shim of esp-adf audio_common.h, only constants referenced by
+ * roadhill.h.
+ */
+#define AUDIO_ELEMENT_TYPE_PERIPH (0x20000)
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+/*
+ * host shim of esp-idf esp_heap_caps.h. There is only one kind of memory on
+ * a pc, caps are ignored but for running out of dma capable memory.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_EXEC (1 << 0)
+#define MALLOC_CAP_32BIT (1 << 1)
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+// tests only, dma capable allocations fail while set
+extern bool host_dma_exhausted;
+
+// as the esp heap, nothing for 0 bytes
+static inline void *heap_caps_malloc(size_t size, unsigned int caps) {
+  if (size == 0 || ((caps & MALLOC_CAP_DMA) && host_dma_exhausted))
+    return NULL;
+  return malloc(size);
+}
+
+static inline void *heap_caps_calloc(size_t n, size_t size,
+                                     unsigned int caps) {
+  if ((caps & MALLOC_CAP_DMA) && host_dma_exhausted)
+    return NULL;
+  return calloc(n, size);
+}
+
+static inline void heap_caps_free(void *ptr) { free(ptr); }
+
+#endif
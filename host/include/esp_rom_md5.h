@@ -0,0 +1,21 @@
+#ifndef HOST_ESP_ROM_MD5_H
+#define HOST_ESP_ROM_MD5_H
+
+/*
+ * host shim of esp-idf esp_rom_md5.h, implemented in host/md5.c
+ */
+#include <stdint.h>
+
+typedef struct MD5Context {
+  uint32_t buf[4];
+  uint32_t bits[2];
+  uint8_t in[64];
+} md5_context_t;
+
+#define ESP_ROM_MD5_DIGEST_LEN 16
+
+void esp_rom_md5_init(md5_context_t *context);
+void esp_rom_md5_update(md5_context_t *context, const void *buf, uint32_t len);
+void esp_rom_md5_final(uint8_t *digest, md5_context_t *context);
+
+#endif
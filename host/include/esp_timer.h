@@ -0,0 +1,12 @@
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+/*
+ * host shim of esp-idf esp_timer.h, only the clock.
+ */
+#include <stdint.h>
+
+/* microseconds, monotonic */
+int64_t esp_timer_get_time(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef HOST_FREERTOS_QUEUE_H
+#define HOST_FREERTOS_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+
+/*
+ * item_size 0 makes a semaphore, see semphr.h
+ */
+QueueHandle_t xQueueGenericCreate(UBaseType_t length, UBaseType_t item_size,
+                                  UBaseType_t initial_count);
+void vQueueDelete(QueueHandle_t queue);
+
+BaseType_t xQueueGenericSend(QueueHandle_t queue, const void *item,
+                             TickType_t ticks, BaseType_t front);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buf, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#define xQueueCreate(length, item_size)                                        \
+  xQueueGenericCreate((length), (item_size), 0)
+#define xQueueSend(queue, item, ticks)                                         \
+  xQueueGenericSend((queue), (item), (ticks), pdFALSE)
+#define xQueueSendToBack(queue, item, ticks)                                   \
+  xQueueGenericSend((queue), (item), (ticks), pdFALSE)
+#define xQueueSendToFront(queue, item, ticks)                                  \
+  xQueueGenericSend((queue), (item), (ticks), pdTRUE)
+
+#endif
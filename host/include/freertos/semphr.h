@@ -0,0 +1,20 @@
+#ifndef HOST_FREERTOS_SEMPHR_H
+#define HOST_FREERTOS_SEMPHR_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+/*
+ * a semaphore given while tasks wait goes to the highest priority one, as on
+ * FreeRTOS. Mutexes are not recursive and have no priority inheritance.
+ */
+#define xSemaphoreCreateBinary() xQueueGenericCreate(1, 0, 0)
+#define xSemaphoreCreateMutex() xQueueGenericCreate(1, 0, 1)
+#define xSemaphoreCreateCounting(max, initial)                                 \
+  xQueueGenericCreate((max), 0, (initial))
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
+
+#define xSemaphoreTake(sem, ticks) xQueueReceive((sem), NULL, (ticks))
+#define xSemaphoreGive(sem) xQueueGenericSend((sem), NULL, 0, pdFALSE)
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+
+/* stack depth and priority are ignored */
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name,
+                       const uint32_t stack_depth, void *const param,
+                       UBaseType_t priority, TaskHandle_t *const created);
+
+/* only vTaskDelete(NULL), deleting the calling task, is supported */
+void vTaskDelete(TaskHandle_t task);
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+
+void vTaskDelay(const TickType_t ticks);
+char *pcTaskGetName(TaskHandle_t task);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+/*
+ * host shim of the generated sdkconfig.h, mmcfs options only. Values follow
+ * the defaults in main/Kconfig.projbuild.
+ */
+#define CONFIG_MMCFS_BUCKET_CACHE_SIZE 32
+#define CONFIG_MMCFS_PCM_READAHEAD_FRAMES 4
+#define CONFIG_MMCFS_MP3_READAHEAD_KB 32
+#define CONFIG_MMCFS_WRITE_COMBINE_KB 32
+#define CONFIG_MMCFS_IOBUF_POOL_SIZE 2
+#define CONFIG_MMCFS_MAX_OPEN_FILES 4
+#define CONFIG_MMCFS_LRU_INDEX_SIZE 2048
+#define CONFIG_MMCFS_COMPACT_KBPS 1024
+#define CONFIG_MMCFS_PCM_CHUNK_KB 4096
+#define CONFIG_MMCFS_DIGEST_FILTER 1
+#define CONFIG_MMCFS_DISCARD 1
+#define CONFIG_MMCFS_DISCARD_KB 4096
+#define CONFIG_MMCFS_DISCARD_CHUNK_KB 256
+#define CONFIG_MMCFS_DISCARD_PLAYING_MS 1000
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef HOST_SOC_MEMORY_LAYOUT_H
+#define HOST_SOC_MEMORY_LAYOUT_H
+
+/*
+ * host shim of esp-idf soc/soc_memory_layout.h. Any memory can be read and
+ * written by the file backend.
+ */
+#include <stdbool.h>
+
+static inline bool esp_ptr_dma_capable(const void *p) {
+  (void)p;
+  return true;
+}
+
+#endif
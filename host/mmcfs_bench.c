@@ -0,0 +1,488 @@
+/*
+ * mmcfs benchmark on an image file.
+ *
+ * It replays a cache workload similar to what the device sees: a stream of
+ * tracks, some of them new (stat miss, create, write mp3, write pcm, commit)
+ * and some of them replayed from the cache (stat hit, pcm_read frames). New
+ * tracks keep arriving after the card is full, so the numbers include
+ * allocation failures and evictions.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "falloc.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+
+typedef enum {
+  OP_STAT,
+  OP_CREATE,
+  OP_WRITE_MP3,
+  OP_WRITE_PCM,
+  OP_COMMIT,
+  OP_PCM_READ,
+  OP_MAX,
+} op_t;
+
+static const char *op_name[OP_MAX] = {
+    "stat", "create", "write_mp3", "write_pcm", "commit", "pcm_read",
+};
+
+typedef struct {
+  uint32_t *samples;
+  size_t count;
+  size_t cap;
+  uint64_t total_us;
+  uint64_t bytes;
+  uint64_t errors;
+} op_stat_t;
+
+static op_stat_t ops[OP_MAX];
+
+// card commands issued by successful commits
+static blkdev_t *bench_dev;
+static uint32_t commits;
+static uint64_t commit_reads;
+static uint64_t commit_writes;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void op_record(op_t op, uint64_t us, size_t bytes, int ret) {
+  op_stat_t *s = &ops[op];
+  if (s->count == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->samples = (uint32_t *)realloc(s->samples, s->cap * sizeof(uint32_t));
+  }
+  s->samples[s->count++] = us;
+  s->total_us += us;
+  s->bytes += bytes;
+  if (ret < 0)
+    s->errors++;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const op_stat_t *s, double p) {
+  if (s->count == 0)
+    return 0;
+  size_t i = (size_t)(p * (s->count - 1) + 0.5);
+  return s->samples[i];
+}
+
+/*
+ * upper bound of the latency p of calls fall under, from the histogram
+ */
+static uint32_t hist_bound(const mmcfs_op_stats_t *o, double p) {
+  uint32_t n = 0;
+  for (int k = 0; k < MMCFS_OP_HIST_SIZE - 1; k++) {
+    n += o->hist[k];
+    if (n >= p * o->count)
+      return (16u << k) < o->max_us ? 16u << k : o->max_us;
+  }
+  return o->max_us;
+}
+
+/*
+ * cache_track, each op timed
+ */
+static int cache_timed(uint32_t id, uint32_t size, const md5_digest_t *digest) {
+  static uint8_t buf[PIC_BLOCK_SIZE];
+  static uint8_t frame[FRAME_BUF_SIZE];
+  mmcfs_file_handle_t file;
+  md5_digest_t d = *digest;
+  uint64_t t;
+  int ret;
+
+  t = now_us();
+  ret = mmcfs_create_file(&d, size, &file);
+  op_record(OP_CREATE, now_us() - t, 0, ret);
+  if (ret < 0)
+    return ret;
+
+  for (uint32_t off = 0; off < size; off += PIC_BLOCK_SIZE) {
+    uint32_t len = size - off < PIC_BLOCK_SIZE ? size - off : PIC_BLOCK_SIZE;
+    fill_track_data(id, off, buf, len);
+    t = now_us();
+    ret = mmcfs_write_mp3(file, (char *)buf, len);
+    op_record(OP_WRITE_MP3, now_us() - t, len, ret);
+    if (ret < 0)
+      return ret;
+  }
+
+  uint32_t frames = track_frames(size);
+  for (uint32_t i = 0; i < frames; i++) {
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, frame,
+                    FRAME_BUF_SIZE);
+    t = now_us();
+    ret = mmcfs_write_pcm(file, (char *)frame, FRAME_BUF_SIZE);
+    op_record(OP_WRITE_PCM, now_us() - t, FRAME_BUF_SIZE, ret);
+    if (ret < 0)
+      return ret;
+  }
+
+  blkdev_file_stats_t before, after;
+  blkdev_file_get_stats(bench_dev, &before);
+  t = now_us();
+  ret = mmcfs_commit_file(file);
+  op_record(OP_COMMIT, now_us() - t, 0, ret);
+  blkdev_file_get_stats(bench_dev, &after);
+  if (ret == 0) {
+    commits++;
+    commit_reads += after.read_cmds - before.read_cmds;
+    commit_writes += after.write_cmds - before.write_cmds;
+  }
+  return ret;
+}
+
+static void play_track(uint32_t size, const md5_digest_t *digest,
+                       uint32_t max_frames) {
+  static char buf[FRAME_BUF_SIZE];
+  uint32_t frames = track_frames(size);
+  if (frames > max_frames)
+    frames = max_frames;
+
+  for (uint32_t i = 0; i < frames; i++) {
+    uint64_t t = now_us();
+    mmcfs_pcm_mix(digest, i, NULL, NULL, 0, NULL, buf);
+    op_record(OP_PCM_READ, now_us() - t, FRAME_BUF_SIZE, 0);
+  }
+}
+
+/*
+ * read the mp3 of the last `count` tracks played back from card, in reads of
+ * the size the mp3 decoder asks for, as transcoding them again would
+ */
+static void reread_mp3(blkdev_t *dev, const uint32_t *played,
+                       uint32_t played_count, uint32_t count) {
+  static char buf[2048];
+  blkdev_file_stats_t before, after;
+  uint32_t files = 0, errors = 0;
+  uint64_t bytes = 0;
+
+  blkdev_file_get_stats(dev, &before);
+  uint64_t start = now_us();
+  for (uint32_t i = 0; i < played_count && files + errors < count; i++) {
+    uint32_t id = played[played_count - 1 - i];
+    md5_digest_t digest;
+    track_md5(id, track_size(id), &digest);
+
+    mmcfs_mp3_handle_t h;
+    if (mmcfs_mp3_open(&digest, &h) < 0)
+      continue; // reclaimed
+    int ret;
+    while ((ret = mmcfs_mp3_read(h, buf, sizeof(buf))) > 0)
+      bytes += ret;
+    mmcfs_mp3_close(h);
+    if (ret < 0)
+      errors++;
+    else
+      files++;
+  }
+  uint64_t us = now_us() - start;
+  blkdev_file_get_stats(dev, &after);
+
+  printf("mp3 reread: %u files, %u errors, %.1f MiB, %.1f MiB/s, "
+         "%.1f reads per MiB, card busy %.1f ms\n",
+         files, errors, bytes / 1048576.0,
+         us ? bytes / 1048576.0 / (us / 1e6) : 0,
+         bytes ? (after.read_cmds - before.read_cmds) / (bytes / 1048576.0) : 0,
+         (after.busy_us - before.busy_us) / 1000.0);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -f path    image file (default /tmp/mmcfs_bench.img)\n"
+          "  -s MiB     image size (default 2048)\n"
+          "  -n count   tracks played (default 200)\n"
+          "  -a KiB     min mp3 size (default 256)\n"
+          "  -b KiB     max mp3 size (default 1536)\n"
+          "  -p pct     chance a track is a replay of a cached one "
+          "(default 50)\n"
+          "  -F frames  max frames read per replay (default 250)\n"
+          "  -r us      read command latency (default 0)\n"
+          "  -w us      write command latency (default 0)\n"
+          "  -R KiB/s   read bandwidth (default unlimited)\n"
+          "  -W KiB/s   write bandwidth (default unlimited)\n"
+          "  -k         keep existing image (do not reformat)\n"
+          "  -S         scan buckets at mount even if checkpoint is clean\n"
+          "  -Q         sequential bucket scan (no read/parse overlap)\n"
+          "  -C us      extra cpu time per 16KiB of buckets parsed at mount "
+          "(default 0)\n"
+          "  -c KiB/s   run the compaction task, copying this fast "
+          "(default off)\n"
+          "  -t count   read back the mp3 of this many tracks played last "
+          "(default 20)\n"
+          "  -v         verbose mmcfs log\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  const char *path = "/tmp/mmcfs_bench.img";
+  uint64_t size_mib = 2048;
+  uint32_t count = 200;
+  uint32_t min_kib = 256, max_kib = 1536;
+  uint32_t replay_pct = 50;
+  uint32_t max_frames = 250;
+  bool keep = false;
+  uint32_t compact_kbps = 0;
+  uint32_t reread = 20;
+  mmcfs_mount_opts_t mount_opts = {0};
+  blkdev_file_model_t model = {0};
+  int opt;
+
+  host_log_level = ESP_LOG_WARN;
+
+  while ((opt = getopt(argc, argv, "f:s:n:a:b:p:F:r:w:R:W:kSQC:c:t:vh")) !=
+         -1) {
+    switch (opt) {
+    case 'f':
+      path = optarg;
+      break;
+    case 's':
+      size_mib = strtoull(optarg, NULL, 0);
+      break;
+    case 'n':
+      count = strtoul(optarg, NULL, 0);
+      break;
+    case 'a':
+      min_kib = strtoul(optarg, NULL, 0);
+      break;
+    case 'b':
+      max_kib = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      replay_pct = strtoul(optarg, NULL, 0);
+      break;
+    case 'F':
+      max_frames = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      model.read_latency_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      model.write_latency_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      model.read_kib_per_sec = strtoul(optarg, NULL, 0);
+      break;
+    case 'W':
+      model.write_kib_per_sec = strtoul(optarg, NULL, 0);
+      break;
+    case 'k':
+      keep = true;
+      break;
+    case 'S':
+      mount_opts.force_scan = true;
+      break;
+    case 'Q':
+      mount_opts.sequential_scan = true;
+      break;
+    case 'C':
+      mount_opts.scan_parse_cost_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      compact_kbps = strtoul(optarg, NULL, 0);
+      break;
+    case 't':
+      reread = strtoul(optarg, NULL, 0);
+      break;
+    case 'v':
+      host_log_level = ESP_LOG_INFO;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (min_kib == 0 || max_kib < min_kib) {
+    usage(argv[0]);
+    return 1;
+  }
+  tracks_init(min_kib, max_kib, false);
+
+  if (!keep)
+    unlink(path);
+
+  // mount time is measured with the device model in place
+  blkdev_t *dev = blkdev_file_open(path, size_mib * 2048, &model);
+  if (dev == NULL)
+    return 1;
+  bench_dev = dev;
+
+  mmcfs_set_mount_opts(&mount_opts);
+  if (mmcfs_mount(dev) != ESP_OK) {
+    fprintf(stderr, "mount failed\n");
+    return 1;
+  }
+
+  mmcfs_stats_t ms;
+  mmcfs_get_stats(&ms);
+  if (ms.mount_scanned) {
+    printf("mount: %.1f ms, %s scan %.1f ms (read wait %.1f ms, parse "
+           "%.1f ms)\n",
+           ms.mount_us / 1000.0,
+           mount_opts.sequential_scan ? "sequential" : "pipelined",
+           ms.scan_us / 1000.0, ms.scan_read_us / 1000.0,
+           ms.scan_parse_us / 1000.0);
+  } else {
+    printf("mount: %.1f ms, from checkpoint\n", ms.mount_us / 1000.0);
+  }
+
+  blkdev_file_reset_stats(dev);
+  if (compact_kbps && mmcfs_compact_start(compact_kbps) != ESP_OK) {
+    fprintf(stderr, "compaction not started\n");
+    return 1;
+  }
+
+  uint32_t *played = (uint32_t *)malloc(count * sizeof(uint32_t));
+  uint32_t played_count = 0;
+  uint32_t next_id = 0;
+  uint32_t hits = 0, misses = 0, failures = 0;
+  uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+  uint64_t t, start = now_us();
+  for (uint32_t i = 0; i < count; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    // replays favour recent tracks
+    uint32_t id;
+    if (played_count && rng % 100 < replay_pct) {
+      uint32_t back = (rng >> 8) % played_count;
+      back = back * back / played_count;
+      id = played[played_count - 1 - back];
+    } else {
+      id = next_id++;
+      played[played_count++] = id;
+    }
+
+    uint32_t size = track_size(id);
+    md5_digest_t digest;
+    track_md5(id, size, &digest);
+
+    mmcfs_finfo_t finfo;
+    t = now_us();
+    int ret = mmcfs_stat(&digest, &finfo);
+    op_record(OP_STAT, now_us() - t, 0, 0);
+
+    if (ret == 0 && finfo.pcm_state == 2) {
+      hits++;
+      play_track(size, &digest, max_frames);
+    } else {
+      misses++;
+      if (cache_timed(id, size, &digest) < 0)
+        failures++;
+    }
+  }
+  uint64_t elapsed = now_us() - start;
+
+  blkdev_file_stats_t ds;
+  blkdev_file_get_stats(dev, &ds);
+
+  printf("tracks: %u, hits: %u, misses: %u, failed to cache: %u, "
+         "%.1f s\n",
+         count, hits, misses, failures, elapsed / 1e6);
+  printf("%-10s %8s %8s %10s %9s %9s %9s %9s\n", "op", "count", "errors",
+         "MiB/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+  for (int i = 0; i < OP_MAX; i++) {
+    op_stat_t *s = &ops[i];
+    qsort(s->samples, s->count, sizeof(uint32_t), cmp_u32);
+    double mibps = s->total_us && s->bytes
+                       ? (double)s->bytes / (1 << 20) / (s->total_us / 1e6)
+                       : 0;
+    printf("%-10s %8zu %8llu %10.2f %9u %9u %9u %9u\n", op_name[i], s->count,
+           (unsigned long long)s->errors, mibps, percentile(s, 0.5),
+           percentile(s, 0.99), percentile(s, 0.999),
+           s->count ? s->samples[s->count - 1] : 0);
+    free(s->samples);
+  }
+  printf("device: %llu reads (%llu sectors), %llu writes (%llu sectors), "
+         "busy %.1f s\n",
+         (unsigned long long)ds.read_cmds,
+         (unsigned long long)ds.sectors_read,
+         (unsigned long long)ds.write_cmds,
+         (unsigned long long)ds.sectors_written, ds.busy_us / 1e6);
+  printf("commit: %.1f reads, %.1f writes per commit (data tail, metadata, "
+         "checkpoint)\n",
+         commits ? (double)commit_reads / commits : 0,
+         commits ? (double)commit_writes / commits : 0);
+
+  reread_mp3(dev, played, played_count, reread);
+
+  mmcfs_compact_stop();
+  mmcfs_get_stats(&ms);
+  printf("bucket cache: %u hits, %u misses\n", ms.bucket_cache_hits,
+         ms.bucket_cache_misses);
+  printf("%-14s %8s %8s %9s %9s %9s\n", "mmcfs op", "count", "errors",
+         "avg(us)", "p99<(us)", "max(us)");
+  for (int i = 0; i < MMCFS_OP_MAX; i++) {
+    const mmcfs_op_stats_t *o = &ms.ops[i];
+    printf("%-14s %8u %8u %9.0f %9u %9u\n", mmcfs_op_name(i), o->count,
+           o->errors, o->count ? (double)o->total_us / o->count : 0,
+           hist_bound(o, 0.99), o->max_us);
+  }
+  printf("mmcfs card: %u reads (%llu sectors), %u writes (%llu sectors), "
+         "%u erases, %u errors\n",
+         ms.dev_reads, (unsigned long long)ms.dev_sectors_read, ms.dev_writes,
+         (unsigned long long)ms.dev_sectors_written, ms.dev_erases,
+         ms.dev_errors);
+  printf("discard: %u units of %u sectors, %u pending, %u skipped in use\n",
+         ms.discard_units, ms.discard_unit_sect, ms.discard_pending,
+         ms.discard_skipped);
+  printf("bucket lookups: %u, %.2f buckets searched each, %u filter false "
+         "positives; %u files in second choice, %u poured\n",
+         ms.bucket_lookups,
+         ms.bucket_lookups ? (double)ms.bucket_probes / ms.bucket_lookups : 0,
+         ms.filter_false, ms.bucket_second, ms.bucket_pours);
+  printf("pcm readahead: %u hits, %u misses, %u refills, refill avg %.0f us, "
+         "max %u us\n",
+         ms.pcm_ra_hits, ms.pcm_ra_misses, ms.pcm_ra_refills,
+         ms.pcm_ra_refills ? (double)ms.pcm_ra_refill_us / ms.pcm_ra_refills
+                           : 0,
+         ms.pcm_ra_refill_max_us);
+  printf("file data: %.1f MiB copied, %.1f MiB direct to/from caller\n",
+         ms.bytes_copied / 1048576.0, ms.bytes_direct / 1048576.0);
+  printf("reclaim: %u runs, %u files, %.1f MiB, avg %.0f us, max %u us\n",
+         ms.reclaim_runs, ms.reclaim_files, ms.reclaim_bytes / 1048576.0,
+         ms.reclaim_runs ? (double)ms.reclaim_us / ms.reclaim_runs : 0,
+         ms.reclaim_max_us);
+  printf("compact: %u files, %.1f MiB moved, %u given up\n",
+         ms.compact_files, ms.compact_bytes / 1048576.0, ms.compact_aborted);
+  printf("pcm growth: %u in place, %u new extents\n", ms.pcm_grown,
+         ms.pcm_extents);
+
+  falloc_stats_t fa;
+  falloc_stats(&fa);
+  printf("free space: %u blocks in %u extents, largest %u blocks, "
+         "fragmentation %u permille\n",
+         fa.free_blocks, fa.free_extents, fa.largest_extent, fa.fragmentation);
+
+  int ret = 0;
+  if (mmcfs_check() != ESP_OK) {
+    fprintf(stderr, "bitmap and free extent index disagree\n");
+    ret = 1;
+  }
+
+  free(played);
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  return ret;
+}
@@ -0,0 +1,355 @@
+/*
+ * mmcfs_mkfs: build a card image with tracks already cached, to be flashed
+ * at the factory.
+ *
+ * Every mp3 in a directory is decoded to 48kHz stereo s16le by an external
+ * decoder (ffmpeg by default), one per core, and cut into frames the way the
+ * device does (FRAME_DAT_SIZE of pcm in each FRAME_BUF_SIZE frame, the last
+ * one zero padded). The image is then written by mmcfs itself, so superblock,
+ * buckets and the layout of mp3 and pcm are exactly what the firmware writes.
+ * Tracks are committed one at a time in name order, each pcm in as few
+ * extents as the card allows, and the image is unmounted clean (checkpoint
+ * written), so the first mount on the device does not scan.
+ *
+ * An existing image is added to. Tracks already cached are skipped.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+
+#define DEFAULT_DECODER                                                        \
+  "ffmpeg -nostdin -v error -i \"$1\" -f s16le -ar 48000 -ac 2 -"
+
+typedef struct {
+  char *path;
+  md5_digest_t digest;
+  uint32_t mp3_size;
+  uint32_t frames;
+  int ret; // 0, cached; 1, already there; negative, failed
+} mkfs_track_t;
+
+static const char *decoder = DEFAULT_DECODER;
+
+static mkfs_track_t *tracks;
+static int track_count;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn = PTHREAD_COND_INITIALIZER;
+static int next_decode;
+static int next_commit;
+
+static int mp3_name(const struct dirent *de) {
+  size_t len = strlen(de->d_name);
+  return len > 4 && strcasecmp(de->d_name + len - 4, ".mp3") == 0;
+}
+
+static int load_mp3(mkfs_track_t *t, char **out) {
+  md5_context_t ctx;
+  struct stat st;
+
+  FILE *fp = fopen(t->path, "rb");
+  if (fp == NULL)
+    return -errno;
+  if (fstat(fileno(fp), &st) != 0 || st.st_size == 0 ||
+      st.st_size > UINT32_MAX) {
+    fclose(fp);
+    return -EINVAL;
+  }
+
+  char *buf = malloc(st.st_size);
+  if (buf == NULL || fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+    free(buf);
+    fclose(fp);
+    return -EIO;
+  }
+  fclose(fp);
+
+  esp_rom_md5_init(&ctx);
+  esp_rom_md5_update(&ctx, buf, st.st_size);
+  esp_rom_md5_final(t->digest.bytes, &ctx);
+  t->mp3_size = st.st_size;
+  *out = buf;
+  return 0;
+}
+
+/*
+ * run the decoder on the mp3, frames go to tmp
+ */
+static int decode(mkfs_track_t *t, FILE *tmp) {
+  static char zeros[FRAME_BUF_SIZE - FRAME_DAT_SIZE];
+  char dat[FRAME_DAT_SIZE];
+  int fds[2], status;
+
+  if (pipe(fds) != 0)
+    return -errno;
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -errno;
+  }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execl("/bin/sh", "sh", "-c", decoder, "sh", t->path, (char *)NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+
+  int ret = 0;
+  for (;;) {
+    size_t len = 0;
+    while (len < FRAME_DAT_SIZE) {
+      ssize_t n = read(fds[0], dat + len, FRAME_DAT_SIZE - len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      len += n;
+    }
+    if (len == 0)
+      break;
+    memset(dat + len, 0, FRAME_DAT_SIZE - len);
+    if (fwrite(dat, FRAME_DAT_SIZE, 1, tmp) != 1 ||
+        fwrite(zeros, sizeof(zeros), 1, tmp) != 1) {
+      ret = -EIO;
+      break;
+    }
+    t->frames++;
+  }
+  close(fds[0]);
+
+  waitpid(pid, &status, 0);
+  // reported as decoder failed
+  if (ret == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+    ret = -EPIPE;
+  if (ret == 0 && t->frames == 0)
+    ret = -ENODATA;
+  return ret;
+}
+
+static bool cached(mkfs_track_t *t) {
+  mmcfs_finfo_t finfo;
+  return mmcfs_stat(&t->digest, &finfo) == 0 && finfo.mp3_state == 2 &&
+         finfo.pcm_state == 2;
+}
+
+static int cache(mkfs_track_t *t, char *mp3, FILE *tmp) {
+  static char frame[FRAME_BUF_SIZE];
+  mmcfs_file_handle_t file;
+
+  int ret = mmcfs_create_file(&t->digest, t->mp3_size, &file);
+  if (ret < 0)
+    return ret;
+
+  for (uint32_t pos = 0; pos < t->mp3_size; pos += PIC_BLOCK_SIZE) {
+    uint32_t len = t->mp3_size - pos;
+    ret = mmcfs_write_mp3(file, mp3 + pos,
+                          len < PIC_BLOCK_SIZE ? len : PIC_BLOCK_SIZE);
+    if (ret < 0)
+      goto fail;
+  }
+
+  rewind(tmp);
+  for (uint32_t i = 0; i < t->frames; i++) {
+    if (fread(frame, FRAME_BUF_SIZE, 1, tmp) != 1) {
+      ret = -EIO;
+      goto fail;
+    }
+    ret = mmcfs_write_pcm(file, frame, FRAME_BUF_SIZE);
+    if (ret < 0)
+      goto fail;
+  }
+  return mmcfs_commit_file(file);
+
+fail:
+  mmcfs_abort_file(file);
+  return ret;
+}
+
+/*
+ * decode in parallel, commit in order, one track at a time
+ */
+static void *worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    int i = next_decode++;
+    pthread_mutex_unlock(&lock);
+    if (i >= track_count)
+      return NULL;
+
+    mkfs_track_t *t = &tracks[i];
+    char *mp3 = NULL;
+    FILE *tmp = tmpfile();
+    t->ret = tmp ? load_mp3(t, &mp3) : -errno;
+    if (t->ret == 0 && cached(t))
+      t->ret = 1;
+    if (t->ret == 0)
+      t->ret = decode(t, tmp);
+
+    pthread_mutex_lock(&lock);
+    while (next_commit != i)
+      pthread_cond_wait(&turn, &lock);
+    if (t->ret == 0)
+      t->ret = cache(t, mp3, tmp);
+
+    char hex[33];
+    sprint_md5_digest(&t->digest, hex, 0);
+    if (t->ret == -EPIPE)
+      printf("%s: decoder failed\n", t->path);
+    else if (t->ret < 0)
+      printf("%s: %s\n", t->path, strerror(-t->ret));
+    else if (t->ret == 0)
+      printf("%s %6u frames %s\n", hex, t->frames, t->path);
+    else
+      printf("%s   already cached %s\n", hex, t->path);
+    next_commit++;
+    pthread_cond_broadcast(&turn);
+    pthread_mutex_unlock(&lock);
+
+    free(mp3);
+    if (tmp)
+      fclose(tmp);
+  }
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] image dir\n"
+          "  -s MiB     image size, needed if image does not exist\n"
+          "  -a KiB     allocation unit of the target card (default "
+          "not reported)\n"
+          "  -j jobs    decoders run at once (default one per core)\n"
+          "  -d cmd     decoder, a shell command writing 48kHz stereo s16le\n"
+          "             to stdout, mp3 is $1 (default " DEFAULT_DECODER ")\n"
+          "  -v         verbose mmcfs log\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  uint64_t size_mib = 0;
+  uint32_t au_kib = 0;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  struct dirent **names;
+  struct stat st;
+  int opt;
+
+  host_log_level = ESP_LOG_WARN;
+  while ((opt = getopt(argc, argv, "s:a:j:d:vh")) != -1) {
+    switch (opt) {
+    case 's':
+      size_mib = strtoull(optarg, NULL, 0);
+      break;
+    case 'a':
+      au_kib = strtoul(optarg, NULL, 0);
+      break;
+    case 'j':
+      jobs = strtol(optarg, NULL, 0);
+      break;
+    case 'd':
+      decoder = optarg;
+      break;
+    case 'v':
+      host_log_level = ESP_LOG_INFO;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (argc - optind != 2 || jobs < 1 ||
+      (size_mib == 0 && stat(argv[optind], &st) != 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *path = argv[optind];
+  const char *dir = argv[optind + 1];
+
+  track_count = scandir(dir, &names, mp3_name, alphasort);
+  if (track_count < 0) {
+    perror(dir);
+    return 1;
+  }
+  tracks = calloc(track_count ? track_count : 1, sizeof(mkfs_track_t));
+  for (int i = 0; i < track_count; i++) {
+    tracks[i].path = malloc(strlen(dir) + strlen(names[i]->d_name) + 2);
+    sprintf(tracks[i].path, "%s/%s", dir, names[i]->d_name);
+    free(names[i]);
+  }
+  free(names);
+
+  blkdev_t *dev = blkdev_file_open(path, size_mib * 2048, NULL);
+  if (dev == NULL)
+    return 1;
+  dev->erase_sectors = au_kib * 2;
+
+  // nothing is freed here, and erase is a no-op on an image anyway
+  mmcfs_mount_opts_t mount_opts = {.no_discard = true};
+  mmcfs_set_mount_opts(&mount_opts);
+  if (mmcfs_mount(dev) != ESP_OK) {
+    fprintf(stderr, "mount failed\n");
+    return 1;
+  }
+
+  if (jobs > track_count)
+    jobs = track_count;
+  pthread_t *threads = calloc(jobs ? jobs : 1, sizeof(pthread_t));
+  for (int i = 0; i < jobs; i++)
+    pthread_create(&threads[i], NULL, worker, NULL);
+  for (int i = 0; i < jobs; i++)
+    pthread_join(threads[i], NULL);
+
+  /*
+   * a full card makes room by evicting the least recently played tracks,
+   * which on a fresh image are the first ones cached; they are missed here
+   */
+  int cached = 0, failed = 0;
+  uint64_t frames = 0;
+  md5_digest_t *digests = calloc(track_count + 1, sizeof(md5_digest_t));
+  mmcfs_finfo_t *finfo = calloc(track_count + 1, sizeof(mmcfs_finfo_t));
+  for (int i = 0; i < track_count; i++)
+    digests[i] = tracks[i].digest;
+  int ret = mmcfs_stat_many(digests, track_count, finfo);
+  if (ret < 0)
+    fprintf(stderr, "stat failed: %s\n", strerror(-ret));
+  for (int i = 0; i < track_count; i++) {
+    if (tracks[i].ret < 0) {
+      failed++;
+    } else if (finfo[i].mp3_state != 2 || finfo[i].pcm_state != 2) {
+      if (ret >= 0)
+        printf("%s: evicted, card full\n", tracks[i].path);
+      failed++;
+    } else {
+      cached++;
+      frames += tracks[i].frames;
+    }
+  }
+
+  esp_err_t err = mmcfs_check();
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+
+  printf("%d tracks cached, %llu frames written (%.1f hours), %d failed\n",
+         cached, (unsigned long long)frames,
+         frames * (double)FRAME_DAT_SIZE / (48000 * 4) / 3600, failed);
+  if (err != ESP_OK)
+    fprintf(stderr, "check failed: %s\n", esp_err_to_name(err));
+  return failed || err != ESP_OK ? 1 : 0;
+}
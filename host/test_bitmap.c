@@ -0,0 +1,190 @@
+/*
+ * bitmap unit tests, checked against a plain bool array model.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define NBITS 1000 // not a multiple of 32 on purpose
+
+static uint32_t words[BITMAP_WORDS(NBITS)];
+static bool model[NBITS];
+static bitmap_t bm;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t rand_u32(uint32_t n) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (uint32_t)(rng >> 16) % n;
+}
+
+static void check_model() {
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < NBITS; i++) {
+    assert(bitmap_test(&bm, i) == model[i]);
+    used += model[i];
+  }
+  assert(bitmap_used(&bm) == used);
+  assert(bitmap_free(&bm) == NBITS - used);
+  assert(bitmap_count(&bm, 0, NBITS) == used);
+
+  // tail bits beyond nbits are never touched
+  if (NBITS % 32) {
+    assert((words[NBITS / 32] >> (NBITS % 32)) == 0);
+  }
+}
+
+static void test_edges() {
+  uint32_t conflict = 0;
+
+  bitmap_init(&bm, words, NBITS);
+  memset(model, 0, sizeof(model));
+
+  assert(bitmap_set_range(&bm, 5, 4, NULL) == ESP_ERR_INVALID_ARG);
+  assert(bitmap_set_range(&bm, 0, NBITS + 1, NULL) == ESP_ERR_INVALID_ARG);
+  assert(bitmap_set_range(&bm, 7, 7, NULL) == ESP_OK);
+  assert(bitmap_used(&bm) == 0);
+
+  // single word, word boundaries, whole words and the last partial word
+  static const uint32_t ranges[][2] = {
+      {0, 1}, {3, 9}, {31, 32}, {32, 64}, {64, 130}, {200, 232}, {990, 1000},
+  };
+  for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    uint32_t s = ranges[r][0], e = ranges[r][1];
+    assert(bitmap_set_range(&bm, s, e, &conflict) == ESP_OK);
+    for (uint32_t i = s; i < e; i++)
+      model[i] = true;
+    check_model();
+  }
+
+  // overlapping set fails and changes nothing
+  conflict = 0;
+  assert(bitmap_set_range(&bm, 10, 40, &conflict) == ESP_ERR_INVALID_STATE);
+  assert(conflict == 31);
+  check_model();
+
+  // clearing a range that is not all set fails and changes nothing
+  assert(bitmap_clear_range(&bm, 120, 140, &conflict) ==
+         ESP_ERR_INVALID_STATE);
+  assert(conflict == 130);
+  check_model();
+
+  assert(bitmap_find_set(&bm, 0, NBITS) == 0);
+  assert(bitmap_find_set(&bm, 1, NBITS) == 3);
+  assert(bitmap_find_set(&bm, 10, 31) == 31);
+  assert(bitmap_find_set(&bm, 10, 30) == 30);
+  assert(bitmap_find_set(&bm, 130, NBITS) == 200);
+  assert(bitmap_find_clear(&bm, 31, NBITS) == 130);
+  assert(bitmap_find_clear(&bm, 990, NBITS) == NBITS);
+  assert(bitmap_find_clear(&bm, 5, 5) == 5);
+
+  assert(bitmap_find_clear_run(&bm, 0, 2) == 1);
+  assert(bitmap_find_clear_run(&bm, 0, 22) == 9);
+  assert(bitmap_find_clear_run(&bm, 0, 70) == 130);
+  assert(bitmap_find_clear_run(&bm, 0, 758) == 232);
+  assert(bitmap_find_clear_run(&bm, 0, 759) == (uint32_t)-1);
+
+  assert(bitmap_clear_range(&bm, 32, 64, NULL) == ESP_OK);
+  for (uint32_t i = 32; i < 64; i++)
+    model[i] = false;
+  check_model();
+
+  bitmap_reset(&bm);
+  memset(model, 0, sizeof(model));
+  check_model();
+}
+
+static void test_random() {
+  bitmap_init(&bm, words, NBITS);
+  memset(model, 0, sizeof(model));
+
+  for (int round = 0; round < 200000; round++) {
+    uint32_t s = rand_u32(NBITS + 1);
+    uint32_t e = s + rand_u32(NBITS + 1 - s);
+    uint32_t conflict = (uint32_t)-1;
+
+    switch (rand_u32(6)) {
+    case 0:
+    case 1: {
+      uint32_t expect = e;
+      for (uint32_t i = s; i < e; i++) {
+        if (model[i]) {
+          expect = i;
+          break;
+        }
+      }
+      esp_err_t err = bitmap_set_range(&bm, s, e, &conflict);
+      if (expect == e) {
+        assert(err == ESP_OK);
+        for (uint32_t i = s; i < e; i++)
+          model[i] = true;
+      } else {
+        assert(err == ESP_ERR_INVALID_STATE && conflict == expect);
+      }
+      break;
+    }
+    case 2:
+    case 3: {
+      uint32_t expect = e;
+      for (uint32_t i = s; i < e; i++) {
+        if (!model[i]) {
+          expect = i;
+          break;
+        }
+      }
+      esp_err_t err = bitmap_clear_range(&bm, s, e, &conflict);
+      if (expect == e) {
+        assert(err == ESP_OK);
+        for (uint32_t i = s; i < e; i++)
+          model[i] = false;
+      } else {
+        assert(err == ESP_ERR_INVALID_STATE && conflict == expect);
+      }
+      break;
+    }
+    case 4: {
+      uint32_t set = e, clr = e, cnt = 0;
+      for (uint32_t i = s; i < e; i++) {
+        if (model[i] && set == e)
+          set = i;
+        if (!model[i] && clr == e)
+          clr = i;
+        cnt += model[i];
+      }
+      assert(bitmap_find_set(&bm, s, e) == set);
+      assert(bitmap_find_clear(&bm, s, e) == clr);
+      assert(bitmap_count(&bm, s, e) == cnt);
+      break;
+    }
+    case 5: {
+      uint32_t len = 1 + rand_u32(64);
+      uint32_t expect = (uint32_t)-1, run = 0;
+      for (uint32_t i = s; i < NBITS; i++) {
+        run = model[i] ? 0 : run + 1;
+        if (run == len) {
+          expect = i + 1 - len;
+          break;
+        }
+      }
+      assert(bitmap_find_clear_run(&bm, s, len) == expect);
+      break;
+    }
+    }
+
+    if (round % 1000 == 0)
+      check_model();
+  }
+  check_model();
+}
+
+int main() {
+  test_edges();
+  test_random();
+  printf("test_bitmap: ok\n");
+  return 0;
+}
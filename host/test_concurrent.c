@@ -0,0 +1,374 @@
+/*
+ * mmcfs stress test, writer tasks caching new tracks at the same time while
+ * player tasks stat, open and read cached ones, on an image file with a slow
+ * card model.
+ *
+ * Every frame read is checked against the data written. A frame read must
+ * not wait behind a whole commit, only behind the card command in flight.
+ * Wall clock on a loaded host is too noisy to tell, so card writes started
+ * while a frame read is in progress are counted instead, and must be well
+ * below the writes of one commit.
+ *
+ * Tracks are removed meanwhile, so the discard task erases whole units of
+ * the card while frames are read. Erasing is slow on the model, and a frame
+ * read must wait behind an erase command of CONFIG_MMCFS_DISCARD_CHUNK_KB at
+ * most, not a unit; counted the same way.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+#include "falloc.h"
+#include "sdkconfig.h"
+
+#define IMAGE "/tmp/mmcfs_test_concurrent.img"
+#define IMAGE_MIB 512
+
+#define SEED_TRACKS 4
+#define NEW_TRACKS 12
+#define PLAYERS 2
+#define WRITERS 2
+
+// player above fetcher, as on the device
+#define PLAYER_PRIORITY 10
+#define WRITER_PRIORITY 5
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static atomic_uint writers_running = WRITERS;
+static atomic_uint frames_read = 0;
+static atomic_bool writer_done = false;
+static atomic_bool cached[SEED_TRACKS + NEW_TRACKS];
+static uint32_t commit_min_us = UINT32_MAX;
+static uint32_t commit_max_us = 0;
+static uint32_t commit_min_writes = UINT32_MAX;
+static SemaphoreHandle_t tasks_done;
+
+/*
+ * card writes, counted as they start, without the backend lock
+ */
+static atomic_uint card_writes = 0;
+static esp_err_t (*backend_write)(blkdev_t *, const void *, size_t, size_t);
+
+static esp_err_t counting_write(blkdev_t *dev, const void *src,
+                                size_t start_sector, size_t sector_count) {
+  card_writes++;
+  return backend_write(dev, src, start_sector, sector_count);
+}
+
+// sectors erased, counted as erases start
+static atomic_uint card_erased = 0;
+static esp_err_t (*backend_erase)(blkdev_t *, size_t, size_t);
+
+static esp_err_t counting_erase(blkdev_t *dev, size_t start_sector,
+                                size_t sector_count) {
+  card_erased += sector_count;
+  return backend_erase(dev, start_sector, sector_count);
+}
+
+static void writer(void *arg) {
+  uint32_t first = SEED_TRACKS + (uintptr_t)arg;
+  for (uint32_t id = first; id < SEED_TRACKS + NEW_TRACKS; id += WRITERS) {
+    int ret = cache_track(id);
+    if (ret < 0) {
+      printf("test_concurrent: caching track %u failed, %d\n", id, ret);
+      abort();
+    }
+    cached[id] = true;
+  }
+  if (--writers_running == 0)
+    writer_done = true;
+  xSemaphoreGive(tasks_done);
+}
+
+typedef struct {
+  uint32_t seed;
+  uint32_t frames;
+  uint32_t tracks;
+  uint32_t max_read_us;
+  uint32_t max_read_writes; // card writes during one frame read
+  uint32_t max_read_erased; // sectors erased during one
+} player_t;
+
+static void play_track(player_t *p, uint32_t id) {
+  static _Thread_local uint8_t frame[FRAME_BUF_SIZE];
+  static _Thread_local uint8_t expect[FRAME_BUF_SIZE];
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+  mmcfs_pcm_handle_t h;
+
+  track_digest(id, &digest);
+  assert(mmcfs_stat(&digest, &finfo) == 0);
+  assert(finfo.mp3_state == 2 && finfo.pcm_state == 2);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+
+  int frames = mmcfs_pcm_frames(h);
+  assert(frames == (int)track_frames(track_size(id)));
+
+  // start somewhere in the track, like a replay after a seek
+  p->seed = p->seed * 1103515245 + 12345;
+  int start = (p->seed >> 8) % frames;
+
+  for (int i = start; i < frames && !writer_done; i++) {
+    uint32_t w = card_writes;
+    uint32_t e = card_erased;
+    uint64_t t = now_us();
+    int ret = mmcfs_pcm_read(h, i, (char *)frame);
+    uint32_t us = now_us() - t;
+    w = card_writes - w;
+    e = card_erased - e;
+    assert(ret == 0);
+
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, expect,
+                    FRAME_BUF_SIZE);
+    if (memcmp(frame, expect, FRAME_BUF_SIZE) != 0) {
+      printf("test_concurrent: track %u frame %d corrupted\n", id, i);
+      abort();
+    }
+
+    if (p->max_read_us < us)
+      p->max_read_us = us;
+    if (p->max_read_writes < w)
+      p->max_read_writes = w;
+    if (p->max_read_erased < e)
+      p->max_read_erased = e;
+    p->frames++;
+    frames_read++;
+
+    // 40ms per frame on the device, much faster here
+    usleep(200);
+  }
+
+  mmcfs_pcm_close(h);
+  p->tracks++;
+}
+
+static void player(void *arg) {
+  player_t *p = (player_t *)arg;
+  while (!writer_done) {
+    // seed tracks, and new ones once committed
+    p->seed = p->seed * 1103515245 + 12345;
+    uint32_t id = (p->seed >> 8) % (SEED_TRACKS + NEW_TRACKS);
+    if (cached[id])
+      play_track(p, id);
+    else
+      usleep(200);
+  }
+  xSemaphoreGive(tasks_done);
+}
+
+/*
+ * commit time without concurrent readers, on the same card model
+ */
+static void time_commits() {
+  for (uint32_t id = 1000; id < 1004; id++) {
+    uint32_t size = track_size(id);
+    mmcfs_file_handle_t file;
+    md5_digest_t digest;
+
+    track_digest(id, &digest);
+    assert(mmcfs_create_file(&digest, size, &file) == 0);
+    assert(write_track(file, id, size, track_frames(size)) == 0);
+
+    uint32_t w = card_writes;
+    uint64_t t = now_us();
+    assert(mmcfs_commit_file(file) == 0);
+    uint32_t us = now_us() - t;
+    w = card_writes - w;
+    if (commit_min_writes > w)
+      commit_min_writes = w;
+    if (commit_min_us > us)
+      commit_min_us = us;
+    if (commit_max_us < us)
+      commit_max_us = us;
+  }
+}
+
+/*
+ * remount from checkpoint, then with a bucket scan, free space must agree
+ */
+static void check_checkpoint(blkdev_t *dev) {
+  mmcfs_stats_t ms;
+  falloc_stats_t fs;
+
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_get_stats(&ms);
+  assert(!ms.mount_scanned);
+  falloc_stats(&fs);
+  uint32_t free_blocks = fs.free_blocks;
+
+  mmcfs_unmount();
+  mmcfs_mount_opts_t opts = {.force_scan = true};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_set_mount_opts(NULL);
+  mmcfs_get_stats(&ms);
+  assert(ms.mount_scanned);
+  falloc_stats(&fs);
+  if (fs.free_blocks != free_blocks) {
+    printf("test_concurrent: checkpoint has %u free blocks, scan %u\n",
+           free_blocks, fs.free_blocks);
+    abort();
+  }
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+  tracks_init(128, 256, false);
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  backend_write = dev->write;
+  dev->write = counting_write;
+  backend_erase = dev->erase;
+  dev->erase = counting_erase;
+  assert(mmcfs_mount(dev) == ESP_OK);
+
+  for (uint32_t id = 0; id < SEED_TRACKS; id++) {
+    assert(cache_track(id) == 0);
+    cached[id] = true;
+  }
+
+  // all slots taken, one committed while the others are open, then those
+  // aborted, leaving reservations out of the checkpoint on card
+  mmcfs_file_handle_t files[CONFIG_MMCFS_MAX_OPEN_FILES];
+  for (int i = 0; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    md5_digest_t digest;
+    mmcfs_file_handle_t dup;
+    track_digest(2000 + i, &digest);
+    assert(mmcfs_create_file(&digest, track_size(2000 + i), &files[i]) == 0);
+    assert(mmcfs_create_file(&digest, track_size(2000 + i), &dup) == -EEXIST);
+  }
+  mmcfs_file_handle_t extra;
+  md5_digest_t digest;
+  track_digest(2100, &digest);
+  assert(mmcfs_create_file(&digest, track_size(2100), &extra) == -EMFILE);
+
+  uint32_t size = track_size(2000);
+  assert(write_track(files[0], 2000, size, track_frames(size)) == 0);
+  assert(mmcfs_commit_file(files[0]) == 0);
+  for (int i = 1; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    mmcfs_abort_file(files[i]);
+  }
+  check_checkpoint(dev);
+
+  // card commands cost like on a slow card, so commits take long, and an
+  // erase of a whole unit longer than a frame
+  blkdev_file_model_t model = {
+      .read_latency_us = 300,
+      .write_latency_us = 1500,
+      .erase_latency_us = 1000,
+      .erase_kib_per_sec = 32 * 1024,
+  };
+  blkdev_file_set_model(dev, &model);
+  time_commits();
+
+  player_t players[PLAYERS];
+  memset(players, 0, sizeof(players));
+  tasks_done = xSemaphoreCreateCounting(PLAYERS + WRITERS, 0);
+  assert(tasks_done);
+
+  for (int i = 0; i < PLAYERS; i++) {
+    players[i].seed = i + 1;
+    assert(xTaskCreate(player, "player", 4096, &players[i], PLAYER_PRIORITY,
+                       NULL) == pdPASS);
+  }
+
+  // the tracks timed, freeing units for the discard task to erase while
+  // frames are read; writers would take the space, so not before one is
+  mmcfs_stats_t ms;
+  mmcfs_get_stats(&ms);
+  uint32_t discard_units = ms.discard_units;
+  while (frames_read == 0)
+    usleep(1000);
+  for (uint32_t id = 1000; id < 1004; id++) {
+    track_digest(id, &digest);
+    assert(mmcfs_remove_file(&digest) == 0);
+  }
+  do {
+    usleep(1000);
+    mmcfs_get_stats(&ms);
+  } while (ms.discard_units == discard_units);
+
+  for (uintptr_t i = 0; i < WRITERS; i++) {
+    assert(xTaskCreate(writer, "writer", 4096, (void *)i, WRITER_PRIORITY,
+                       NULL) == pdPASS);
+  }
+
+  for (int i = 0; i < PLAYERS + WRITERS; i++) {
+    xSemaphoreTake(tasks_done, portMAX_DELAY);
+  }
+
+  mmcfs_get_stats(&ms);
+  discard_units = ms.discard_units - discard_units;
+
+  uint32_t frames = 0, tracks = 0, max_read_us = 0, max_read_writes = 0;
+  uint32_t max_read_erased = 0;
+  for (int i = 0; i < PLAYERS; i++) {
+    frames += players[i].frames;
+    tracks += players[i].tracks;
+    if (max_read_us < players[i].max_read_us)
+      max_read_us = players[i].max_read_us;
+    if (max_read_writes < players[i].max_read_writes)
+      max_read_writes = players[i].max_read_writes;
+    if (max_read_erased < players[i].max_read_erased)
+      max_read_erased = players[i].max_read_erased;
+  }
+
+  blkdev_file_set_model(dev, NULL);
+  assert(mmcfs_check() == ESP_OK);
+
+  // everything written is there after remount, checkpoint included
+  check_checkpoint(dev);
+  for (uint32_t id = 0; id < SEED_TRACKS + NEW_TRACKS; id++) {
+    md5_digest_t digest;
+    mmcfs_finfo_t finfo;
+    track_digest(id, &digest);
+    assert(mmcfs_stat(&digest, &finfo) == 0 && finfo.pcm_state == 2);
+  }
+  assert(mmcfs_check() == ESP_OK);
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+
+  printf("test_concurrent: %u tracks written, %u frames in %u tracks read\n"
+         "test_concurrent: frame read max %u us, %u card writes; commit "
+         "%u..%u us, %u+ card writes\n"
+         "test_concurrent: %u units of %u sectors discarded, frame read "
+         "%u sectors erased max\n",
+         NEW_TRACKS, frames, tracks, max_read_us, max_read_writes,
+         commit_min_us, commit_max_us, commit_min_writes, discard_units,
+         ms.discard_unit_sect, max_read_erased);
+
+  // at most the writes in flight, one per writer, before each of the (up to
+  // two) card reads of a frame read
+  assert(frames > 0);
+  assert(max_read_writes <= 2 * WRITERS &&
+         max_read_writes < commit_min_writes);
+  // likewise an erase command before each card read, not a unit
+  assert(discard_units > 0 &&
+         ms.discard_unit_sect > CONFIG_MMCFS_DISCARD_CHUNK_KB * 2);
+  assert(max_read_erased <= 2 * CONFIG_MMCFS_DISCARD_CHUNK_KB * 2);
+  printf("test_concurrent: ok\n");
+  return 0;
+}
@@ -0,0 +1,327 @@
+/*
+ * mmcfs power loss test. Creating and removing a track is run once for every
+ * card write it does, with power cut at that write: the write is dropped or
+ * torn (only its first bytes reach the card), and nothing after it does.
+ * Then the card is mounted again and checked:
+ *
+ * - mount succeeds and no blocks are claimed by two files
+ * - free space agrees with a full bucket scan, checkpoint or not
+ * - every other track is there, with every pcm frame intact
+ * - the track in flight is either there, mp3 and pcm, or gone: both records
+ *   are written in one transaction
+ *
+ * The track created, the one removed and one more share a bucket, so a torn
+ * bucket write loses (or duplicates) a record unless the log is replayed.
+ * Compaction is cut the same way, moving the last track into the hole a
+ * removed one left: every track must be intact, wherever it is.
+ * Old contents of every sector written are kept, to roll the card back
+ * before the next cut.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+#include "falloc.h"
+
+#define IMAGE "/tmp/mmcfs_test_crash.img"
+#define IMAGE_MIB 128
+
+#define SEED_TRACKS 4
+
+static uint16_t track_bucket(uint32_t id) {
+  md5_digest_t digest;
+  track_digest(id, &digest);
+  return (digest.bytes[0] << 4) + (digest.bytes[1] >> 4);
+}
+
+/*
+ * first track from given id on in the same bucket as track id
+ */
+static uint32_t same_bucket(uint32_t id, uint32_t from) {
+  uint16_t bucket = track_bucket(id);
+  while (track_bucket(from) != bucket)
+    from++;
+  return from;
+}
+
+/*
+ * card with power cut and undo
+ */
+typedef struct undo {
+  size_t start;
+  size_t count;
+  struct undo *next;
+  uint8_t data[];
+} undo_t;
+
+static esp_err_t (*backend_read)(blkdev_t *, void *, size_t, size_t);
+static esp_err_t (*backend_write)(blkdev_t *, const void *, size_t, size_t);
+static undo_t *undo_list = NULL;
+
+static bool armed = false;
+static uint32_t writes_left; // before the cut
+static uint32_t tear;        // bytes of the cut write reaching the card
+static bool cut = false;
+static uint32_t writes = 0;
+
+static esp_err_t crash_write(blkdev_t *dev, const void *src,
+                             size_t start_sector, size_t sector_count) {
+  if (cut)
+    return ESP_FAIL;
+
+  undo_t *u = malloc(sizeof(undo_t) + sector_count * 512);
+  assert(u);
+  u->start = start_sector;
+  u->count = sector_count;
+  assert(backend_read(dev, u->data, start_sector, sector_count) == ESP_OK);
+  u->next = undo_list;
+  undo_list = u;
+
+  writes++;
+  if (armed && writes_left-- == 0) {
+    cut = true;
+    if (tear >= sector_count * 512)
+      return ESP_FAIL;
+
+    size_t n = tear / 512;
+    if (n)
+      assert(backend_write(dev, src, start_sector, n) == ESP_OK);
+    if (tear % 512) {
+      uint8_t sector[512];
+      assert(backend_read(dev, sector, start_sector + n, 1) == ESP_OK);
+      memcpy(sector, (const uint8_t *)src + n * 512, tear % 512);
+      assert(backend_write(dev, sector, start_sector + n, 1) == ESP_OK);
+    }
+    return ESP_FAIL;
+  }
+
+  return backend_write(dev, src, start_sector, sector_count);
+}
+
+static void undo_all(blkdev_t *dev) {
+  while (undo_list) {
+    undo_t *u = undo_list;
+    assert(backend_write(dev, u->data, u->start, u->count) == ESP_OK);
+    undo_list = u->next;
+    free(u);
+  }
+}
+
+static void undo_forget() {
+  while (undo_list) {
+    undo_t *u = undo_list;
+    undo_list = u->next;
+    free(u);
+  }
+}
+
+/*
+ * -ENOENT if not there, 1 if mp3 only, 2 if pcm too (all frames checked)
+ */
+static int verify_track(uint32_t id) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  static uint8_t expect[FRAME_BUF_SIZE];
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+  mmcfs_pcm_handle_t h;
+
+  track_digest(id, &digest);
+  int ret = mmcfs_stat(&digest, &finfo);
+  if (ret < 0) {
+    assert(ret == -ENOENT);
+    return ret;
+  }
+
+  assert(finfo.mp3_state == 2);
+  if (finfo.pcm_state == 0)
+    return 1;
+
+  assert(finfo.pcm_state == 2);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  int frames = mmcfs_pcm_frames(h);
+  assert(frames == (int)track_frames(track_size(id)));
+  for (int i = 0; i < frames; i++) {
+    assert(mmcfs_pcm_read(h, i, (char *)frame) == 0);
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, expect,
+                    FRAME_BUF_SIZE);
+    if (memcmp(frame, expect, FRAME_BUF_SIZE) != 0) {
+      printf("test_crash: track %u frame %d corrupted\n", id, i);
+      abort();
+    }
+  }
+  mmcfs_pcm_close(h);
+  return 2;
+}
+
+typedef enum { OP_CREATE, OP_REMOVE, OP_COMPACT } op_t;
+
+static const char *op_name[] = {"create", "remove", "compact"};
+
+static uint32_t seeds[SEED_TRACKS];
+static uint32_t new_track;
+static uint32_t replays = 0;
+static uint32_t scans = 0;
+
+/*
+ * mount after a cut and check everything, inflight is the track of op, done
+ * if op returned success
+ */
+static void check_after(blkdev_t *dev, op_t op, uint32_t inflight,
+                        bool done) {
+  mmcfs_stats_t ms;
+  falloc_stats_t fst;
+
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_get_stats(&ms);
+  assert(ms.scan_conflicts == 0);
+  replays += ms.log_replayed;
+  scans += ms.mount_scanned;
+  assert(mmcfs_check() == ESP_OK);
+
+  for (int i = 0; i < SEED_TRACKS; i++) {
+    if (seeds[i] != inflight)
+      assert(verify_track(seeds[i]) == 2);
+  }
+
+  int state = verify_track(inflight);
+  if (op == OP_COMPACT)
+    assert(state == 2);
+  else
+    assert(state == 2 || state == -ENOENT);
+  if (done && op != OP_COMPACT)
+    assert(state == (op == OP_CREATE ? 2 : -ENOENT));
+
+  falloc_stats(&fst);
+  uint32_t free_blocks = fst.free_blocks;
+  mmcfs_unmount();
+
+  mmcfs_mount_opts_t opts = {.force_scan = true};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_set_mount_opts(NULL);
+  mmcfs_get_stats(&ms);
+  assert(ms.scan_conflicts == 0);
+  falloc_stats(&fst);
+  if (fst.free_blocks != free_blocks) {
+    printf("test_crash: %s, %u free blocks after mount, %u by scan\n",
+           op_name[op], free_blocks, fst.free_blocks);
+    abort();
+  }
+  mmcfs_unmount();
+}
+
+/*
+ * cut power at every write of op, each torn at given bytes. Returns the
+ * number of cuts.
+ */
+static uint32_t run_op(blkdev_t *dev, op_t op, uint32_t tear_bytes) {
+  uint32_t inflight = op == OP_CREATE ? new_track : seeds[0];
+  if (op == OP_COMPACT)
+    inflight = seeds[SEED_TRACKS - 1];
+
+  for (uint32_t k = 0;; k++) {
+    assert(mmcfs_mount(dev) == ESP_OK);
+    undo_forget();
+
+    writes = 0;
+    writes_left = k;
+    tear = tear_bytes;
+    cut = false;
+    armed = true;
+
+    int ret;
+    if (op == OP_CREATE) {
+      ret = cache_track(new_track);
+    } else if (op == OP_COMPACT) {
+      mmcfs_stats_t ms;
+      ret = mmcfs_compact_step(0);
+      mmcfs_get_stats(&ms);
+      ret = ret == 1 && ms.compact_files == 1 ? 0 : -1;
+    } else {
+      md5_digest_t digest;
+      track_digest(inflight, &digest);
+      ret = mmcfs_remove_file(&digest);
+    }
+
+    // a cut while writing the checkpoint does not fail the op
+    armed = false;
+    bool was_cut = cut;
+    assert(ret == 0 || was_cut);
+
+    // power off, and on
+    mmcfs_unmount();
+    cut = false;
+    check_after(dev, op, inflight, ret == 0);
+    undo_all(dev);
+
+    if (!was_cut)
+      return k;
+  }
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+  tracks_init(24, 48, true);
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  backend_read = dev->read;
+  backend_write = dev->write;
+  dev->write = crash_write;
+
+  // seeds[0] is removed, new_track created, both next to seeds[1]
+  seeds[0] = 0;
+  seeds[1] = same_bucket(0, 1);
+  seeds[2] = seeds[1] + 1;
+  seeds[3] = seeds[1] + 2;
+  new_track = same_bucket(0, seeds[3] + 1);
+
+  // the longest track, first on card and removed, a hole for compaction to
+  // move the last seed into
+  uint32_t hole = 1000;
+  while (track_size(hole) / 1024 < 48)
+    hole++;
+
+  assert(mmcfs_mount(dev) == ESP_OK);
+  assert(cache_track(hole) == 0);
+  for (int i = 0; i < SEED_TRACKS; i++) {
+    assert(cache_track(seeds[i]) == 0);
+  }
+  md5_digest_t digest;
+  track_digest(hole, &digest);
+  assert(mmcfs_remove_file(&digest) == 0);
+  mmcfs_unmount();
+  undo_forget();
+
+  // whole write lost, within the first record (or log header), within the
+  // second sector, within the second bucket of a log
+  const uint32_t tears[] = {0, 64, 576, 2048};
+  for (int op = OP_CREATE; op <= OP_COMPACT; op++) {
+    for (int t = 0; t < sizeof(tears) / sizeof(tears[0]); t++) {
+      uint32_t cuts = run_op(dev, op, tears[t]);
+      printf("test_crash: %s, %u power cuts tearing at %u bytes\n",
+             op_name[op], cuts, tears[t]);
+    }
+  }
+
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+
+  printf("test_crash: %u log replays, %u mounts scanned\n", replays, scans);
+
+  // a torn bucket write must have been seen and repaired
+  assert(replays > 0);
+  printf("test_crash: ok\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * mmcfs format test. A new card is laid out for its allocation unit:
+ *
+ * - version 2 superblock, with the unit used and the one the card reported
+ * - data area starts on a unit boundary, no block straddles two units, for
+ *   units of 4MiB, 12MiB (not a power of 2), 64MiB and not reported, and
+ *   12MiB on cards of 1 and 2TiB where the blocks would be 8 and 16MiB
+ * - the format mounts again from its superblock and checks clean
+ *
+ * A version 0 superblock (laid out before geometry was recorded) still
+ * mounts and is left as it is.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+
+#define IMAGE "/tmp/mmcfs_test_format.img"
+#define IMAGE_MIB 512
+#define TIB (1024 * 1024) // MiB
+
+#define SUPERBLOCK_SECTOR 2
+#define DEFAULT_AU_SECT 8192 // 4MiB
+
+static void read_superblock(blkdev_t *dev, mmcfs_superblock_t *sb) {
+  assert(blkdev_read(dev, sb, SUPERBLOCK_SECTOR, 1) == ESP_OK);
+}
+
+static void format(uint32_t mib, uint32_t card_au, uint32_t expect_au) {
+  mmcfs_superblock_t sb;
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)mib * 2048, NULL);
+  assert(dev);
+  dev->erase_sectors = card_au;
+  assert(mmcfs_mount(dev) == ESP_OK);
+  assert(mmcfs_check() == ESP_OK);
+  mmcfs_unmount();
+
+  read_superblock(dev, &sb);
+  mmcfs_t *fs = &sb.mmcfs;
+  assert(sb.version == MMCFS_VERSION_GEOMETRY);
+  assert(sb.geometry.au_sect == expect_au);
+  assert(sb.geometry.card_au_sect == card_au);
+  assert(fs->block_start >= 64 * 2048 && fs->block_start % expect_au == 0);
+  assert(expect_au % fs->block_sect == 0 || fs->block_sect % expect_au == 0);
+  assert(fs->block_count <= MMCFS_MAX_BITARRAY_SIZE);
+  assert(fs->block_start + fs->block_count * fs->block_sect < dev->capacity);
+
+  // from superblock, not formatted again
+  assert(mmcfs_mount(dev) == ESP_OK);
+  assert(mmcfs_check() == ESP_OK);
+  mmcfs_unmount();
+  mmcfs_superblock_t again;
+  read_superblock(dev, &again);
+  assert(memcmp(&sb, &again, sizeof(sb)) == 0);
+
+  printf("test_format: unit %u sectors (card %u), data at %llu MiB, "
+         "%llu blocks of %llu sectors\n",
+         expect_au, card_au, (unsigned long long)fs->block_start / 2048,
+         (unsigned long long)fs->block_count,
+         (unsigned long long)fs->block_sect);
+  blkdev_file_close(dev);
+}
+
+/*
+ * turn a fresh (unit not reported) format into a version 0 one
+ */
+static void check_version0() {
+  mmcfs_superblock_t sb;
+  md5_context_t ctx;
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_unmount();
+
+  read_superblock(dev, &sb);
+  sb.version = 0;
+  memset(&sb.geometry, 0, sizeof(sb.geometry));
+  esp_rom_md5_init(&ctx);
+  esp_rom_md5_update(&ctx, &sb, sizeof(sb) - 16);
+  esp_rom_md5_final(sb.md5, &ctx);
+  assert(blkdev_write(dev, &sb, SUPERBLOCK_SECTOR, 1) == ESP_OK);
+
+  assert(mmcfs_mount(dev) == ESP_OK);
+  assert(mmcfs_check() == ESP_OK);
+  mmcfs_unmount();
+
+  mmcfs_superblock_t again;
+  read_superblock(dev, &again);
+  assert(memcmp(&sb, &again, sizeof(sb)) == 0);
+  blkdev_file_close(dev);
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+
+  format(IMAGE_MIB, 0, DEFAULT_AU_SECT);
+  format(IMAGE_MIB, 8192, 8192);               // 4MiB
+  format(IMAGE_MIB, 24576, 24576);             // 12MiB
+  format(IMAGE_MIB, 131072, 131072);           // 64MiB
+  format(IMAGE_MIB, 1 << 20, DEFAULT_AU_SECT); // out of spec
+  format(TIB, 24576, 24576);
+  format(2 * TIB, 24576, 24576);
+  check_version0();
+
+  unlink(IMAGE);
+  printf("test_format: ok\n");
+  return 0;
+}
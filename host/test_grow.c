@@ -0,0 +1,211 @@
+/*
+ * mmcfs pcm growth test. Tracks decode to far more pcm than create_file
+ * estimates from the mp3 size, so pcm files have to grow while written:
+ *
+ * - two tracks written at the same time end up in several extents each
+ * - a track written alone grows in place
+ * - every frame reads back, across extent boundaries, with and after remount
+ * - free space agrees with a full bucket scan, unused tails are released
+ * - an aborted track and removed tracks give back all their extents
+ * - every call shows in the op stats
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+#include "falloc.h"
+
+#define IMAGE "/tmp/mmcfs_test_grow.img"
+#define IMAGE_MIB 128
+#define BLOCK_SIZE 512 // for IMAGE_MIB
+
+#define MP3_SIZE (24 * 1024 + 123) // estimated 2 seconds of pcm
+#define FRAMES 1200                 // about 10 MiB, 49 seconds
+
+/*
+ * mp3 written, pcm to come frame by frame
+ */
+static mmcfs_file_handle_t create_track(uint32_t id) {
+  mmcfs_file_handle_t file;
+  md5_digest_t digest;
+
+  track_md5(id, MP3_SIZE, &digest);
+  assert(mmcfs_create_file(&digest, MP3_SIZE, &file) == 0);
+  assert(write_track(file, id, MP3_SIZE, 0) == 0);
+  return file;
+}
+
+static void write_frame(mmcfs_file_handle_t file, uint32_t id, int i) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, frame, FRAME_BUF_SIZE);
+  int ret = mmcfs_write_pcm(file, (char *)frame, FRAME_BUF_SIZE);
+  if (ret < 0) {
+    printf("test_grow: track %u frame %d not written, %d\n", id, i, ret);
+    abort();
+  }
+}
+
+static void check_frame(mmcfs_pcm_handle_t h, uint32_t id, int i) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  static uint8_t expect[FRAME_BUF_SIZE];
+
+  assert(mmcfs_pcm_read(h, i, (char *)frame) == 0);
+  fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, expect,
+                  FRAME_BUF_SIZE);
+  if (memcmp(frame, expect, FRAME_BUF_SIZE) != 0) {
+    printf("test_grow: track %u frame %d corrupted\n", id, i);
+    abort();
+  }
+}
+
+/*
+ * every frame in order, then every 7th backwards (seeks)
+ */
+static void verify_track(uint32_t id) {
+  md5_digest_t digest;
+  mmcfs_pcm_handle_t h;
+
+  track_md5(id, MP3_SIZE, &digest);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  assert(mmcfs_pcm_frames(h) == FRAMES);
+  for (int i = 0; i < FRAMES; i++)
+    check_frame(h, id, i);
+  for (int i = FRAMES - 1; i >= 0; i -= 7)
+    check_frame(h, id, i);
+  mmcfs_pcm_close(h);
+}
+
+static uint32_t free_blocks() {
+  falloc_stats_t fs;
+  falloc_stats(&fs);
+  return fs.free_blocks;
+}
+
+/*
+ * every call counted, in one histogram bucket, pcm written by the card
+ */
+static void check_ops(const mmcfs_stats_t *ms) {
+  assert(ms->ops[MMCFS_OP_CREATE].count == 3);
+  assert(ms->ops[MMCFS_OP_WRITE_PCM].count == 3 * FRAMES);
+  assert(ms->ops[MMCFS_OP_COMMIT].count == 3);
+  assert(ms->ops[MMCFS_OP_BUCKET_UPDATE].count >= 3);
+  for (int i = 0; i < MMCFS_OP_MAX; i++) {
+    const mmcfs_op_stats_t *o = &ms->ops[i];
+    uint32_t n = 0;
+    for (int k = 0; k < MMCFS_OP_HIST_SIZE; k++)
+      n += o->hist[k];
+    assert(n == o->count && o->errors == 0);
+  }
+  assert(ms->dev_errors == 0);
+  assert(ms->dev_sectors_written >= 3 * FRAMES * (FRAME_BUF_SIZE / 512));
+}
+
+/*
+ * remount with a bucket scan, then from checkpoint, free space must agree
+ */
+static void check_remount(blkdev_t *dev) {
+  mmcfs_unmount();
+  mmcfs_mount_opts_t opts = {.force_scan = true};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_set_mount_opts(NULL);
+  uint32_t scanned = free_blocks();
+
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+  if (free_blocks() != scanned) {
+    printf("test_grow: checkpoint has %u free blocks, scan %u\n",
+           free_blocks(), scanned);
+    abort();
+  }
+  assert(mmcfs_check() == ESP_OK);
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  uint32_t empty = free_blocks();
+
+  // interleaved, neither can grow in place
+  mmcfs_file_handle_t a = create_track(0);
+  mmcfs_file_handle_t b = create_track(1);
+  for (int i = 0; i < FRAMES; i++) {
+    write_frame(a, 0, i);
+    write_frame(b, 1, i);
+  }
+  assert(mmcfs_commit_file(a) == 0);
+  assert(mmcfs_commit_file(b) == 0);
+
+  mmcfs_stats_t ms;
+  mmcfs_get_stats(&ms);
+  uint32_t new_extents = ms.pcm_extents;
+  assert(new_extents >= 4);
+
+  // alone
+  mmcfs_file_handle_t c = create_track(2);
+  for (int i = 0; i < FRAMES; i++)
+    write_frame(c, 2, i);
+  assert(mmcfs_commit_file(c) == 0);
+  mmcfs_get_stats(&ms);
+  assert(ms.pcm_grown > 0);
+  check_ops(&ms);
+
+  // tails released, nothing but the frames (and mp3) is used
+  uint32_t used = empty - free_blocks();
+  uint32_t need = 3 * ((MP3_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE) +
+                  3 * FRAMES * (FRAME_BUF_SIZE / BLOCK_SIZE);
+  if (used != need) {
+    printf("test_grow: %u blocks used, %u expected\n", used, need);
+    abort();
+  }
+  assert(mmcfs_check() == ESP_OK);
+
+  for (uint32_t id = 0; id < 3; id++)
+    verify_track(id);
+
+  // aborted after growing
+  uint32_t before = free_blocks();
+  mmcfs_file_handle_t d = create_track(3);
+  for (int i = 0; i < FRAMES; i++)
+    write_frame(d, 3, i);
+  mmcfs_abort_file(d);
+  assert(free_blocks() == before);
+
+  check_remount(dev);
+  for (uint32_t id = 0; id < 3; id++)
+    verify_track(id);
+
+  for (uint32_t id = 0; id < 3; id++) {
+    md5_digest_t digest;
+    track_md5(id, MP3_SIZE, &digest);
+    assert(mmcfs_remove_file(&digest) == 0);
+    assert(mmcfs_pcm_open(&digest, &(mmcfs_pcm_handle_t){0}) == -ENOENT);
+  }
+  assert(free_blocks() == empty);
+  check_remount(dev);
+  assert(free_blocks() == empty);
+
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+
+  printf("test_grow: %d frames per track on a %u byte estimate, %u new "
+         "extents, %u grown in place\n",
+         FRAMES, MP3_SIZE / (12 * 1024) * 48000 * 4, ms.pcm_extents,
+         ms.pcm_grown);
+  printf("test_grow: ok\n");
+  return 0;
+}
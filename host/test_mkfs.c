@@ -0,0 +1,124 @@
+/*
+ * mmcfs_mkfs test, with cat as the decoder so the pcm of a track is its mp3
+ * bytes twice (once would give a pcm of a whole frame the mp3's digest):
+ *
+ * - every .mp3 in the directory is cached, other files are not
+ * - mp3 is read back by its md5, pcm is FRAME_DAT_SIZE of data per frame,
+ *   zeros after it and after the end of the last frame
+ * - image checks clean and mounts from its checkpoint (no scan)
+ * - a second run skips tracks already cached, a failing decoder fails
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+
+#define IMAGE "/tmp/mmcfs_test_mkfs.img"
+#define DIR "/tmp/mmcfs_test_mkfs"
+#define MKFS "./mmcfs_mkfs -s 256 -a 4096 -j 3"
+#define CAT "'cat \"$1\" \"$1\"'"
+
+static const uint32_t sizes[] = {1, FRAME_DAT_SIZE, PIC_BLOCK_SIZE + 1,
+                                 10 * FRAME_DAT_SIZE - 7, 300000};
+#define TRACKS (sizeof(sizes) / sizeof(sizes[0]))
+
+static void make_tracks() {
+  char path[64];
+
+  system("rm -rf " DIR);
+  assert(mkdir(DIR, 0755) == 0);
+  for (uint32_t n = 0; n < TRACKS; n++) {
+    uint8_t *buf = malloc(sizes[n]);
+    track_mp3(n, sizes[n], buf);
+    sprintf(path, DIR "/track%u.%s", n, n % 2 ? "MP3" : "mp3");
+    FILE *fp = fopen(path, "wb");
+    assert(fwrite(buf, sizes[n], 1, fp) == 1);
+    fclose(fp);
+    free(buf);
+  }
+  // not an mp3
+  FILE *fp = fopen(DIR "/cover.jpg", "wb");
+  fputs("jpeg", fp);
+  fclose(fp);
+}
+
+static void verify_track(uint32_t n) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  md5_context_t ctx;
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+  mmcfs_pcm_handle_t h;
+
+  uint32_t size = 2 * sizes[n];
+  uint8_t *buf = malloc(size);
+  track_mp3(n, sizes[n], buf);
+  memcpy(buf + sizes[n], buf, sizes[n]);
+  esp_rom_md5_init(&ctx);
+  esp_rom_md5_update(&ctx, buf, sizes[n]);
+  esp_rom_md5_final(digest.bytes, &ctx);
+
+  assert(mmcfs_stat(&digest, &finfo) == 0);
+  assert(finfo.mp3_state == 2 && finfo.pcm_state == 2);
+
+  int frames = (size + FRAME_DAT_SIZE - 1) / FRAME_DAT_SIZE;
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  assert(mmcfs_pcm_frames(h) == frames);
+  for (int i = 0; i < frames; i++) {
+    assert(mmcfs_pcm_read(h, i, (char *)frame) == 0);
+    uint32_t pos = i * FRAME_DAT_SIZE;
+    uint32_t len = size - pos < FRAME_DAT_SIZE ? size - pos : FRAME_DAT_SIZE;
+    assert(memcmp(frame, buf + pos, len) == 0);
+    for (uint32_t j = len; j < FRAME_BUF_SIZE; j++)
+      assert(frame[j] == 0);
+  }
+  mmcfs_pcm_close(h);
+  free(buf);
+}
+
+int main() {
+  mmcfs_stats_t ms;
+
+  host_log_level = ESP_LOG_WARN;
+  make_tracks();
+  unlink(IMAGE);
+  assert(system(MKFS " -d " CAT " " IMAGE " " DIR " > /dev/null") == 0);
+
+  blkdev_t *dev = blkdev_file_open(IMAGE, 0, NULL);
+  assert(dev);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_get_stats(&ms);
+  assert(!ms.mount_scanned);
+  assert(mmcfs_check() == ESP_OK);
+  for (uint32_t n = 0; n < TRACKS; n++)
+    verify_track(n);
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+
+  // all there already, nothing decoded
+  assert(system(MKFS " -d false " IMAGE " " DIR
+                     " | grep -c 'already cached' | grep -qx 5") == 0);
+
+  // a new track the decoder fails on
+  FILE *fp = fopen(DIR "/new.mp3", "wb");
+  fputs("new", fp);
+  fclose(fp);
+  assert(system(MKFS " -d 'test \"$1\" != " DIR "/new.mp3 && cat \"$1\"' "
+                     IMAGE " " DIR " > /dev/null") != 0);
+  assert(system(MKFS " -d " CAT " " IMAGE " " DIR
+                     " | grep -c 'already cached' | grep -qx 5") == 0);
+
+  system("rm -rf " DIR);
+  unlink(IMAGE);
+  printf("test_mkfs: ok\n");
+  return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * mmcfs mp3 reader test:
+ *
+ * - mp3s of 0 bytes to several readahead buffers read back whole, in reads
+ *   of many sizes, then 0 at the end; readahead refills counted
+ * - mp3s appended in chunks of odd sizes, through the write combining
+ *   buffer and, with no dma memory for one, bounced, read back whole
+ * - a reader is stale (-ENOENT) once its track is removed
+ * - an open reader keeps its track from being reclaimed, as the card is
+ *   filled twice over
+ * - an mp3 corrupted on card fails the read reaching its end (-EIO)
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+
+#define IMAGE "/tmp/mmcfs_test_mp3.img"
+#define IMAGE_MIB 128
+
+#define RA_SIZE (CONFIG_MMCFS_MP3_READAHEAD_KB * 1024)
+
+static const uint32_t sizes[] = {0,           1,           511,
+                                 512,         RA_SIZE - 1, RA_SIZE,
+                                 RA_SIZE + 1, 300000,      4 * RA_SIZE,
+                                 1234567};
+#define TRACKS (sizeof(sizes) / sizeof(sizes[0]))
+
+static const size_t reads[] = {1, 7, 512, 2048, 5000, RA_SIZE, 100000};
+#define READS (sizeof(reads) / sizeof(reads[0]))
+
+static const size_t chunks[] = {1, 511, 513, 1000, 4096, PIC_BLOCK_SIZE - 1};
+#define CHUNKS (sizeof(chunks) / sizeof(chunks[0]))
+#define ODD_SIZE 300001
+
+/*
+ * whole mp3 in reads of len, checked against what was cached
+ */
+static void read_track(uint32_t id, uint32_t size, const md5_digest_t *digest,
+                       size_t len) {
+  mmcfs_mp3_handle_t h;
+  mmcfs_stats_t before, after;
+
+  uint8_t *expect = malloc(size);
+  uint8_t *buf = malloc(size + len);
+  track_mp3(id, size, expect);
+
+  mmcfs_get_stats(&before);
+  assert(mmcfs_mp3_open(digest, &h) == 0);
+  assert(mmcfs_mp3_size(h) == size);
+  uint32_t pos = 0;
+  int ret;
+  while ((ret = mmcfs_mp3_read(h, (char *)buf + pos, len)) > 0) {
+    // short only at the end
+    assert(ret == len || pos + ret == size);
+    pos += ret;
+  }
+  assert(ret == 0 && pos == size);
+  assert(memcmp(buf, expect, size) == 0);
+  assert(mmcfs_mp3_read(h, (char *)buf, len) == 0);
+  mmcfs_mp3_close(h);
+  mmcfs_get_stats(&after);
+  assert(after.mp3_ra_refills - before.mp3_ra_refills ==
+         (size + RA_SIZE - 1) / RA_SIZE);
+  assert(after.mp3_bytes_read - before.mp3_bytes_read == size);
+
+  free(buf);
+  free(expect);
+}
+
+/*
+ * mp3 id written in chunks of odd sizes, bounced if no_wc as there is no dma
+ * memory for write combining buffers
+ */
+static void cache_odd(uint32_t id, uint32_t size, bool no_wc) {
+  mmcfs_file_handle_t file;
+  md5_digest_t digest;
+
+  uint8_t *mp3 = malloc(size);
+  track_mp3(id, size, mp3);
+  track_md5(id, size, &digest);
+  host_dma_exhausted = no_wc;
+  assert(mmcfs_create_file(&digest, size, &file) == 0);
+  host_dma_exhausted = false;
+
+  for (uint32_t pos = 0, i = 0; pos < size; i++) {
+    uint32_t n = chunks[i % CHUNKS];
+    if (n > size - pos)
+      n = size - pos;
+    assert(mmcfs_write_mp3(file, (char *)mp3 + pos, n) == 0);
+    pos += n;
+  }
+  assert(write_track(file, id, 0, 1) == 0);
+  assert(mmcfs_commit_file(file) == 0);
+  free(mp3);
+}
+
+/*
+ * whole mp3 from a reader open before
+ */
+static void read_open(mmcfs_mp3_handle_t h, uint32_t id) {
+  uint32_t size = mmcfs_mp3_size(h);
+  uint8_t *expect = malloc(size);
+  uint8_t *buf = malloc(size);
+  track_mp3(id, size, expect);
+  assert(mmcfs_mp3_read(h, (char *)buf, size) == size);
+  assert(memcmp(buf, expect, size) == 0);
+  mmcfs_mp3_close(h);
+  free(buf);
+  free(expect);
+}
+
+/*
+ * sector of the image the first 512 bytes of mp3 id are in
+ */
+static uint64_t find_sector(blkdev_t *dev, uint32_t id) {
+  static uint8_t first[512], sect[512];
+  fill_track_data(id, 0, first, sizeof(first));
+  for (uint64_t s = 0; s < dev->capacity; s++) {
+    assert(blkdev_read(dev, sect, s, 1) == ESP_OK);
+    if (memcmp(sect, first, 512) == 0)
+      return s;
+  }
+  abort();
+}
+
+int main() {
+  md5_digest_t digests[TRACKS];
+  mmcfs_mp3_handle_t h;
+  mmcfs_stats_t ms;
+  char buf[2048];
+
+  host_log_level = ESP_LOG_WARN;
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  assert(mmcfs_mount(dev) == ESP_OK);
+
+  for (uint32_t id = 0; id < TRACKS; id++) {
+    track_md5(id, sizes[id], &digests[id]);
+    assert(cache_track_size(id, sizes[id], 1) == 0);
+  }
+  for (uint32_t id = 0; id < TRACKS; id++) {
+    for (int r = 0; r < READS; r++)
+      read_track(id, sizes[id], &digests[id], reads[r]);
+  }
+
+  // odd appends, combined and bounced
+  for (uint32_t id = 1000; id < 1002; id++) {
+    md5_digest_t digest;
+    cache_odd(id, ODD_SIZE, id == 1001);
+    track_md5(id, ODD_SIZE, &digest);
+    for (int r = 0; r < READS; r++)
+      read_track(id, ODD_SIZE, &digest, reads[r]);
+  }
+
+  // not cached
+  md5_digest_t missing = digests[0];
+  missing.bytes[0] ^= 1;
+  assert(mmcfs_mp3_open(&missing, &h) == -ENOENT);
+
+  // removed while open
+  assert(mmcfs_mp3_open(&digests[0], &h) == 0);
+  assert(mmcfs_remove_file(&digests[0]) == 0);
+  assert(mmcfs_mp3_read(h, buf, sizeof(buf)) == -ENOENT);
+  mmcfs_mp3_close(h);
+
+  // kept while open, as new tracks take twice what the card holds
+  assert(mmcfs_mp3_open(&digests[TRACKS - 1], &h) == 0);
+  uint32_t id = TRACKS;
+  md5_digest_t digest;
+  do {
+    track_md5(id, 1 << 20, &digest);
+    assert(cache_track_size(id++, 1 << 20, 1) == 0);
+    mmcfs_get_stats(&ms);
+  } while (ms.reclaim_bytes < 2 * (uint64_t)(IMAGE_MIB / 2) << 20);
+  read_open(h, TRACKS - 1);
+  printf("test_mp3: %u tracks cached, %u files reclaimed\n", id,
+         ms.reclaim_files);
+
+  // one byte off in the middle of the last track cached
+  mmcfs_unmount();
+  static uint8_t sect[512];
+  uint64_t s = find_sector(dev, id - 1) + 1000;
+  assert(blkdev_read(dev, sect, s, 1) == ESP_OK);
+  sect[100] ^= 0x40;
+  assert(blkdev_write(dev, sect, s, 1) == ESP_OK);
+  assert(mmcfs_mount(dev) == ESP_OK);
+
+  assert(mmcfs_mp3_open(&digest, &h) == 0);
+  uint32_t pos = 0;
+  int ret;
+  while ((ret = mmcfs_mp3_read(h, buf, sizeof(buf))) > 0)
+    pos += ret;
+  assert(ret == -EIO && pos == (1 << 20) - sizeof(buf));
+  assert(mmcfs_mp3_read(h, buf, sizeof(buf)) == -EIO);
+  mmcfs_mp3_close(h);
+  mmcfs_get_stats(&ms);
+  assert(ms.mp3_bad == 1);
+  assert(ms.ops[MMCFS_OP_MP3_READ].errors == 2);
+
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+  printf("test_mp3: ok\n");
+  return 0;
+}
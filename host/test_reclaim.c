@@ -0,0 +1,297 @@
+/*
+ * mmcfs space reclaim test. Many more tracks are cached than the card holds,
+ * so creating a track has to remove least recently used ones:
+ *
+ * - every create succeeds
+ * - a track being played is never removed, nor one played recently
+ * - the oldest tracks are gone, both mp3 and pcm
+ * - free space agrees with a full bucket scan
+ * - after mounting from checkpoint, reclaim works again (index rebuilt)
+ *
+ * Then compaction is run till it is done, with a track being played: free
+ * space ends up in fewer, larger extents, and every track is intact.
+ *
+ * After mounting from checkpoint the digest filter is built in background,
+ * then looking up tracks not cached reads no bucket. A batch stat of every
+ * track agrees with stat, before and after.
+ *
+ * Freed space is discarded in small units throughout, erased sectors read
+ * back as 0xff, so a unit erased while in use would corrupt a track.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+#include "falloc.h"
+
+#define IMAGE "/tmp/mmcfs_test_reclaim.img"
+#define IMAGE_MIB 128
+
+#define ERASE_SECTORS 256 // 128KiB units
+
+#define TRACKS 200
+#define PLAYING 0 // kept open for the whole test
+#define FAVORITE 1 // played after every create
+
+/*
+ * frame i of track id, from an open reader
+ */
+static void check_frame(mmcfs_pcm_handle_t h, uint32_t id, int i) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  static uint8_t expect[FRAME_BUF_SIZE];
+
+  assert(mmcfs_pcm_read(h, i, (char *)frame) == 0);
+  fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, expect,
+                  FRAME_BUF_SIZE);
+  if (memcmp(frame, expect, FRAME_BUF_SIZE) != 0) {
+    printf("test_reclaim: track %u frame %d corrupted\n", id, i);
+    abort();
+  }
+}
+
+static void play_track(uint32_t id) {
+  md5_digest_t digest;
+  mmcfs_pcm_handle_t h;
+
+  track_digest(id, &digest);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  check_frame(h, id, 0);
+  mmcfs_pcm_close(h);
+}
+
+static void verify_track(uint32_t id) {
+  md5_digest_t digest;
+  mmcfs_pcm_handle_t h;
+
+  track_digest(id, &digest);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  int frames = mmcfs_pcm_frames(h);
+  assert(frames == (int)track_frames(track_size(id)));
+  for (int i = 0; i < frames; i++)
+    check_frame(h, id, i);
+  mmcfs_pcm_close(h);
+}
+
+static int track_state(uint32_t id) {
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+
+  track_digest(id, &digest);
+  int ret = mmcfs_stat(&digest, &finfo);
+  if (ret < 0)
+    return ret;
+  assert(finfo.mp3_state == 2 && finfo.pcm_state == 2);
+  return 0;
+}
+
+/*
+ * remount from checkpoint, then with a bucket scan, free space must agree
+ */
+static void check_checkpoint(blkdev_t *dev) {
+  mmcfs_stats_t ms;
+  falloc_stats_t fs;
+
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_get_stats(&ms);
+  assert(!ms.mount_scanned);
+  falloc_stats(&fs);
+  uint32_t free_blocks = fs.free_blocks;
+
+  mmcfs_unmount();
+  mmcfs_mount_opts_t opts = {.force_scan = true};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_set_mount_opts(NULL);
+  falloc_stats(&fs);
+  if (fs.free_blocks != free_blocks) {
+    printf("test_reclaim: checkpoint has %u free blocks, scan %u\n",
+           free_blocks, fs.free_blocks);
+    abort();
+  }
+
+  // back to a checkpoint mount, lru index not built
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+}
+
+/*
+ * whole tracklist in one batch, same answers as one by one
+ */
+static void check_stat_many(uint32_t cached) {
+  static md5_digest_t digests[TRACKS];
+  static mmcfs_finfo_t finfo[TRACKS];
+
+  for (uint32_t id = 0; id < TRACKS; id++)
+    track_digest(id, &digests[id]);
+  assert(mmcfs_stat_many(digests, TRACKS, finfo) == (int)cached);
+  for (uint32_t id = 0; id < TRACKS; id++) {
+    int state = track_state(id) == 0 ? 2 : 0;
+    assert(finfo[id].mp3_state == state && finfo[id].pcm_state == state);
+  }
+}
+
+/*
+ * wait till every unit pending is discarded, as a unit being erased is held
+ * allocated
+ */
+static void discard_idle() {
+  mmcfs_stats_t ms;
+
+  do {
+    usleep(1000);
+    mmcfs_get_stats(&ms);
+  } while (ms.discard_pending);
+}
+
+/*
+ * nothing is playing
+ */
+static void check_discard(blkdev_t *dev) {
+  mmcfs_stats_t ms;
+  blkdev_file_stats_t ds;
+
+  discard_idle();
+  mmcfs_get_stats(&ms);
+  blkdev_file_get_stats(dev, &ds);
+  assert(ms.discard_unit_sect == ERASE_SECTORS);
+  assert(ms.discard_units > 0 && ms.dev_erases == ms.discard_units);
+  assert(ds.sectors_erased == (uint64_t)ms.discard_units * ERASE_SECTORS);
+  assert(ms.ops[MMCFS_OP_DISCARD].count == ms.discard_units);
+  assert(mmcfs_check() == ESP_OK);
+  printf("test_reclaim: %u units of %u sectors discarded, %u skipped in use\n",
+         ms.discard_units, ERASE_SECTORS, ms.discard_skipped);
+}
+
+static void check_filter() {
+  mmcfs_stats_t before, after;
+
+  do {
+    usleep(1000);
+    mmcfs_get_stats(&before);
+  } while (!before.filter_ready);
+
+  for (uint32_t id = 1000000; id < 1000100; id++) {
+    assert(track_state(id) == -ENOENT);
+  }
+  mmcfs_get_stats(&after);
+  // only buckets with a matching fingerprint are searched
+  assert(after.bucket_probes - before.bucket_probes ==
+         after.filter_false - before.filter_false);
+}
+
+int main() {
+  host_log_level = ESP_LOG_WARN;
+  tracks_init(24, 48, true);
+
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  dev->erase_sectors = ERASE_SECTORS;
+  blkdev_file_set_erase_fill(dev, true);
+  assert(mmcfs_mount(dev) == ESP_OK);
+
+  assert(cache_track(PLAYING) == 0);
+  md5_digest_t digest;
+  mmcfs_pcm_handle_t playing;
+  track_digest(PLAYING, &digest);
+  assert(mmcfs_pcm_open(&digest, &playing) == 0);
+  int playing_frames = mmcfs_pcm_frames(playing);
+
+  for (uint32_t id = FAVORITE; id < TRACKS; id++) {
+    int ret = cache_track(id);
+    if (ret < 0) {
+      printf("test_reclaim: caching track %u failed, %d\n", id, ret);
+      abort();
+    }
+    play_track(FAVORITE);
+    check_frame(playing, PLAYING, id % playing_frames);
+  }
+
+  mmcfs_stats_t ms;
+  mmcfs_get_stats(&ms);
+  assert(ms.reclaim_runs > 0 && ms.reclaim_files > 0);
+  assert(track_state(PLAYING) == 0 && track_state(FAVORITE) == 0);
+  assert(track_state(FAVORITE + 1) == -ENOENT);
+  assert(track_state(TRACKS - 1) == 0);
+
+  // removed in pairs, nothing leaked
+  uint32_t cached = 0;
+  for (uint32_t id = 0; id < TRACKS; id++) {
+    if (track_state(id) == 0)
+      cached++;
+  }
+  assert(ms.reclaim_files == 2 * (TRACKS - cached));
+  assert(mmcfs_check() == ESP_OK);
+  check_stat_many(cached);
+
+  mmcfs_pcm_close(playing);
+  check_discard(dev);
+  check_checkpoint(dev);
+  check_filter();
+  check_stat_many(cached);
+
+  for (uint32_t id = TRACKS; id < TRACKS + 20; id++) {
+    assert(cache_track(id) == 0);
+  }
+  mmcfs_stats_t after;
+  mmcfs_get_stats(&after);
+  assert(after.reclaim_files > 0);
+  assert(mmcfs_check() == ESP_OK);
+  check_checkpoint(dev);
+
+  // compaction, with the newest track playing
+  falloc_stats_t before, compacted;
+  discard_idle();
+  falloc_stats(&before);
+  track_digest(TRACKS + 19, &digest);
+  assert(mmcfs_pcm_open(&digest, &playing) == 0);
+  playing_frames = mmcfs_pcm_frames(playing);
+
+  int steps = 0;
+  int ret;
+  while ((ret = mmcfs_compact_step(0)) == 1) {
+    check_frame(playing, TRACKS + 19, steps++ % playing_frames);
+  }
+  assert(ret == 0);
+  mmcfs_pcm_close(playing);
+
+  discard_idle();
+  mmcfs_get_stats(&after);
+  falloc_stats(&compacted);
+  assert(after.compact_files > 0 && after.compact_aborted == 0);
+  assert(compacted.free_blocks == before.free_blocks);
+  assert(compacted.free_extents < before.free_extents &&
+         compacted.largest_extent > before.largest_extent);
+  for (uint32_t id = 0; id < TRACKS + 20; id++) {
+    if (track_state(id) == 0)
+      verify_track(id);
+  }
+  assert(mmcfs_check() == ESP_OK);
+  check_checkpoint(dev);
+
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+
+  printf("test_reclaim: %u tracks cached, %u left; %u reclaims, %u files, "
+         "%.1f MiB, max %u us\n",
+         TRACKS, cached, ms.reclaim_runs, ms.reclaim_files,
+         ms.reclaim_bytes / 1048576.0, ms.reclaim_max_us);
+  printf("test_reclaim: compaction moved %u files, %.1f MiB; free space in "
+         "%u extents, was %u; largest %u blocks, was %u\n",
+         after.compact_files, after.compact_bytes / 1048576.0,
+         compacted.free_extents, before.free_extents,
+         compacted.largest_extent, before.largest_extent);
+  printf("test_reclaim: ok\n");
+  return 0;
+}
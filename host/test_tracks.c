@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "test_tracks.h"
+
+static uint32_t min_kib = 256;
+static uint32_t max_kib = 1536;
+static bool frames_reserved = false;
+
+void tracks_init(uint32_t min, uint32_t max, bool reserved) {
+  min_kib = min;
+  max_kib = max;
+  frames_reserved = reserved;
+}
+
+void fill_track_data(uint32_t id, uint32_t offset, uint8_t *buf, size_t len) {
+  uint64_t x = 0x9e3779b97f4a7c15ULL * (id + 1) + offset / 8;
+  for (size_t i = 0; i < len; i += 8) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    size_t n = len - i < 8 ? len - i : 8;
+    memcpy(&buf[i], &x, n);
+  }
+}
+
+void track_mp3(uint32_t id, uint32_t size, uint8_t *buf) {
+  for (uint32_t off = 0; off < size; off += PIC_BLOCK_SIZE) {
+    uint32_t len = size - off < PIC_BLOCK_SIZE ? size - off : PIC_BLOCK_SIZE;
+    fill_track_data(id, off, buf + off, len);
+  }
+}
+
+uint32_t track_size(uint32_t id) {
+  uint32_t h = id * 2654435761u;
+  return (min_kib + h % (max_kib - min_kib + 1)) * 1024 + h % 1024 + 1;
+}
+
+uint32_t track_frames(uint32_t size) {
+  // a second per 12KiB of mp3
+  if (frames_reserved)
+    return size / (12 * 1024) * 48000 * 4 / FRAME_BUF_SIZE;
+  // 25 frames per second
+  return (uint64_t)size * 25 / (128 * 1000 / 8);
+}
+
+void track_md5(uint32_t id, uint32_t size, md5_digest_t *digest) {
+  uint8_t buf[PIC_BLOCK_SIZE];
+  md5_context_t ctx;
+  esp_rom_md5_init(&ctx);
+  for (uint32_t off = 0; off < size; off += PIC_BLOCK_SIZE) {
+    uint32_t len = size - off < PIC_BLOCK_SIZE ? size - off : PIC_BLOCK_SIZE;
+    fill_track_data(id, off, buf, len);
+    esp_rom_md5_update(&ctx, buf, len);
+  }
+  esp_rom_md5_final(digest->bytes, &ctx);
+}
+
+void track_digest(uint32_t id, md5_digest_t *digest) {
+  track_md5(id, track_size(id), digest);
+}
+
+int write_track(mmcfs_file_handle_t file, uint32_t id, uint32_t size,
+                uint32_t frames) {
+  static _Thread_local uint8_t buf[PIC_BLOCK_SIZE];
+  static _Thread_local uint8_t frame[FRAME_BUF_SIZE];
+  int ret;
+
+  for (uint32_t off = 0; off < size; off += PIC_BLOCK_SIZE) {
+    uint32_t len = size - off < PIC_BLOCK_SIZE ? size - off : PIC_BLOCK_SIZE;
+    fill_track_data(id, off, buf, len);
+    ret = mmcfs_write_mp3(file, (char *)buf, len);
+    if (ret < 0)
+      return ret;
+  }
+
+  for (uint32_t i = 0; i < frames; i++) {
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, frame,
+                    FRAME_BUF_SIZE);
+    ret = mmcfs_write_pcm(file, (char *)frame, FRAME_BUF_SIZE);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+int cache_track_size(uint32_t id, uint32_t size, uint32_t frames) {
+  mmcfs_file_handle_t file;
+  md5_digest_t digest;
+
+  track_md5(id, size, &digest);
+  int ret = mmcfs_create_file(&digest, size, &file);
+  if (ret < 0)
+    return ret;
+
+  ret = write_track(file, id, size, frames);
+  if (ret < 0)
+    return ret;
+
+  return mmcfs_commit_file(file);
+}
+
+int cache_track(uint32_t id) {
+  uint32_t size = track_size(id);
+  return cache_track_size(id, size, track_frames(size));
+}
@@ -0,0 +1,40 @@
+#ifndef HOST_TEST_TRACKS_H
+#define HOST_TEST_TRACKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// after roadhill.h and mmcfs.h, which has no include guard
+
+/*
+ * synthetic tracks for the host tests and mmcfs_bench. Track id has an mp3
+ * of track_size(id) bytes and track_frames(size) pcm frames, filled by
+ * fill_track_data with id and id ^ 0x80000000, so anything read back can be
+ * checked without keeping what was written.
+ *
+ * tracks_init sets the mp3 sizes, min_kib to max_kib, and the pcm: as a
+ * 128kbps mp3 decodes, or if reserved exactly what create_file reserves for
+ * the mp3.
+ */
+void tracks_init(uint32_t min_kib, uint32_t max_kib, bool reserved);
+
+void fill_track_data(uint32_t id, uint32_t offset, uint8_t *buf, size_t len);
+// the first size bytes of mp3 id, as write_track writes them
+void track_mp3(uint32_t id, uint32_t size, uint8_t *buf);
+uint32_t track_size(uint32_t id);
+uint32_t track_frames(uint32_t size);
+
+// md5 of the first size bytes of mp3 id, its digest if size is its size
+void track_md5(uint32_t id, uint32_t size, md5_digest_t *digest);
+void track_digest(uint32_t id, md5_digest_t *digest);
+
+// mp3 and pcm into a file created for track id, returns as the writes do
+int write_track(mmcfs_file_handle_t file, uint32_t id, uint32_t size,
+                uint32_t frames);
+
+// create, write and commit; a failed write aborts the file
+int cache_track_size(uint32_t id, uint32_t size, uint32_t frames);
+int cache_track(uint32_t id);
+
+#endif
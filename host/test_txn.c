@@ -0,0 +1,231 @@
+/*
+ * mmcfs transaction size test. The commit changing the most buckets is set
+ * up on purpose, files going to their first choice bucket only so that
+ * digests pick the buckets:
+ *
+ * - the track's mp3 goes to a full bucket, pouring out an mp3 whose pcm is
+ *   in another one
+ * - its pcm, grown into MMCFS_PCM_MAX_EXTENTS extents, goes to another full
+ *   bucket, the pcm and each further extent pouring out one more such mp3
+ *
+ * The commit logs MMCFS_TXN_MAX_BUCKETS buckets. Tracks poured are gone,
+ * pcm and all, every other one is there, with and after remount.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "roadhill.h"
+#include "mmcfs.h"
+#include "blkdev_file.h"
+#include "test_tracks.h"
+#include "falloc.h"
+
+#define IMAGE "/tmp/mmcfs_test_txn.img"
+#define IMAGE_MIB 128
+#define BLOCK_SIZE 512 // for IMAGE_MIB
+
+#define MP3_SIZE (24 * 1024 + 123) // estimated 2 seconds of pcm
+#define FRAMES 1200                 // about 10 MiB, 49 seconds
+#define FILL_SIZE 100
+#define FILL_FIRST 1000
+
+#define BUCKET_FILES (sizeof(mmcfs_bucket_t) / sizeof(mmcfs_file_t))
+#define BLOCKS(bytes) (((bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+static uint16_t bucket_of(const md5_digest_t *digest) {
+  return (digest->bytes[0] << 4) + (digest->bytes[1] >> 4);
+}
+
+/*
+ * digest of the pcm write_track writes for track id
+ */
+static void pcm_md5(uint32_t id, uint32_t frames, md5_digest_t *digest) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  md5_context_t ctx;
+  esp_rom_md5_init(&ctx);
+  for (uint32_t i = 0; i < frames; i++) {
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, frame,
+                    FRAME_BUF_SIZE);
+    esp_rom_md5_update(&ctx, frame, FRAME_DAT_SIZE);
+  }
+  esp_rom_md5_final(digest->bytes, &ctx);
+}
+
+/*
+ * tracks whose mp3 fills the bucket of the track's mp3 (0) and pcm (1),
+ * oldest first, each with its pcm in a bucket of its own
+ */
+static uint32_t fillers[2][BUCKET_FILES];
+
+static void find_fillers(uint16_t mp3_bucket, uint16_t pcm_bucket) {
+  uint16_t used[2 + 2 * BUCKET_FILES] = {mp3_bucket, pcm_bucket};
+  int n_used = 2;
+  int found[2] = {0};
+
+  for (uint32_t id = FILL_FIRST;
+       found[0] < BUCKET_FILES || found[1] < BUCKET_FILES; id++) {
+    md5_digest_t digest;
+    track_md5(id, FILL_SIZE, &digest);
+    uint16_t b = bucket_of(&digest);
+    int k = b == mp3_bucket ? 0 : b == pcm_bucket ? 1 : -1;
+    if (k < 0 || found[k] == BUCKET_FILES)
+      continue;
+
+    pcm_md5(id, 1, &digest);
+    b = bucket_of(&digest);
+    bool taken = false;
+    for (int i = 0; i < n_used; i++)
+      taken |= used[i] == b;
+    if (taken)
+      continue;
+
+    used[n_used++] = b;
+    fillers[k][found[k]++] = id;
+  }
+}
+
+static mmcfs_file_handle_t create_track(uint32_t id) {
+  mmcfs_file_handle_t file;
+  md5_digest_t digest;
+
+  track_md5(id, MP3_SIZE, &digest);
+  assert(mmcfs_create_file(&digest, MP3_SIZE, &file) == 0);
+  assert(write_track(file, id, MP3_SIZE, 0) == 0);
+  return file;
+}
+
+static void write_frame(mmcfs_file_handle_t file, uint32_t id, int i) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, frame, FRAME_BUF_SIZE);
+  assert(mmcfs_write_pcm(file, (char *)frame, FRAME_BUF_SIZE) == 0);
+}
+
+static uint32_t free_blocks() {
+  falloc_stats_t fs;
+  falloc_stats(&fs);
+  return fs.free_blocks;
+}
+
+/*
+ * poured: the oldest mp3 in the bucket of the track's mp3, and one for the
+ * pcm and each further extent in the bucket of its pcm
+ */
+static bool poured(int k, int i) {
+  return k == 0 ? i < 1 : i < MMCFS_PCM_MAX_EXTENTS;
+}
+
+static void check(uint32_t id, uint32_t empty) {
+  static uint8_t frame[FRAME_BUF_SIZE];
+  static uint8_t expect[FRAME_BUF_SIZE];
+  md5_digest_t digest;
+  mmcfs_finfo_t finfo;
+  mmcfs_pcm_handle_t h;
+
+  uint32_t kept = 0;
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < BUCKET_FILES; i++) {
+      track_md5(fillers[k][i], FILL_SIZE, &digest);
+      int ret = mmcfs_stat(&digest, &finfo);
+      if (poured(k, i)) {
+        assert(ret == -ENOENT);
+      } else {
+        assert(ret == 0 && finfo.pcm_state == 2);
+        kept++;
+      }
+    }
+  }
+
+  track_md5(id, MP3_SIZE, &digest);
+  assert(mmcfs_pcm_open(&digest, &h) == 0);
+  assert(mmcfs_pcm_frames(h) == FRAMES);
+  for (int i = 0; i < FRAMES; i++) {
+    assert(mmcfs_pcm_read(h, i, (char *)frame) == 0);
+    fill_track_data(id ^ 0x80000000, i * FRAME_BUF_SIZE, expect,
+                    FRAME_BUF_SIZE);
+    assert(memcmp(frame, expect, FRAME_BUF_SIZE) == 0);
+  }
+  mmcfs_pcm_close(h);
+
+  // nothing left of the poured pcms
+  uint32_t used = empty - free_blocks();
+  uint32_t need = BLOCKS(MP3_SIZE) + FRAMES * BLOCKS(FRAME_BUF_SIZE) +
+                  kept * (BLOCKS(FILL_SIZE) + BLOCKS(FRAME_BUF_SIZE));
+  if (used != need) {
+    printf("test_txn: %u blocks used, %u expected\n", used, need);
+    abort();
+  }
+  assert(mmcfs_check() == ESP_OK);
+}
+
+int main() {
+  mmcfs_stats_t ms;
+
+  host_log_level = ESP_LOG_WARN;
+  unlink(IMAGE);
+  blkdev_t *dev = blkdev_file_open(IMAGE, (uint64_t)IMAGE_MIB * 2048, NULL);
+  assert(dev);
+  mmcfs_mount_opts_t opts = {.one_choice = true};
+  mmcfs_set_mount_opts(&opts);
+  assert(mmcfs_mount(dev) == ESP_OK);
+  uint32_t empty = free_blocks();
+
+  // a track with its mp3 and pcm in different buckets
+  uint32_t id = 0;
+  uint16_t mp3_bucket, pcm_bucket;
+  for (;; id++) {
+    md5_digest_t digest;
+    track_md5(id, MP3_SIZE, &digest);
+    mp3_bucket = bucket_of(&digest);
+    pcm_md5(id, FRAMES, &digest);
+    pcm_bucket = bucket_of(&digest);
+    if (mp3_bucket != pcm_bucket)
+      break;
+  }
+
+  find_fillers(mp3_bucket, pcm_bucket);
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < BUCKET_FILES; i++)
+      assert(cache_track_size(fillers[k][i], FILL_SIZE, 1) == 0);
+  }
+  mmcfs_get_stats(&ms);
+  assert(ms.bucket_pours == 0);
+
+  // written alongside another track, so its pcm cannot grow in place
+  mmcfs_file_handle_t t = create_track(id);
+  mmcfs_file_handle_t other = create_track(id + 1);
+  for (int i = 0; i < FRAMES; i++) {
+    write_frame(t, id, i);
+    write_frame(other, id + 1, i);
+  }
+  assert(mmcfs_commit_file(t) == 0);
+  mmcfs_abort_file(other);
+
+  mmcfs_get_stats(&ms);
+  printf("test_txn: mp3 in bucket %u, pcm in %u, %u pours, %u buckets of "
+         "%u logged\n",
+         mp3_bucket, pcm_bucket, ms.bucket_pours, ms.txn_max_buckets,
+         MMCFS_LOG_MAX_BUCKETS);
+  // extents pour their pcm's bucket without counting
+  assert(ms.bucket_pours == 2);
+  assert(ms.txn_max_buckets == MMCFS_TXN_MAX_BUCKETS);
+  check(id, empty);
+
+  mmcfs_unmount();
+  assert(mmcfs_mount(dev) == ESP_OK);
+  mmcfs_set_mount_opts(NULL);
+  check(id, empty);
+
+  mmcfs_unmount();
+  blkdev_file_close(dev);
+  unlink(IMAGE);
+  printf("test_txn: ok\n");
+  return 0;
+}
@@ -19,6 +19,7 @@
 #include "esp_log.h"
 
 #include "adpcm_stream.h"
+#include "mmcfs.h"
 
 static const char *TAG = "adpcm_stream";
 
@@ -35,9 +36,24 @@ static int mp3_read_cb(audio_element_handle_t el, char *buf, int len,
 
   QueueHandle_t in = ((pacman_context_t *)ctx)->in;
   QueueHandle_t out = ((pacman_context_t *)ctx)->out;
+  mmcfs_mp3_handle_t mp3 = ((pacman_context_t *)ctx)->mp3;
   pacman_inmsg_t msg;
   pacman_outmsg_t outmsg;
 
+  // transcoding a cached mp3 again, end of stream on error as well
+  if (mp3) {
+    int ret = mmcfs_mp3_read(mp3, buf, len);
+    if (ret < 0) {
+      ESP_LOGI(TAG, "mp3 read from card failed, %d", ret);
+      outmsg.type = PCM_OUT_ERROR;
+      outmsg.data = NULL;
+      outmsg.len = 0;
+      xQueueSend(out, &outmsg, portMAX_DELAY);
+      return 0;
+    }
+    return ret;
+  }
+
   while (read_buf == NULL) {
     if (pdTRUE != xQueueReceive(in, &msg, portMAX_DELAY)) {
       continue;
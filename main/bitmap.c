@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "bitmap.h"
+
+/*
+ * mask of bits [lo, hi) within one word, 0 <= lo < hi <= 32
+ */
+static inline uint32_t word_mask(uint32_t lo, uint32_t hi) {
+  uint32_t m = hi == 32 ? 0xffffffff : ((uint32_t)1 << hi) - 1;
+  return m & ~(((uint32_t)1 << lo) - 1);
+}
+
+void bitmap_init(bitmap_t *bm, uint32_t *words, uint32_t nbits) {
+  bm->words = words;
+  bm->nbits = nbits;
+  bitmap_reset(bm);
+}
+
+void bitmap_reset(bitmap_t *bm) {
+  memset(bm->words, 0, BITMAP_WORDS(bm->nbits) * sizeof(uint32_t));
+  bm->used = 0;
+}
+
+void bitmap_recount(bitmap_t *bm) {
+  bm->used = bitmap_count(bm, 0, bm->nbits);
+}
+
+/*
+ * `inv` is 0 to search for set bits, 0xffffffff for clear bits.
+ */
+static uint32_t find_first(const bitmap_t *bm, uint32_t start, uint32_t end,
+                           uint32_t inv) {
+  if (start >= end)
+    return end;
+
+  uint32_t w = start / 32;
+  uint32_t last = (end - 1) / 32;
+  uint32_t v = (bm->words[w] ^ inv) & word_mask(start % 32, 32);
+
+  while (v == 0) {
+    if (++w > last)
+      return end;
+    v = bm->words[w] ^ inv;
+  }
+
+  uint32_t i = w * 32 + __builtin_ctz(v);
+  return i < end ? i : end;
+}
+
+uint32_t bitmap_find_set(const bitmap_t *bm, uint32_t start, uint32_t end) {
+  return find_first(bm, start, end, 0);
+}
+
+uint32_t bitmap_find_clear(const bitmap_t *bm, uint32_t start, uint32_t end) {
+  return find_first(bm, start, end, 0xffffffff);
+}
+
+uint32_t bitmap_find_clear_run(const bitmap_t *bm, uint32_t start,
+                               uint32_t len) {
+  if (len == 0)
+    return start <= bm->nbits ? start : (uint32_t)-1;
+
+  while (start < bm->nbits && bm->nbits - start >= len) {
+    start = bitmap_find_clear(bm, start, bm->nbits);
+    if (start == bm->nbits || bm->nbits - start < len)
+      break;
+
+    uint32_t set = bitmap_find_set(bm, start, start + len);
+    if (set == start + len)
+      return start;
+    start = set + 1;
+  }
+  return -1;
+}
+
+uint32_t bitmap_count(const bitmap_t *bm, uint32_t start, uint32_t end) {
+  if (start >= end)
+    return 0;
+
+  uint32_t first = start / 32;
+  uint32_t last = (end - 1) / 32;
+
+  if (first == last)
+    return __builtin_popcount(bm->words[first] &
+                              word_mask(start % 32, (end - 1) % 32 + 1));
+
+  uint32_t n = __builtin_popcount(bm->words[first] & word_mask(start % 32, 32));
+  for (uint32_t w = first + 1; w < last; w++) {
+    n += __builtin_popcount(bm->words[w]);
+  }
+  n += __builtin_popcount(bm->words[last] & word_mask(0, (end - 1) % 32 + 1));
+  return n;
+}
+
+/*
+ * set (or clear) every bit in range, no checks. Caller has verified the
+ * range is all clear (or all set).
+ */
+static void fill_range(bitmap_t *bm, uint32_t start, uint32_t end, bool set) {
+  uint32_t first = start / 32;
+  uint32_t last = (end - 1) / 32;
+
+  if (first == last) {
+    uint32_t m = word_mask(start % 32, (end - 1) % 32 + 1);
+    bm->words[first] = set ? bm->words[first] | m : bm->words[first] & ~m;
+    return;
+  }
+
+  uint32_t m = word_mask(start % 32, 32);
+  bm->words[first] = set ? bm->words[first] | m : bm->words[first] & ~m;
+
+  for (uint32_t w = first + 1; w < last; w++) {
+    bm->words[w] = set ? 0xffffffff : 0;
+  }
+
+  m = word_mask(0, (end - 1) % 32 + 1);
+  bm->words[last] = set ? bm->words[last] | m : bm->words[last] & ~m;
+}
+
+esp_err_t bitmap_set_range(bitmap_t *bm, uint32_t start, uint32_t end,
+                           uint32_t *conflict) {
+  if (start > end || end > bm->nbits)
+    return ESP_ERR_INVALID_ARG;
+
+  if (start == end)
+    return ESP_OK;
+
+  uint32_t i = bitmap_find_set(bm, start, end);
+  if (i != end) {
+    if (conflict)
+      *conflict = i;
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  fill_range(bm, start, end, true);
+  bm->used += end - start;
+  return ESP_OK;
+}
+
+esp_err_t bitmap_clear_range(bitmap_t *bm, uint32_t start, uint32_t end,
+                             uint32_t *conflict) {
+  if (start > end || end > bm->nbits)
+    return ESP_ERR_INVALID_ARG;
+
+  if (start == end)
+    return ESP_OK;
+
+  uint32_t i = bitmap_find_clear(bm, start, end);
+  if (i != end) {
+    if (conflict)
+      *conflict = i;
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  fill_range(bm, start, end, false);
+  bm->used -= end - start;
+  return ESP_OK;
+}
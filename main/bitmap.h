@@ -0,0 +1,70 @@
+#ifndef APPLICATION_BITMAP_H
+#define APPLICATION_BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * fixed size bitmap on 32-bit words.
+ *
+ * Bit i lives in words[i / 32] at bit (i % 32), which on a little-endian cpu
+ * is the same memory layout as the old byte array (byte i / 8, bit i % 8).
+ *
+ * Range operations touch whole words where they can, searches skip all-ones
+ * or all-zeros words and use count-trailing-zeros inside a word. `used` is
+ * kept up to date by the range operations.
+ *
+ * All ranges are [start, end), end exclusive.
+ */
+typedef struct {
+  uint32_t *words;
+  uint32_t nbits;
+  uint32_t used;
+} bitmap_t;
+
+#define BITMAP_WORDS(nbits) (((nbits) + 31) / 32)
+
+/* words must hold BITMAP_WORDS(nbits) words, they are cleared */
+void bitmap_init(bitmap_t *bm, uint32_t *words, uint32_t nbits);
+void bitmap_reset(bitmap_t *bm);
+
+/* recompute used counter, after words are loaded from elsewhere */
+void bitmap_recount(bitmap_t *bm);
+
+/* no range check */
+static inline bool bitmap_test(const bitmap_t *bm, uint32_t i) {
+  return !!(bm->words[i / 32] & ((uint32_t)1 << (i % 32)));
+}
+
+/*
+ * set all bits in range, which must all be clear. Otherwise nothing is
+ * changed, ESP_ERR_INVALID_STATE is returned and the first set bit is
+ * stored in conflict (if not NULL).
+ */
+esp_err_t bitmap_set_range(bitmap_t *bm, uint32_t start, uint32_t end,
+                           uint32_t *conflict);
+
+/* the reverse of bitmap_set_range */
+esp_err_t bitmap_clear_range(bitmap_t *bm, uint32_t start, uint32_t end,
+                             uint32_t *conflict);
+
+/* first set / clear bit in range, or end if none */
+uint32_t bitmap_find_set(const bitmap_t *bm, uint32_t start, uint32_t end);
+uint32_t bitmap_find_clear(const bitmap_t *bm, uint32_t start, uint32_t end);
+
+/* first run of `len` clear bits at or after start, or -1 (0xffffffff) */
+uint32_t bitmap_find_clear_run(const bitmap_t *bm, uint32_t start,
+                               uint32_t len);
+
+/* popcount of range */
+uint32_t bitmap_count(const bitmap_t *bm, uint32_t start, uint32_t end);
+
+static inline uint32_t bitmap_used(const bitmap_t *bm) { return bm->used; }
+
+static inline uint32_t bitmap_free(const bitmap_t *bm) {
+  return bm->nbits - bm->used;
+}
+
+#endif
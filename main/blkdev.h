@@ -0,0 +1,66 @@
+#ifndef APPLICATION_BLKDEV_H
+#define APPLICATION_BLKDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+/*
+ * sector device underneath mmcfs.
+ *
+ * sector size is always 512 bytes. mmcfs never talks to sdmmc (or anything
+ * else) directly, it goes through this interface, so the same mmcfs code runs
+ * on the board (sdmmc backend, blkdev_sdmmc.c) and on a linux pc (file
+ * backend, host/blkdev_file.c).
+ */
+typedef struct blkdev blkdev_t;
+
+struct blkdev {
+  const char *name;
+
+  /* total sectors */
+  uint64_t capacity;
+
+  esp_err_t (*read)(blkdev_t *dev, void *dst, size_t start_sector,
+                    size_t sector_count);
+  esp_err_t (*write)(blkdev_t *dev, const void *src, size_t start_sector,
+                     size_t sector_count);
+
+  /*
+   * optional, tell the card sectors hold nothing worth keeping (discard, or
+   * erase), so its garbage collection need not copy them. NULL if not
+   * supported. erase_sectors is the unit erasing is worth doing in (the
+   * allocation unit), 0 if not known.
+   */
+  esp_err_t (*erase)(blkdev_t *dev, size_t start_sector, size_t sector_count);
+  uint32_t erase_sectors;
+
+  /* backend private data */
+  void *ctx;
+};
+
+static inline esp_err_t blkdev_read(blkdev_t *dev, void *dst,
+                                    size_t start_sector, size_t sector_count) {
+  return dev->read(dev, dst, start_sector, sector_count);
+}
+
+static inline esp_err_t blkdev_write(blkdev_t *dev, const void *src,
+                                     size_t start_sector,
+                                     size_t sector_count) {
+  return dev->write(dev, src, start_sector, sector_count);
+}
+
+static inline esp_err_t blkdev_erase(blkdev_t *dev, size_t start_sector,
+                                     size_t sector_count) {
+  if (dev->erase == NULL)
+    return ESP_ERR_NOT_SUPPORTED;
+  return dev->erase(dev, start_sector, sector_count);
+}
+
+/*
+ * initialize sdmmc host and card (slot 1, 1-bit), returns NULL on failure.
+ */
+blkdev_t *blkdev_sdmmc_init(void);
+
+#endif
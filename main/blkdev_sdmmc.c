@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "driver/sdmmc_defs.h"
+#include "driver/sdmmc_host.h"
+#include "sdmmc_cmd.h"
+
+#include "blkdev.h"
+
+static const char *TAG = "blkdev_sdmmc";
+
+/*
+ * print sdmmc card info
+ */
+static void sdmmc_card_info(const sdmmc_card_t *card) {
+  bool print_scr = false;
+  bool print_csd = false;
+  const char *type;
+
+  ESP_LOGI(TAG, "sdmmc name: %s", card->cid.name);
+  if (card->is_sdio) {
+    type = "SDIO";
+    print_scr = true;
+    print_csd = true;
+  } else if (card->is_mmc) {
+    type = "MMC";
+    print_csd = true;
+  } else {
+    type = (card->ocr & SD_OCR_SDHC_CAP) ? "SDHC/SDXC" : "SDSC";
+  }
+
+  ESP_LOGI(TAG, "sdmmc type: %s", type);
+
+  if (card->max_freq_khz < 1000) {
+    ESP_LOGI(TAG, "sdmmc speed: %d kHz", card->max_freq_khz);
+  } else {
+    ESP_LOGI(TAG, "sdmmc speed: %d MHz%s", card->max_freq_khz / 1000,
+             card->is_ddr ? ", DDR" : "");
+  }
+
+  ESP_LOGI(TAG, "sdmmc size: %lluMB, sector size: %d",
+           ((uint64_t)card->csd.capacity) * card->csd.sector_size /
+               (1024 * 1024),
+           card->csd.sector_size);
+
+  if (print_csd) {
+    ESP_LOGI(TAG,
+             "sdmmc csd: ver=%d, sector_size=%d, capacity=%d read_bl_len=%d",
+             card->csd.csd_ver, card->csd.sector_size, card->csd.capacity,
+             card->csd.read_block_len);
+  }
+
+  if (print_scr) {
+    ESP_LOGI(TAG, "sdmmc scr: sd_spec=%d, bus_width=%d", card->scr.sd_spec,
+             card->scr.bus_width);
+  }
+}
+
+static esp_err_t sdmmc_blkdev_read(blkdev_t *dev, void *dst,
+                                   size_t start_sector, size_t sector_count) {
+  return sdmmc_read_sectors((sdmmc_card_t *)dev->ctx, dst, start_sector,
+                            sector_count);
+}
+
+static esp_err_t sdmmc_blkdev_write(blkdev_t *dev, const void *src,
+                                    size_t start_sector, size_t sector_count) {
+  return sdmmc_write_sectors((sdmmc_card_t *)dev->ctx, src, start_sector,
+                             sector_count);
+}
+
+/*
+ * discard if the card supports it (no erased state to write, cheaper),
+ * otherwise erase
+ */
+static esp_err_t sdmmc_blkdev_erase(blkdev_t *dev, size_t start_sector,
+                                    size_t sector_count) {
+  sdmmc_card_t *card = (sdmmc_card_t *)dev->ctx;
+  sdmmc_erase_arg_t arg =
+      sdmmc_can_discard(card) == ESP_OK ? SDMMC_DISCARD_ARG : SDMMC_ERASE_ARG;
+  return sdmmc_erase_sectors(card, start_sector, sector_count, arg);
+}
+
+static blkdev_t sdmmc_blkdev = {
+    .name = "sdmmc",
+    .read = sdmmc_blkdev_read,
+    .write = sdmmc_blkdev_write,
+    .erase = sdmmc_blkdev_erase,
+};
+
+/*
+ * Initialize mmc card. If successful, the (singleton) sdmmc blkdev is
+ * returned.
+ */
+blkdev_t *blkdev_sdmmc_init(void) {
+  esp_err_t err = sdmmc_host_init();
+  if (err != ESP_OK) {
+    return NULL;
+  }
+
+  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
+  slot_config.width = 1;
+  err = sdmmc_host_init_slot(SDMMC_HOST_SLOT_1, &slot_config);
+  if (err != ESP_OK) {
+    return NULL;
+  }
+
+  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+  host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+
+  sdmmc_card_t *card = (sdmmc_card_t *)malloc(sizeof(sdmmc_card_t));
+  if (card == NULL) {
+    return NULL;
+  }
+
+  err = sdmmc_card_init(&host, card);
+  if (err != ESP_OK) {
+    free(card);
+    return NULL;
+  }
+
+  sdmmc_card_info(card);
+
+  sdmmc_blkdev.capacity = card->csd.capacity;
+  sdmmc_blkdev.ctx = card;
+
+  // allocation unit from SD status, mmc cards leave it to mmcfs
+  if (!card->is_mmc && !card->is_sdio) {
+    sdmmc_blkdev.erase_sectors = card->ssr.alloc_unit_kb * 2;
+    ESP_LOGI(TAG, "sdmmc allocation unit: %u KiB, discard %s",
+             card->ssr.alloc_unit_kb,
+             sdmmc_can_discard(card) == ESP_OK ? "supported" : "not supported");
+  }
+  return &sdmmc_blkdev;
+}
@@ -0,0 +1,420 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "falloc.h"
+
+static const char *TAG = "falloc";
+
+/*
+ * note on the index
+ *
+ * 1. all nodes live in one pool array, referenced by index. Index 0 is the
+ *    nil node (height 0), so a zeroed link means no child. The pool grows by
+ *    doubling; with CONFIG_SPIRAM_USE_MALLOC large pools land in psram.
+ * 2. every free extent is linked in both trees. Free extents never overlap
+ *    or touch (adjacent ones are merged), so moving the start of an extent
+ *    within its own range does not change its position in the by-start tree,
+ *    only the by-size tree needs re-insertion.
+ */
+#define NIL (0)
+#define BY_START (0)
+#define BY_SIZE (1)
+#define LEFT (0)
+#define RIGHT (1)
+
+typedef struct {
+  uint32_t start;
+  uint32_t len;
+  uint32_t child[2][2]; // [tree][LEFT/RIGHT]
+  int8_t height[2];     // [tree]
+} falloc_node_t;
+
+static falloc_node_t *pool = NULL;
+static uint32_t pool_size = 0;
+static uint32_t pool_used = 0;
+static uint32_t recycled = NIL; // singly-linked by child[0][0]
+
+static uint32_t root[2] = {NIL, NIL};
+static uint32_t block_count = 0;
+static uint32_t free_blocks = 0;
+static uint32_t free_extents = 0;
+
+#define HEIGHT(t, n) (pool[n].height[t])
+#define CHILD(t, n, d) (pool[n].child[t][d])
+
+static uint32_t node_alloc(uint32_t start, uint32_t len) {
+  uint32_t n;
+  if (recycled != NIL) {
+    n = recycled;
+    recycled = CHILD(0, n, 0);
+  } else {
+    if (pool_used == pool_size) {
+      uint32_t size = pool_size * 2;
+      falloc_node_t *p =
+          (falloc_node_t *)realloc(pool, size * sizeof(falloc_node_t));
+      if (p == NULL) {
+        return NIL;
+      }
+      pool = p;
+      pool_size = size;
+    }
+    n = pool_used++;
+  }
+
+  memset(&pool[n], 0, sizeof(falloc_node_t));
+  pool[n].start = start;
+  pool[n].len = len;
+  return n;
+}
+
+static void node_free(uint32_t n) {
+  CHILD(0, n, 0) = recycled;
+  recycled = n;
+}
+
+static int node_cmp(int t, uint32_t a, uint32_t b) {
+  if (t == BY_SIZE && pool[a].len != pool[b].len) {
+    return pool[a].len < pool[b].len ? -1 : 1;
+  }
+  if (pool[a].start != pool[b].start) {
+    return pool[a].start < pool[b].start ? -1 : 1;
+  }
+  return 0;
+}
+
+static void fix_height(int t, uint32_t n) {
+  int8_t l = HEIGHT(t, CHILD(t, n, LEFT));
+  int8_t r = HEIGHT(t, CHILD(t, n, RIGHT));
+  HEIGHT(t, n) = (l > r ? l : r) + 1;
+}
+
+/*
+ * rotate n towards d, returns the new subtree root
+ */
+static uint32_t rotate(int t, uint32_t n, int d) {
+  uint32_t c = CHILD(t, n, !d);
+  CHILD(t, n, !d) = CHILD(t, c, d);
+  CHILD(t, c, d) = n;
+  fix_height(t, n);
+  fix_height(t, c);
+  return c;
+}
+
+static uint32_t rebalance(int t, uint32_t n) {
+  fix_height(t, n);
+  int bf = HEIGHT(t, CHILD(t, n, LEFT)) - HEIGHT(t, CHILD(t, n, RIGHT));
+  if (bf > 1) {
+    uint32_t l = CHILD(t, n, LEFT);
+    if (HEIGHT(t, CHILD(t, l, LEFT)) < HEIGHT(t, CHILD(t, l, RIGHT))) {
+      CHILD(t, n, LEFT) = rotate(t, l, LEFT);
+    }
+    return rotate(t, n, RIGHT);
+  }
+  if (bf < -1) {
+    uint32_t r = CHILD(t, n, RIGHT);
+    if (HEIGHT(t, CHILD(t, r, RIGHT)) < HEIGHT(t, CHILD(t, r, LEFT))) {
+      CHILD(t, n, RIGHT) = rotate(t, r, RIGHT);
+    }
+    return rotate(t, n, LEFT);
+  }
+  return n;
+}
+
+static uint32_t avl_insert(int t, uint32_t r, uint32_t n) {
+  if (r == NIL) {
+    CHILD(t, n, LEFT) = NIL;
+    CHILD(t, n, RIGHT) = NIL;
+    HEIGHT(t, n) = 1;
+    return n;
+  }
+
+  int d = node_cmp(t, n, r) > 0;
+  CHILD(t, r, d) = avl_insert(t, CHILD(t, r, d), n);
+  return rebalance(t, r);
+}
+
+static uint32_t avl_remove_min(int t, uint32_t r, uint32_t *min) {
+  if (CHILD(t, r, LEFT) == NIL) {
+    *min = r;
+    return CHILD(t, r, RIGHT);
+  }
+  CHILD(t, r, LEFT) = avl_remove_min(t, CHILD(t, r, LEFT), min);
+  return rebalance(t, r);
+}
+
+/*
+ * n must be in the tree
+ */
+static uint32_t avl_remove(int t, uint32_t r, uint32_t n) {
+  assert(r != NIL);
+
+  int c = node_cmp(t, n, r);
+  if (c != 0) {
+    int d = c > 0;
+    CHILD(t, r, d) = avl_remove(t, CHILD(t, r, d), n);
+    return rebalance(t, r);
+  }
+
+  uint32_t left = CHILD(t, r, LEFT);
+  uint32_t right = CHILD(t, r, RIGHT);
+  if (right == NIL) {
+    return left;
+  }
+
+  uint32_t m;
+  right = avl_remove_min(t, right, &m);
+  CHILD(t, m, LEFT) = left;
+  CHILD(t, m, RIGHT) = right;
+  return rebalance(t, m);
+}
+
+static void index_insert(uint32_t n) {
+  root[BY_START] = avl_insert(BY_START, root[BY_START], n);
+  root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], n);
+  free_extents++;
+}
+
+static void index_remove(uint32_t n) {
+  root[BY_START] = avl_remove(BY_START, root[BY_START], n);
+  root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], n);
+  free_extents--;
+}
+
+/*
+ * free extent with the largest start <= block, or NIL
+ */
+static uint32_t find_floor(uint32_t block) {
+  uint32_t r = root[BY_START], best = NIL;
+  while (r != NIL) {
+    if (pool[r].start <= block) {
+      best = r;
+      r = CHILD(BY_START, r, RIGHT);
+    } else {
+      r = CHILD(BY_START, r, LEFT);
+    }
+  }
+  return best;
+}
+
+/*
+ * free extent with the smallest start >= block, or NIL
+ */
+static uint32_t find_ceil(uint32_t block) {
+  uint32_t r = root[BY_START], best = NIL;
+  while (r != NIL) {
+    if (pool[r].start >= block) {
+      best = r;
+      r = CHILD(BY_START, r, LEFT);
+    } else {
+      r = CHILD(BY_START, r, RIGHT);
+    }
+  }
+  return best;
+}
+
+/*
+ * smallest free extent with len >= blocks (lowest start among equals)
+ */
+static uint32_t find_best_fit(uint32_t blocks) {
+  uint32_t r = root[BY_SIZE], best = NIL;
+  while (r != NIL) {
+    if (pool[r].len >= blocks) {
+      best = r;
+      r = CHILD(BY_SIZE, r, LEFT);
+    } else {
+      r = CHILD(BY_SIZE, r, RIGHT);
+    }
+  }
+  return best;
+}
+
+esp_err_t falloc_init(uint32_t count) {
+  falloc_deinit();
+
+  pool_size = 64;
+  pool = (falloc_node_t *)malloc(pool_size * sizeof(falloc_node_t));
+  if (pool == NULL) {
+    pool_size = 0;
+    return ESP_ERR_NO_MEM;
+  }
+
+  // nil node
+  memset(&pool[NIL], 0, sizeof(falloc_node_t));
+  pool_used = 1;
+  block_count = count;
+  return ESP_OK;
+}
+
+void falloc_deinit() {
+  free(pool);
+  pool = NULL;
+  pool_size = 0;
+  pool_used = 0;
+  recycled = NIL;
+  root[BY_START] = NIL;
+  root[BY_SIZE] = NIL;
+  block_count = 0;
+  free_blocks = 0;
+  free_extents = 0;
+}
+
+uint32_t falloc_alloc(uint32_t blocks) {
+  if (blocks == 0) {
+    return FALLOC_NONE;
+  }
+
+  uint32_t n = find_best_fit(blocks);
+  if (n == NIL) {
+    return FALLOC_NONE;
+  }
+
+  uint32_t start = pool[n].start;
+  if (pool[n].len == blocks) {
+    index_remove(n);
+    node_free(n);
+  } else {
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], n);
+    pool[n].start += blocks;
+    pool[n].len -= blocks;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], n);
+  }
+
+  free_blocks -= blocks;
+  return start;
+}
+
+esp_err_t falloc_reserve(uint32_t start, uint32_t blocks) {
+  if (blocks == 0 || start + blocks > block_count || start + blocks < start) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint32_t n = find_floor(start);
+  if (n == NIL || start + blocks > pool[n].start + pool[n].len) {
+    ESP_LOGI(TAG, "reserving %u blocks from %u, not free", blocks, start);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  uint32_t end = start + blocks;
+  uint32_t n_start = pool[n].start;
+  uint32_t n_end = pool[n].start + pool[n].len;
+
+  if (n_start == start && n_end == end) {
+    index_remove(n);
+    node_free(n);
+  } else if (n_start == start) {
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], n);
+    pool[n].start = end;
+    pool[n].len = n_end - end;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], n);
+  } else if (n_end == end) {
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], n);
+    pool[n].len = start - n_start;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], n);
+  } else {
+    uint32_t m = node_alloc(end, n_end - end);
+    if (m == NIL) {
+      return ESP_ERR_NO_MEM;
+    }
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], n);
+    pool[n].len = start - n_start;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], n);
+    index_insert(m);
+  }
+
+  free_blocks -= blocks;
+  return ESP_OK;
+}
+
+esp_err_t falloc_free(uint32_t start, uint32_t blocks) {
+  if (blocks == 0 || start + blocks > block_count || start + blocks < start) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  uint32_t end = start + blocks;
+
+  // any free extent starting before end must also end before start
+  uint32_t left = find_floor(end - 1);
+  if (left != NIL && pool[left].start + pool[left].len > start) {
+    ESP_LOGI(TAG, "freeing %u blocks from %u, overlaps free extent %u+%u",
+             blocks, start, pool[left].start, pool[left].len);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (left != NIL && pool[left].start + pool[left].len != start) {
+    left = NIL;
+  }
+
+  uint32_t right = find_ceil(end);
+  if (right != NIL && pool[right].start != end) {
+    right = NIL;
+  }
+
+  if (left != NIL && right != NIL) {
+    uint32_t right_len = pool[right].len;
+    index_remove(right);
+    node_free(right);
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], left);
+    pool[left].len += blocks + right_len;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], left);
+  } else if (left != NIL) {
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], left);
+    pool[left].len += blocks;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], left);
+  } else if (right != NIL) {
+    root[BY_SIZE] = avl_remove(BY_SIZE, root[BY_SIZE], right);
+    pool[right].start = start;
+    pool[right].len += blocks;
+    root[BY_SIZE] = avl_insert(BY_SIZE, root[BY_SIZE], right);
+  } else {
+    uint32_t n = node_alloc(start, blocks);
+    if (n == NIL) {
+      return ESP_ERR_NO_MEM;
+    }
+    index_insert(n);
+  }
+
+  free_blocks += blocks;
+  return ESP_OK;
+}
+
+uint32_t falloc_next_free(uint32_t from, uint32_t *blocks) {
+  uint32_t n = find_ceil(from);
+  if (n == NIL) {
+    return FALLOC_NONE;
+  }
+  if (blocks) {
+    *blocks = pool[n].len;
+  }
+  return pool[n].start;
+}
+
+uint32_t falloc_find(uint32_t block, uint32_t *blocks) {
+  uint32_t n = find_floor(block);
+  if (n == NIL || block >= pool[n].start + pool[n].len) {
+    return FALLOC_NONE;
+  }
+  if (blocks) {
+    *blocks = pool[n].len;
+  }
+  return pool[n].start;
+}
+
+void falloc_stats(falloc_stats_t *stats) {
+  uint32_t n = root[BY_SIZE];
+  while (n != NIL && CHILD(BY_SIZE, n, RIGHT) != NIL) {
+    n = CHILD(BY_SIZE, n, RIGHT);
+  }
+
+  stats->free_blocks = free_blocks;
+  stats->free_extents = free_extents;
+  stats->largest_extent = n == NIL ? 0 : pool[n].len;
+  stats->fragmentation =
+      free_blocks == 0
+          ? 0
+          : 1000 - (uint32_t)((uint64_t)stats->largest_extent * 1000 /
+                              free_blocks);
+}
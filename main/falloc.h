@@ -0,0 +1,67 @@
+#ifndef APPLICATION_FALLOC_H
+#define APPLICATION_FALLOC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/*
+ * in-ram index of free extents (runs of free blocks) in mmcfs data area.
+ *
+ * Each free extent is kept in two AVL trees, one ordered by start block (for
+ * coalescing neighbours on free) and one ordered by (length, start) for
+ * best-fit lookup. Allocate and free are O(log n) in the number of free
+ * extents.
+ *
+ * The index mirrors bit_array in mmcfs.c, it does not own it. mmcfs sets or
+ * clears bits and updates the index together.
+ */
+
+#define FALLOC_NONE ((uint32_t)-1)
+
+typedef struct {
+  uint32_t free_blocks;
+  uint32_t free_extents;
+  uint32_t largest_extent;
+
+  /* 1 - largest_extent / free_blocks, in permille. 0 means not fragmented */
+  uint32_t fragmentation;
+} falloc_stats_t;
+
+/* start with no free blocks at all */
+esp_err_t falloc_init(uint32_t block_count);
+void falloc_deinit(void);
+
+/*
+ * best-fit, returns start block or FALLOC_NONE if there is no free extent
+ * large enough.
+ */
+uint32_t falloc_alloc(uint32_t blocks);
+
+/*
+ * take given range out of the index, the range must be free.
+ */
+esp_err_t falloc_reserve(uint32_t start, uint32_t blocks);
+
+/*
+ * return given range to the index, merging with adjacent free extents. The
+ * range must not overlap any free extent.
+ */
+esp_err_t falloc_free(uint32_t start, uint32_t blocks);
+
+/*
+ * find the first free extent starting at or after given block. returns
+ * start block (and length) or FALLOC_NONE.
+ */
+uint32_t falloc_next_free(uint32_t from, uint32_t *blocks);
+
+/*
+ * find the free extent containing given block, returns its start (and
+ * length) or FALLOC_NONE.
+ */
+uint32_t falloc_find(uint32_t block, uint32_t *blocks);
+
+void falloc_stats(falloc_stats_t *stats);
+
+#endif
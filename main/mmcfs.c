@@ -1,15 +1,24 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
 #include "esp_err.h"
+#include "esp_timer.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "esp_rom_md5.h"
-
-#include "driver/sdmmc_defs.h"
-#include "driver/sdmmc_host.h"
-#include "sdmmc_cmd.h"
+#include "soc/soc_memory_layout.h"
 
 #include "roadhill.h"
+#include "bitmap.h"
+#include "blkdev.h"
+#include "falloc.h"
 #include "mmcfs.h"
 
 static const char *TAG = "mmcfs";
@@ -20,6 +29,19 @@ static const char *TAG = "mmcfs";
  */
 #define SUPERBLOCK_SECTOR (2)
 
+// allocation unit assumed if the card does not tell, usual for SDHC
+#define DEFAULT_AU_SECT (4 * 1024 * 1024 / 512)
+
+/*
+ * checkpoint header, followed by up to 32 sectors of bitmap
+ */
+#define CHECKPOINT_SECTOR (2 * 1024 * 1024 / 512)
+
+/*
+ * write log header, followed by up to MMCFS_LOG_MAX_BUCKETS buckets
+ */
+#define LOG_SECTOR (1024 * 1024 / 512)
+
 /*
  * note on bucket and write log
  *
@@ -29,8 +51,19 @@ static const char *TAG = "mmcfs";
  *    shift 12 bits to left we got 0x3e80. So the first byte of a null file
  *    in this bucket is 0x3e, the secod byte is 0x80, and all remaining
  *    bytes are 0x00.
- * 3. write log has two buckets. the former is the bucket being written. the
- *    latter is bitwise NOT-ed.
+ * 3. buckets are changed in transactions, see txn_commit. The write log
+ *    (mmcfs_log_t) holds every bucket of the last transaction, and is written
+ *    before any of them is written in place. A valid log is therefore the
+ *    last transaction, and mount writes its buckets again where they differ
+ *    on card (torn by a power loss). A torn log fails its md5, no bucket was
+ *    touched then.
+ * 4. older firmware logged one bucket at a time at superblock's log_start,
+ *    followed by its bitwise NOT. Mount still replays that once, then
+ *    invalidates it.
+ * 5. a file is in one of two buckets, the one its first 12 bits give or
+ *    a second choice (mmcfs_bucket_alt), so lookups try both. Older
+ *    firmware only ever used the first and does not see files in the
+ *    second.
  */
 
 /*
@@ -41,9 +74,23 @@ const char mmcfs_superblock_magic[16] = {0xf2, 0xf4, 0x82, 0x9f, 0x63, 0x69,
                                          0x28, 0x4c, 0xc5, 0x8c};
 
 /*
- * pointer to mmc card (driver level)
+ * echo "morning my bird" | md5sum
+ */
+const char mmcfs_log_magic[16] = {0x6d, 0xbf, 0xcb, 0x1f, 0xc3, 0x50,
+                                  0x58, 0xab, 0xe9, 0x11, 0x0e, 0x20,
+                                  0x91, 0xd9, 0xf7, 0x6a};
+
+/*
+ * echo "morning my dog" | md5sum
+ */
+const char mmcfs_checkpoint_magic[16] = {0x08, 0x6c, 0x7e, 0xe7, 0xf2, 0xd0,
+                                         0xf7, 0xea, 0xfb, 0x4e, 0x17, 0x33,
+                                         0xd5, 0x86, 0x7e, 0x2f};
+
+/*
+ * pointer to sector device (sdmmc on board, image file on host)
  */
-static sdmmc_card_t *card = NULL;
+static blkdev_t *dev = NULL;
 
 /*
  * pointer to superblock, but it is not necessary for holding superblock
@@ -61,7 +108,8 @@ static mmcfs_t *fs = NULL;
  */
 static uint64_t last_access = 0;
 
-static uint8_t bit_array[16 * 1024] __attribute__((aligned(4))) = {0};
+static uint32_t bit_words[BITMAP_WORDS(MMCFS_MAX_BITARRAY_SIZE)] = {0};
+static bitmap_t bit_array = {bit_words, MMCFS_MAX_BITARRAY_SIZE, 0};
 
 /* The ONLY read/write buf for mmc io, which means data must be
  * copied into this buffer before doing any write operation.
@@ -74,11 +122,230 @@ static uint8_t bit_array[16 * 1024] __attribute__((aligned(4))) = {0};
  */
 static uint8_t iobuf[16 * 1024] __attribute__((aligned(8))) = {0};
 
+/*
+ * Locking. mmcfs_mount and mmcfs_unmount must not run concurrently with
+ * anything else, all other calls may come from different tasks. A file
+ * handle or pcm reader is used by one task at a time.
+ *
+ * - meta_lock: buckets, bucket cache, log, checkpoint, iobuf, bbuf,
+ *   open_files, last_access. Held through the metadata part of a commit.
+ * - discard_lock: held by the discard task while a unit of free space is
+ *   claimed for erase, by reclaim, which would take it for space in use,
+ *   and by compaction while it reserves and commits a move.
+ * - alloc_lock: bit_array and the free extent index.
+ * - readers_lock: the pcm_readers list and stale flags.
+ * - dev_lock: one card command at a time. FreeRTOS hands a mutex to the
+ *   highest priority waiter, so a player task waits for at most the command
+ *   in flight, not for a whole commit.
+ *
+ * - stats_lock: op latency histograms, taken with nothing else after it.
+ *
+ * Order is meta, discard, alloc, readers, dev. Frame reads take only readers
+ * and dev.
+ *
+ * Other stats counters are not locked (card counters are under dev_lock),
+ * they may be slightly off while operations run concurrently.
+ */
+static SemaphoreHandle_t meta_lock = NULL;
+static SemaphoreHandle_t discard_lock = NULL;
+static SemaphoreHandle_t alloc_lock = NULL;
+static SemaphoreHandle_t readers_lock = NULL;
+static SemaphoreHandle_t dev_lock = NULL;
+static SemaphoreHandle_t stats_lock = NULL;
+
+static mmcfs_stats_t stats = {0};
+
+static void lock(SemaphoreHandle_t l) { xSemaphoreTake(l, portMAX_DELAY); }
+static void unlock(SemaphoreHandle_t l) { xSemaphoreGive(l); }
+
+static esp_err_t dev_read(void *dst, size_t start_sector, size_t sector_count) {
+  lock(dev_lock);
+  esp_err_t err = blkdev_read(dev, dst, start_sector, sector_count);
+  stats.dev_reads++;
+  stats.dev_sectors_read += sector_count;
+  stats.dev_errors += err != ESP_OK;
+  unlock(dev_lock);
+  return err;
+}
+
+static esp_err_t dev_write(const void *src, size_t start_sector,
+                           size_t sector_count) {
+  lock(dev_lock);
+  esp_err_t err = blkdev_write(dev, src, start_sector, sector_count);
+  stats.dev_writes++;
+  stats.dev_sectors_written += sector_count;
+  stats.dev_errors += err != ESP_OK;
+  unlock(dev_lock);
+  return err;
+}
+
+static esp_err_t dev_erase(size_t start_sector, size_t sector_count) {
+  lock(dev_lock);
+  esp_err_t err = blkdev_erase(dev, start_sector, sector_count);
+  stats.dev_erases++;
+  stats.dev_errors += err != ESP_OK;
+  unlock(dev_lock);
+  return err;
+}
+
+/*
+ * pool of CONFIG_MMCFS_IOBUF_POOL_SIZE dma capable buffers, the size of
+ * iobuf, for file data that has to be bounced (caller's buffer not dma
+ * capable, no readahead or write combining buffer). Allocated at mount. An
+ * operation holds at most one.
+ */
+#define POOL_BUF_SIZE sizeof(iobuf)
+
+static QueueHandle_t pool_q = NULL;
+static uint8_t *pool_bufs[CONFIG_MMCFS_IOBUF_POOL_SIZE] = {NULL};
+
+static uint8_t *pool_get() {
+  uint8_t *buf;
+  xQueueReceive(pool_q, &buf, portMAX_DELAY);
+  return buf;
+}
+
+static void pool_put(uint8_t *buf) { xQueueSend(pool_q, &buf, 0); }
+
+static void pool_deinit() {
+  for (int i = 0; i < CONFIG_MMCFS_IOBUF_POOL_SIZE; i++) {
+    heap_caps_free(pool_bufs[i]);
+    pool_bufs[i] = NULL;
+  }
+  if (pool_q) {
+    vQueueDelete(pool_q);
+    pool_q = NULL;
+  }
+}
+
+static esp_err_t pool_init() {
+  pool_q = xQueueCreate(CONFIG_MMCFS_IOBUF_POOL_SIZE, sizeof(uint8_t *));
+  if (pool_q == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  for (int i = 0; i < CONFIG_MMCFS_IOBUF_POOL_SIZE; i++) {
+    pool_bufs[i] = (uint8_t *)heap_caps_malloc(POOL_BUF_SIZE, MALLOC_CAP_DMA);
+    if (pool_bufs[i] == NULL) {
+      pool_deinit();
+      return ESP_ERR_NO_MEM;
+    }
+    pool_put(pool_bufs[i]);
+  }
+  return ESP_OK;
+}
+
+void *mmcfs_buf_alloc(size_t size) {
+  return heap_caps_malloc(size, MALLOC_CAP_DMA);
+}
+
+void mmcfs_buf_free(void *buf) { heap_caps_free(buf); }
+
+bool mmcfs_buf_is_dma(const void *buf) {
+  return ((uintptr_t)buf & 3) == 0 && esp_ptr_dma_capable(buf);
+}
+
+/*
+ * bucket table is scanned in chunks of this size at mount
+ */
+#define SCAN_BUF_SIZE (16 * 1024)
+
 /*
  * buffer for fast read/write bucket
  */
 static mmcfs_bucket_t bbuf;
 
+/*
+ * in-memory copy of checkpoint header. ckpt_clean is true if the header on
+ * card is CLEAN and matches bit_array, i.e. nothing changed since it was
+ * written.
+ */
+static mmcfs_checkpoint_t ckpt __attribute__((aligned(4)));
+static bool ckpt_clean = false;
+
+/*
+ * a log or bucket write failed, so buckets on card are unknown until the log
+ * is replayed at next mount. No checkpoint is written and blocks of the
+ * records involved stay reserved till then.
+ */
+static bool bucket_unsure = false;
+
+/*
+ * blocks reserved for a file being moved by compaction, on card only once
+ * the move is committed. alloc_lock.
+ */
+static uint32_t compact_dest_start = 0;
+static uint32_t compact_dest_end = 0;
+
+// given when files are removed, so the compaction task looks again
+static SemaphoreHandle_t compact_wake = NULL;
+
+/*
+ * discard of freed space. The card is told what is free in units of
+ * discard_unit_sect sectors (its allocation unit, or CONFIG_MMCFS_DISCARD_KB,
+ * doubled while there would be more than DISCARD_MAX_UNITS), so its garbage
+ * collection does not copy dead data around and sequential writes stay
+ * fast. Units blocks are freed in are marked pending; the discard task
+ * claims one that is wholly free like any allocation, erases it in commands
+ * of discard_chunk_sect, releasing the card to readers between them, and
+ * frees it again. Claimed blocks are free on card, checkpoint leaves them out.
+ * Pending units are forgotten at unmount. alloc_lock.
+ */
+#define DISCARD_MAX_UNITS 32768
+#define DISCARD_IDLE_MS 10000
+
+static uint32_t *discard_words = NULL;
+static bitmap_t discard_pending = {0};
+static uint32_t discard_unit_sect = 0;
+static uint32_t discard_chunk_sect = 0;
+static uint32_t discard_playing_ms = 0;
+static uint32_t discard_start = 0;
+static uint32_t discard_end = 0;
+
+static volatile bool discard_stopping = false;
+static SemaphoreHandle_t discard_done = NULL;
+static SemaphoreHandle_t discard_wake = NULL;
+
+static mmcfs_mount_opts_t mount_opts = {0};
+
+static const char *op_names[MMCFS_OP_MAX] = {
+    "stat",   "create",   "write_mp3",     "write_pcm",
+    "commit", "pcm_read", "bucket_update", "reclaim", "discard",
+    "mp3_read",
+};
+
+const char *mmcfs_op_name(mmcfs_op_t op) {
+  return op < MMCFS_OP_MAX ? op_names[op] : "unknown";
+}
+
+/*
+ * one call of op that started at t (esp_timer_get_time), ret < 0 is an error
+ */
+static void op_record(mmcfs_op_t op, int64_t t, int ret) {
+  uint32_t us = esp_timer_get_time() - t;
+  int k = 0;
+  while (k < MMCFS_OP_HIST_SIZE - 1 && us >= (16u << k))
+    k++;
+
+  lock(stats_lock);
+  mmcfs_op_stats_t *o = &stats.ops[op];
+  o->count++;
+  o->errors += ret < 0;
+  o->total_us += us;
+  if (o->max_us < us)
+    o->max_us = us;
+  o->hist[k]++;
+  unlock(stats_lock);
+}
+
+static esp_err_t release_blocks(uint32_t start, uint32_t end);
+static esp_err_t checkpoint_invalidate();
+static void pcm_invalidate(const md5_digest_t *digest);
+static bool pcm_reading(const md5_digest_t *digest);
+static bool pcm_playing();
+static void open_files_exclude(bitmap_t *bm);
+static void open_files_drop();
+
 static uint32_t mmcfs_block_count() {
   // TODO staticfy
   return fs->block_count;
@@ -122,13 +389,26 @@ static bool mmcfs_file_is_pcm(const mmcfs_file_t *file) {
   return file->type == MMCFS_FILE_PCM;
 }
 
+static bool mmcfs_file_is_extent(const mmcfs_file_t *file) {
+  return file->type == MMCFS_FILE_EXTENT;
+}
+
+/*
+ * self of extent record i (1..) of a pcm file, in the bucket of the pcm
+ */
+static void mmcfs_extent_digest(const md5_digest_t *pcm, int i,
+                                md5_digest_t *out) {
+  *out = *pcm;
+  out->bytes[15] ^= i;
+}
+
 /*
  * sets file to null
  */
-static void mmcfs_file_nullify(mmcfs_file_t *file, const md5_digest_t *digest) {
+static void mmcfs_file_nullify(mmcfs_file_t *file, uint16_t bucket) {
   memset(file, 0, sizeof(mmcfs_file_t));
-  file->self.bytes[0] = digest->bytes[0];
-  file->self.bytes[1] = digest->bytes[1] & 0xf0;
+  file->self.bytes[0] = bucket >> 4;
+  file->self.bytes[1] = bucket << 4;
 }
 
 static bool mmcfs_file_digest_match(const mmcfs_file_t *file,
@@ -141,10 +421,19 @@ static uint16_t mmcfs_bucket_index(const md5_digest_t *digest) {
   return (((uint16_t)bytes[0]) << 4) + (bytes[1] >> 4);
 }
 
-static size_t mmcfs_bucket_start_sector(const md5_digest_t *digest) {
-  size_t index = ((size_t)digest->bytes[0]) << 4;
-  index += digest->bytes[1] >> 4;
-  return fs->bucket_start + index * fs->bucket_sect;
+/*
+ * second choice bucket, from the next 12 bits of digest, never the first
+ * one. A file goes to the emptier of the two, so a bucket overflows only
+ * when both are full.
+ */
+static uint16_t mmcfs_bucket_alt(const md5_digest_t *digest) {
+  const uint8_t *bytes = digest->bytes;
+  uint16_t h = (((uint16_t)bytes[2]) << 4) + (bytes[3] >> 4);
+  return mmcfs_bucket_index(digest) ^ (h | 1);
+}
+
+static size_t mmcfs_bucket_start_sector(uint16_t index) {
+  return fs->bucket_start + (size_t)index * fs->bucket_sect;
 }
 
 static size_t mmcfs_bucket_sector_count() { return fs->bucket_sect; }
@@ -174,283 +463,786 @@ static int mmcfs_bucket_find_file(const mmcfs_bucket_t *bucket,
 }
 
 /*
- * read a bucket into iobuf
+ * write-through bucket cache of CONFIG_MMCFS_BUCKET_CACHE_SIZE buckets, the
+ * least recently used one is replaced. A cached bucket always equals the one
+ * on card, it is updated only after the card write succeeds.
  */
-static int mmcfs_bucket_read(const md5_digest_t *digest,
-                             mmcfs_bucket_t *bucket) {
-  size_t start_sector = mmcfs_bucket_start_sector(digest);
-  size_t sector_count = mmcfs_bucket_sector_count();
-  char *buf = bucket ? (char *)bucket : (char *)iobuf;
-  esp_err_t err = sdmmc_read_sectors(card, buf, start_sector, sector_count);
-  if (err != ESP_OK) {
-    return -EIO;
+typedef struct {
+  uint16_t index; // bucket index
+  uint32_t tick;  // last use, 0 for empty slot
+} bcache_slot_t;
+
+static bcache_slot_t *bcache_slots = NULL;
+static mmcfs_bucket_t *bcache_data = NULL;
+static int bcache_size = 0;
+static uint32_t bcache_tick = 0;
+
+static void bcache_init() {
+  int size = CONFIG_MMCFS_BUCKET_CACHE_SIZE;
+#ifdef CONFIG_MMCFS_BUCKET_CACHE_SPIRAM
+  uint32_t caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+#else
+  uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+#endif
+
+  if (size == 0)
+    return;
+
+  bcache_slots = (bcache_slot_t *)calloc(size, sizeof(bcache_slot_t));
+  bcache_data =
+      (mmcfs_bucket_t *)heap_caps_malloc(size * sizeof(mmcfs_bucket_t), caps);
+  if (bcache_slots == NULL || bcache_data == NULL) {
+    ESP_LOGI(TAG, "no memory for %d buckets, bucket cache disabled", size);
+    free(bcache_slots);
+    heap_caps_free(bcache_data);
+    bcache_slots = NULL;
+    bcache_data = NULL;
+    return;
   }
-  return 0;
+
+  bcache_size = size;
+  bcache_tick = 0;
 }
 
-/*
- *
- */
-static int mmcfs_bucket_update(mmcfs_bucket_t *bucket) {
+static void bcache_deinit() {
+  free(bcache_slots);
+  heap_caps_free(bcache_data);
+  bcache_slots = NULL;
+  bcache_data = NULL;
+  bcache_size = 0;
+}
 
-  if (bucket != NULL && bucket != (mmcfs_bucket_t *)iobuf) {
-    memcpy(iobuf, bucket, sizeof(mmcfs_bucket_t));
+static int bcache_find(uint16_t index) {
+  for (int i = 0; i < bcache_size; i++) {
+    if (bcache_slots[i].tick && bcache_slots[i].index == index)
+      return i;
   }
+  return -1;
+}
 
-  mmcfs_bucket_t *log = (mmcfs_bucket_t *)iobuf;
-  uint32_t *c0 = (uint32_t *)&log[0];
-  uint32_t *c1 = (uint32_t *)&log[1];
-  for (int i = 0; i < sizeof(mmcfs_bucket_t) / sizeof(uint32_t); i++) {
-    c1[i] = ~c0[i];
-  }
+static mmcfs_bucket_t *bcache_lookup(uint16_t index) {
+  int i = bcache_find(index);
+  if (i < 0)
+    return NULL;
 
-  // write log
-  esp_err_t err = sdmmc_write_sectors(card, iobuf, fs->log_start, fs->log_sect);
-  if (err != ESP_OK) {
-    return -EIO;
-  }
+  bcache_slots[i].tick = ++bcache_tick;
+  return &bcache_data[i];
+}
 
-  err = sdmmc_write_sectors(card, iobuf,
-                            mmcfs_bucket_start_sector(&log->files[0].self),
-                            mmcfs_bucket_sector_count());
-  if (err != ESP_OK) {
-    return -EIO;
+static void bcache_put(uint16_t index, const mmcfs_bucket_t *bucket) {
+  if (bcache_size == 0)
+    return;
+
+  int i = bcache_find(index);
+  if (i < 0) {
+    i = 0;
+    for (int j = 1; j < bcache_size; j++) {
+      if (bcache_slots[j].tick < bcache_slots[i].tick)
+        i = j;
+    }
   }
 
-  return 0;
+  bcache_slots[i].index = index;
+  bcache_slots[i].tick = ++bcache_tick;
+  memcpy(&bcache_data[i], bucket, sizeof(mmcfs_bucket_t));
 }
 
 /*
- * remove a given file, possibly also remove the linked pcm
- * TODO write log
+ * drop a bucket whose state on card is unknown (failed write)
  */
-static int mmcfs_bucket_remove_file(const md5_digest_t *digest,
-                                    bool remove_linked_pcm) {
-  int ret = mmcfs_bucket_read(digest, NULL);
-  if (ret < 0)
-    return ret;
+static void bcache_drop(uint16_t index) {
+  int i = bcache_find(index);
+  if (i >= 0)
+    bcache_slots[i].tick = 0;
+}
 
-  mmcfs_bucket_t *buc = (mmcfs_bucket_t *)iobuf;
+/*
+ * digest filter, a 16 bit fingerprint of each file in every bucket, in slot
+ * order, 0 for null files. With the two bucket choices it works as a cuckoo
+ * filter: a lookup reads only a bucket holding the fingerprint, so a miss
+ * usually reads none, and a placement knows how full both choices are.
+ * Fingerprints of a bucket are taken whenever it is read from or written to
+ * card, filter_valid has a bit for each bucket taken. The mount scan takes
+ * all of them, after mounting from checkpoint filter_task does. meta_lock.
+ */
+static uint16_t *filter = NULL;
+static uint32_t *filter_valid = NULL;
+static int filter_buckets = 0; // valid ones
+
+static void filter_init() {
+  filter_buckets = 0;
+#ifdef CONFIG_MMCFS_DIGEST_FILTER
+#ifdef CONFIG_MMCFS_DIGEST_FILTER_SPIRAM
+  uint32_t caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+#else
+  uint32_t caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+#endif
+  if (mount_opts.no_filter)
+    return;
 
-  // find returns -ENOENT or index
-  int index = mmcfs_bucket_find_file(buc, digest);
-  if (index == -ENOENT) {
-    return 0;
-  } else if (index < 0) {
-    return index;
+  size_t slots = fs->bucket_count * mmcfs_bucket_max_files();
+  filter = (uint16_t *)heap_caps_malloc(slots * sizeof(uint16_t), caps);
+  filter_valid = (uint32_t *)calloc(BITMAP_WORDS(fs->bucket_count),
+                                    sizeof(uint32_t));
+  if (filter == NULL || filter_valid == NULL) {
+    ESP_LOGI(TAG, "no memory for digest filter, lookups read buckets");
+    heap_caps_free(filter);
+    free(filter_valid);
+    filter = NULL;
+    filter_valid = NULL;
   }
+#endif
+}
 
-  if (mmcfs_file_is_mp3(&buc->files[index]) && remove_linked_pcm) {
-    md5_digest_t link = buc->files[index].link;
-    // api seems problematic, should the caller provide file type?
-    int r = mmcfs_bucket_remove_file(&link, false);
-    if (r < 0)
-      return r;
+static void filter_deinit() {
+  heap_caps_free(filter);
+  free(filter_valid);
+  filter = NULL;
+  filter_valid = NULL;
+  filter_buckets = 0;
+}
 
-    return mmcfs_bucket_remove_file(digest, false);
-  }
+static uint16_t filter_fingerprint(const md5_digest_t *digest) {
+  // bits not used for either bucket choice
+  uint16_t fp = ((uint16_t)digest->bytes[4] << 8) | digest->bytes[5];
+  return fp ? fp : 1;
+}
+
+static bool filter_has(uint16_t index) {
+  return filter && (filter_valid[index / 32] & (1u << (index % 32)));
+}
+
+static void filter_take(uint16_t index, const mmcfs_bucket_t *bucket) {
+  if (filter == NULL)
+    return;
 
   int max_files = mmcfs_bucket_max_files();
-  for (int i = index; i < max_files; i++) {
-    if (i < max_files - 1) {
-      buc->files[i] = buc->files[i + 1];
-    } else {
-      mmcfs_file_nullify(&buc->files[i], digest);
-    }
+  uint16_t *fps = &filter[index * max_files];
+  for (int k = 0; k < max_files; k++) {
+    const mmcfs_file_t *f = &bucket->files[k];
+    fps[k] = mmcfs_file_is_null(f) ? 0 : filter_fingerprint(&f->self);
   }
 
-  return mmcfs_bucket_update(NULL);
+  if (!filter_has(index)) {
+    filter_valid[index / 32] |= 1u << (index % 32);
+    filter_buckets++;
+  }
 }
 
-/* These three functions are UNSAFE. Callers must check range for themselves.
+/*
+ * bucket whose state on card is unknown (failed write)
  */
-bool test_bit(int i) { return !!(bit_array[i / 8] & ((uint8_t)1 << (i % 8))); }
-
-void set_bit(int i) {
-  // ESP_LOGI(TAG, "set bit %d", i);
-  bit_array[i / 8] |= (1 << (i % 8));
+static void filter_drop(uint16_t index) {
+  if (filter_has(index)) {
+    filter_valid[index / 32] &= ~(1u << (index % 32));
+    filter_buckets--;
+  }
 }
 
-void clear_bit(int i) { bit_array[i / 8] &= ~(1 << (i % 8)); }
-
-/* Set all bits from start to end (exclusive).
- *
- * The function returns
- * - ESP_ERR_INVALID_ARG, if start > end or end > block_count
- * - ESP_ERR_INVALID_STATE, if
+/*
+ * true if digest is known not to be in bucket
  */
-esp_err_t set_bits(uint32_t start, uint32_t end, uint32_t *conflict) {
-  if (start > end || end > mmcfs_block_count()) {
-    return ESP_ERR_INVALID_ARG;
-  }
+static bool filter_absent(uint16_t index, const md5_digest_t *digest) {
+  if (!filter_has(index))
+    return false;
 
-  for (uint32_t i = start; i < end; i++) {
-    if (test_bit(i)) {
-      *conflict = i;
-      return ESP_ERR_INVALID_STATE;
-    }
+  int max_files = mmcfs_bucket_max_files();
+  const uint16_t *fps = &filter[index * max_files];
+  uint16_t fp = filter_fingerprint(digest);
+  for (int k = 0; k < max_files && fps[k]; k++) {
+    if (fps[k] == fp)
+      return false;
   }
+  return true;
+}
 
-  for (uint32_t i = start; i < end; i++) {
-    set_bit(i);
-  }
+/*
+ * files in bucket, or -1 if not known
+ */
+static int filter_fill(uint16_t index) {
+  if (!filter_has(index))
+    return -1;
 
-  return ESP_OK;
+  int max_files = mmcfs_bucket_max_files();
+  const uint16_t *fps = &filter[index * max_files];
+  int n = 0;
+  while (n < max_files && fps[n])
+    n++;
+  return n;
 }
 
-/* Clear all bits from start to end (exclusive)
- * TODO optimize performance
+/*
+ * files in use order, for reclaiming space. Entries form a max-heap on used,
+ * so if there are more files than CONFIG_MMCFS_LRU_INDEX_SIZE, the most
+ * recently used ones are left out (lru_partial). used starts as the access
+ * counter on card and is bumped in RAM when the file is played. Built by the
+ * mount scan, or on first reclaim after mounting from checkpoint. meta_lock.
  */
-esp_err_t clear_bits(uint32_t start, uint32_t end, uint32_t *conflict) {
-  if (start > end || end > mmcfs_block_count()) {
-    return ESP_ERR_INVALID_ARG;
+typedef struct {
+  uint32_t used;
+  uint32_t block_start;
+  uint32_t block_end;
+  uint16_t bucket;
+} lru_entry_t;
+
+static lru_entry_t *lru = NULL;
+static int lru_size = 0;
+static int lru_count = 0;
+static bool lru_built = false;
+static bool lru_partial = false;
+
+static void lru_init() {
+  lru_size = CONFIG_MMCFS_LRU_INDEX_SIZE;
+  lru = (lru_entry_t *)malloc(lru_size * sizeof(lru_entry_t));
+  if (lru == NULL) {
+    ESP_LOGI(TAG, "no memory for %d lru entries, no space reclaim", lru_size);
+    lru_size = 0;
   }
+  lru_count = 0;
+  lru_built = false;
+  lru_partial = false;
+}
 
-  for (uint32_t i = start; i < end; i++) {
-    if (!test_bit(i)) {
-      *conflict = i;
+static void lru_deinit() {
+  free(lru);
+  lru = NULL;
+  lru_size = 0;
+  lru_count = 0;
+  lru_built = false;
+}
 
-      ESP_LOGI(TAG, "clear_bits error, bit %u not set", i);
+static void lru_swap(int i, int j) {
+  lru_entry_t e = lru[i];
+  lru[i] = lru[j];
+  lru[j] = e;
+}
 
-      return ESP_ERR_INVALID_STATE;
-    }
+static void lru_sift_up(int i) {
+  while (i > 0 && lru[(i - 1) / 2].used < lru[i].used) {
+    lru_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
   }
+}
 
-  for (uint32_t i = start; i < end; i++) {
-    clear_bit(i);
+static void lru_sift_down(int i) {
+  for (;;) {
+    int m = i;
+    int l = 2 * i + 1;
+    if (l < lru_count && lru[l].used > lru[m].used)
+      m = l;
+    if (l + 1 < lru_count && lru[l + 1].used > lru[m].used)
+      m = l + 1;
+    if (m == i)
+      return;
+    lru_swap(i, m);
+    i = m;
   }
-
-  return ESP_OK;
 }
 
-/*
- * for mp3 and pcm file
- * create_mp3 (md5 & size)
- * create_pcm (with mp3 md5, only estimated size)
- *
- * write_mp3
- * write_pcm
- *
- * read mp3
- * read pcm by mp3_md5, sect
- * read pcm by pcm_md5, sect
- */
+static void lru_add(const mmcfs_file_t *f, uint16_t bucket) {
+  // go with their pcm
+  if (mmcfs_file_is_extent(f))
+    return;
 
-/* round up to next power of 2
- */
-uint64_t round_power2(uint64_t n) {
-  n = n - 1;
-  while (n & (n - 1)) {
-    n = n & (n - 1);
+  lru_entry_t e = {f->access, f->block_start, f->block_end, bucket};
+
+  if (lru_count < lru_size) {
+    lru[lru_count] = e;
+    lru_sift_up(lru_count++);
+    return;
   }
-  return n << 1;
-}
 
-/*
- * print sdmmc card info
- */
-static void sdmmc_card_info(const sdmmc_card_t *card) {
-  bool print_scr = false;
-  bool print_csd = false;
-  const char *type;
+  // full, keep the older one
+  lru_partial = true;
+  if (lru_size && e.used < lru[0].used) {
+    lru[0] = e;
+    lru_sift_down(0);
+  }
+}
 
-  ESP_LOGI(TAG, "sdmmc name: %s", card->cid.name);
-  if (card->is_sdio) {
-    type = "SDIO";
-    print_scr = true;
-    print_csd = true;
-  } else if (card->is_mmc) {
-    type = "MMC";
-    print_csd = true;
-  } else {
-    type = (card->ocr & SD_OCR_SDHC_CAP) ? "SDHC/SDXC" : "SDSC";
+static int lru_find(uint16_t bucket, uint32_t block_start,
+                    uint32_t block_end) {
+  for (int i = 0; i < lru_count; i++) {
+    if (lru[i].block_start == block_start && lru[i].block_end == block_end &&
+        lru[i].bucket == bucket)
+      return i;
   }
+  return -1;
+}
 
-  ESP_LOGI(TAG, "sdmmc type: %s", type);
+static void lru_remove(uint16_t bucket, uint32_t block_start,
+                       uint32_t block_end) {
+  int i = lru_find(bucket, block_start, block_end);
+  if (i < 0)
+    return;
 
-  if (card->max_freq_khz < 1000) {
-    ESP_LOGI(TAG, "sdmmc speed: %d kHz", card->max_freq_khz);
-  } else {
-    ESP_LOGI(TAG, "sdmmc speed: %d MHz%s", card->max_freq_khz / 1000,
-             card->is_ddr ? ", DDR" : "");
+  lru[i] = lru[--lru_count];
+  if (i < lru_count) {
+    lru_sift_up(i);
+    lru_sift_down(i);
   }
+}
 
-  ESP_LOGI(TAG, "sdmmc size: %lluMB, sector size: %d",
-           ((uint64_t)card->csd.capacity) * card->csd.sector_size /
-               (1024 * 1024),
-           card->csd.sector_size);
+static void lru_touch(const mmcfs_file_t *f, uint16_t bucket) {
+  int i = lru_find(bucket, f->block_start, f->block_end);
+  if (i < 0)
+    return;
 
-  if (print_csd) {
-    ESP_LOGI(TAG,
-             "sdmmc csd: ver=%d, sector_size=%d, capacity=%d read_bl_len=%d",
-             card->csd.csd_ver, card->csd.sector_size, card->csd.capacity,
-             card->csd.read_block_len);
-  }
+  lru[i].used = last_access++;
+  lru_sift_up(i);
+}
 
-  if (print_scr) {
-    ESP_LOGI(TAG, "sdmmc scr: sd_spec=%d, bus_width=%d", card->scr.sd_spec,
-             card->scr.bus_width);
-  }
+static void lru_move(uint16_t bucket, uint32_t block_start, uint32_t block_end,
+                     uint32_t new_start) {
+  int i = lru_find(bucket, block_start, block_end);
+  if (i < 0)
+    return;
+
+  lru[i].block_start = new_start;
+  lru[i].block_end = new_start + block_end - block_start;
 }
 
 /*
- * validate superblock
+ * record of lru entry in its bucket, or -1 if it is gone
  */
-bool mmcfs_superblock_valid(mmcfs_superblock_t *superblock) {
-  md5_context_t md5_ctx;
-  uint8_t digest[16];
-  if (memcmp(superblock->magic, mmcfs_superblock_magic,
-             sizeof(mmcfs_superblock_magic)) == 0) {
-    esp_rom_md5_init(&md5_ctx);
-    esp_rom_md5_update(&md5_ctx, superblock, 512 - 16);
-    esp_rom_md5_final(digest, &md5_ctx);
-    if (memcmp(digest, superblock->md5, sizeof(digest)) == 0) {
-      return true;
-    }
+static int lru_find_file(const mmcfs_bucket_t *bucket, const lru_entry_t *e) {
+  for (int k = 0; k < mmcfs_bucket_max_files(); k++) {
+    const mmcfs_file_t *f = &bucket->files[k];
+    if (mmcfs_file_is_null(f))
+      break;
+    if (f->block_start == e->block_start && f->block_end == e->block_end)
+      return k;
   }
-  return false;
+  return -1;
 }
 
 /*
- * Initialize mmc card. If successful, (variable) card is available.
+ * read a bucket into iobuf, or given bucket buffer
  */
-static esp_err_t init_mmc() {
-  esp_err_t err = sdmmc_host_init();
-  if (err != ESP_OK) {
-    return err;
-  }
-
-  sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
-  slot_config.width = 1;
-  err = sdmmc_host_init_slot(SDMMC_HOST_SLOT_1, &slot_config);
-  if (err != ESP_OK) {
-    return err;
-  }
-
-  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
-  host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+static int mmcfs_bucket_read(uint16_t index, mmcfs_bucket_t *bucket) {
+  char *buf = bucket ? (char *)bucket : (char *)iobuf;
 
-  card = (sdmmc_card_t *)malloc(sizeof(sdmmc_card_t));
-  if (card == NULL) {
-    return ESP_ERR_NO_MEM;
+  mmcfs_bucket_t *cached = bcache_lookup(index);
+  if (cached) {
+    stats.bucket_cache_hits++;
+    memcpy(buf, cached, sizeof(mmcfs_bucket_t));
+    return 0;
   }
+  stats.bucket_cache_misses++;
 
-  err = sdmmc_card_init(&host, card);
+  size_t start_sector = mmcfs_bucket_start_sector(index);
+  size_t sector_count = mmcfs_bucket_sector_count();
+  esp_err_t err = dev_read(buf, start_sector, sector_count);
   if (err != ESP_OK) {
-    free(card);
-    card = NULL;
-    return err;
+    return -EIO;
   }
 
-  sdmmc_card_info(card);
-  return ESP_OK;
+  bcache_put(index, (mmcfs_bucket_t *)buf);
+  filter_take(index, (mmcfs_bucket_t *)buf);
+  return 0;
 }
 
 /*
- * print mmcfs info
+ * find digest in its first, then second choice bucket, read into given
+ * bucket buffer (iobuf if NULL). Returns index of the file and the bucket
+ * it is in, or -ENOENT.
  */
-void mmcfs_info(mmcfs_t *fs) {
-  const char *TAG = pcTaskGetName(NULL);
+static int mmcfs_bucket_lookup(const md5_digest_t *digest,
+                               mmcfs_bucket_t *bucket, uint16_t *where) {
+  uint16_t choice[2] = {mmcfs_bucket_index(digest), mmcfs_bucket_alt(digest)};
+  mmcfs_bucket_t *buf = bucket ? bucket : (mmcfs_bucket_t *)iobuf;
+
+  stats.bucket_lookups++;
+  for (int c = 0; c < 2; c++) {
+    if (filter_absent(choice[c], digest))
+      continue;
+
+    stats.bucket_probes++;
+    int ret = mmcfs_bucket_read(choice[c], buf);
+    if (ret < 0) {
+      return ret;
+    }
+
+    int index = mmcfs_bucket_find_file(buf, digest);
+    if (index != -ENOENT) {
+      if (where) {
+        *where = choice[c];
+      }
+      return index;
+    }
+    if (filter_has(choice[c])) {
+      stats.filter_false++;
+    }
+  }
+  return -ENOENT;
+}
+
+/*
+ * metadata transaction, meta_lock held. Buckets are staged in iobuf, after a
+ * sector kept for the log header, and changed in place there. txn_commit
+ * writes header and buckets to the log in one go, then each bucket in place.
+ * Blocks of files removed are released (and readers of them invalidated)
+ * only after that, and the lru index follows.
+ */
+#define TXN_MAX_REMOVED ((1 + MMCFS_PCM_MAX_EXTENTS) * MMCFS_LOG_MAX_BUCKETS)
+
+// one more bucket for replay to read into
+_Static_assert(512 + (MMCFS_LOG_MAX_BUCKETS + 1) * sizeof(mmcfs_bucket_t) <=
+                   sizeof(iobuf),
+               "iobuf too small for a transaction");
+
+typedef struct {
+  md5_digest_t self;
+  uint32_t block_start;
+  uint32_t block_end;
+  uint16_t bucket;
+  mmcfs_file_type_t type;
+} txn_removed_t;
+
+static struct {
+  int count;
+  uint16_t index[MMCFS_LOG_MAX_BUCKETS];
+  int removed_count;
+  txn_removed_t removed[TXN_MAX_REMOVED];
+  int added_count;
+  mmcfs_file_t added[2];
+  uint16_t added_bucket[2];
+} txn;
+
+static mmcfs_bucket_t *txn_staged() { return (mmcfs_bucket_t *)&iobuf[512]; }
+
+static void txn_begin() {
+  txn.count = 0;
+  txn.removed_count = 0;
+  txn.added_count = 0;
+}
+
+/*
+ * stage bucket, once per transaction
+ */
+static int txn_bucket(uint16_t index, mmcfs_bucket_t **out) {
+  for (int i = 0; i < txn.count; i++) {
+    if (txn.index[i] == index) {
+      *out = &txn_staged()[i];
+      return 0;
+    }
+  }
+
+  if (txn.count == MMCFS_LOG_MAX_BUCKETS) {
+    return -E2BIG;
+  }
+
+  int ret = mmcfs_bucket_read(index, &txn_staged()[txn.count]);
+  if (ret < 0) {
+    return ret;
+  }
+
+  *out = &txn_staged()[txn.count];
+  txn.index[txn.count++] = index;
+  return 0;
+}
+
+static uint16_t txn_bucket_index(const mmcfs_bucket_t *staged) {
+  return txn.index[staged - txn_staged()];
+}
+
+/*
+ * bucket as the transaction has it so far, without staging it: the staged
+ * copy, or read into bbuf
+ */
+static mmcfs_bucket_t *txn_staged_bucket(uint16_t index) {
+  for (int i = 0; i < txn.count; i++) {
+    if (txn.index[i] == index)
+      return &txn_staged()[i];
+  }
+  return NULL;
+}
+
+static int txn_peek(uint16_t index, const mmcfs_bucket_t **out) {
+  *out = txn_staged_bucket(index);
+  if (*out) {
+    return 0;
+  }
+
+  *out = &bbuf;
+  return mmcfs_bucket_read(index, &bbuf);
+}
+
+/*
+ * stage the bucket digest is in, first or second choice. The other one is
+ * only peeked at, so it takes no log slot. Returns index of the file, or
+ * -ENOENT.
+ */
+static int txn_lookup(const md5_digest_t *digest, mmcfs_bucket_t **out) {
+  uint16_t choice[2] = {mmcfs_bucket_index(digest), mmcfs_bucket_alt(digest)};
+
+  for (int c = 0; c < 2; c++) {
+    // the filter is what is on card
+    if (!txn_staged_bucket(choice[c]) && filter_absent(choice[c], digest))
+      continue;
+
+    const mmcfs_bucket_t *buc;
+    int ret = txn_peek(choice[c], &buc);
+    if (ret < 0) {
+      return ret;
+    }
+
+    int index = mmcfs_bucket_find_file(buc, digest);
+    if (index == -ENOENT) {
+      continue;
+    } else if (index < 0) {
+      return index;
+    }
+
+    ret = txn_bucket(choice[c], out);
+    return ret < 0 ? ret : index;
+  }
+  return -ENOENT;
+}
+
+static int txn_remove(const mmcfs_file_t *file, uint16_t bucket) {
+  if (txn.removed_count == TXN_MAX_REMOVED) {
+    return -E2BIG;
+  }
+
+  txn_removed_t *r = &txn.removed[txn.removed_count++];
+  r->self = file->self;
+  r->block_start = file->block_start;
+  r->block_end = file->block_end;
+  r->bucket = bucket;
+  r->type = file->type;
+  return 0;
+}
+
+static int txn_add(const mmcfs_file_t *file, uint16_t bucket) {
+  if (txn.added_count == sizeof(txn.added) / sizeof(txn.added[0])) {
+    return -E2BIG;
+  }
+
+  txn.added_bucket[txn.added_count] = bucket;
+  txn.added[txn.added_count++] = *file;
+  return 0;
+}
+
+static void log_seal(mmcfs_log_t *log) {
+  md5_context_t md5_ctx;
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, log, sizeof(mmcfs_log_t) - 16);
+  esp_rom_md5_final(log->md5, &md5_ctx);
+}
+
+static int txn_write() {
+  md5_context_t md5_ctx;
+  size_t sect = mmcfs_bucket_sector_count();
+
+  // bit_array on card may be stale from now on
+  if (checkpoint_invalidate() != ESP_OK) {
+    return -EIO;
+  }
+
+  mmcfs_log_t *log = (mmcfs_log_t *)iobuf;
+  memset(log, 0, sizeof(mmcfs_log_t));
+  memcpy(log->magic, mmcfs_log_magic, 16);
+  memcpy(log->superblock_md5, superblock->md5, 16);
+  log->count = txn.count;
+  memcpy(log->index, txn.index, sizeof(txn.index));
+  if (stats.txn_max_buckets < txn.count) {
+    stats.txn_max_buckets = txn.count;
+  }
+
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, txn_staged(),
+                     txn.count * sizeof(mmcfs_bucket_t));
+  esp_rom_md5_final(log->buckets_md5, &md5_ctx);
+  log_seal(log);
+
+  // on failure the log may or may not be on card, replayed at next mount
+  esp_err_t err = dev_write(iobuf, LOG_SECTOR, 1 + txn.count * sect);
+  if (err != ESP_OK) {
+    bucket_unsure = true;
+    return -EIO;
+  }
+
+  for (int i = 0; i < txn.count; i++) {
+    err = dev_write(&txn_staged()[i], fs->bucket_start + txn.index[i] * sect,
+                    sect);
+    if (err != ESP_OK) {
+      bcache_drop(txn.index[i]);
+      filter_drop(txn.index[i]);
+      bucket_unsure = true;
+      return -EIO;
+    }
+    bcache_put(txn.index[i], &txn_staged()[i]);
+    filter_take(txn.index[i], &txn_staged()[i]);
+  }
+
+  for (int i = 0; i < txn.added_count; i++) {
+    lru_add(&txn.added[i], txn.added_bucket[i]);
+  }
+
+  for (int i = 0; i < txn.removed_count; i++) {
+    txn_removed_t *r = &txn.removed[i];
+    pcm_invalidate(&r->self);
+    lru_remove(r->bucket, r->block_start, r->block_end);
+
+    err = release_blocks(r->block_start, r->block_end);
+    if (err != ESP_OK) {
+      ESP_LOGI(TAG, "failed to release blocks %u-%u of removed file, %s",
+               r->block_start, r->block_end, esp_err_to_name(err));
+    }
+  }
+
+  if (txn.removed_count && compact_wake) {
+    xSemaphoreGive(compact_wake);
+  }
+  return 0;
+}
+
+static int txn_commit() {
+  if (txn.count == 0) {
+    return 0;
+  }
+
+  int64_t t = esp_timer_get_time();
+  int ret = txn_write();
+  op_record(MMCFS_OP_BUCKET_UPDATE, t, ret);
+  return ret;
+}
+
+/*
+ * remove a given file, possibly also remove the linked pcm, in transaction
+ */
+static int mmcfs_bucket_remove_file(const md5_digest_t *digest,
+                                    bool remove_linked_pcm) {
+  mmcfs_bucket_t *buc;
+
+  // returns -ENOENT or index
+  int index = txn_lookup(digest, &buc);
+  if (index == -ENOENT) {
+    return 0;
+  } else if (index < 0) {
+    return index;
+  }
+
+  if (mmcfs_file_is_mp3(&buc->files[index]) && remove_linked_pcm) {
+    md5_digest_t link = buc->files[index].link;
+    // api seems problematic, should the caller provide file type?
+    int r = mmcfs_bucket_remove_file(&link, false);
+    if (r < 0)
+      return r;
+
+    return mmcfs_bucket_remove_file(digest, false);
+  }
+
+  // an extent goes with its pcm, if that is there
+  if (mmcfs_file_is_extent(&buc->files[index]) &&
+      mmcfs_bucket_find_file(buc, &buc->files[index].link) >= 0) {
+    md5_digest_t link = buc->files[index].link;
+    return mmcfs_bucket_remove_file(&link, false);
+  }
+
+  uint16_t bucket = txn_bucket_index(buc);
+  int ret = txn_remove(&buc->files[index], bucket);
+  if (ret < 0)
+    return ret;
+
+  md5_digest_t self = buc->files[index].self;
+  int extents =
+      mmcfs_file_is_pcm(&buc->files[index]) ? buc->files[index].extents : 0;
+
+  int max_files = mmcfs_bucket_max_files();
+  for (int i = index; i < max_files; i++) {
+    if (i < max_files - 1) {
+      buc->files[i] = buc->files[i + 1];
+    } else {
+      mmcfs_file_nullify(&buc->files[i], bucket);
+    }
+  }
+
+  for (int i = 1; i <= extents; i++) {
+    md5_digest_t ext;
+    mmcfs_extent_digest(&self, i, &ext);
+    ret = mmcfs_bucket_remove_file(&ext, false);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+/* UNSAFE. Callers must check range for themselves.
+ */
+bool test_bit(int i) { return bitmap_test(&bit_array, i); }
+
+/* Set all bits from start to end (exclusive).
+ *
+ * The function returns
+ * - ESP_ERR_INVALID_ARG, if start > end or end > block_count
+ * - ESP_ERR_INVALID_STATE, if any bit in range is already set, the first one
+ *   is stored in conflict.
+ */
+esp_err_t set_bits(uint32_t start, uint32_t end, uint32_t *conflict) {
+  return bitmap_set_range(&bit_array, start, end, conflict);
+}
+
+/* Clear all bits from start to end (exclusive), the reverse of set_bits.
+ */
+esp_err_t clear_bits(uint32_t start, uint32_t end, uint32_t *conflict) {
+  uint32_t bit;
+  esp_err_t err = bitmap_clear_range(&bit_array, start, end, &bit);
+  if (err == ESP_ERR_INVALID_STATE) {
+    ESP_LOGI(TAG, "clear_bits error, bit %u not set", bit);
+    if (conflict)
+      *conflict = bit;
+  }
+  return err;
+}
+
+/*
+ * for mp3 and pcm file
+ * create_mp3 (md5 & size)
+ * create_pcm (with mp3 md5, only estimated size)
+ *
+ * write_mp3
+ * write_pcm
+ *
+ * read mp3
+ * read pcm by mp3_md5, sect
+ * read pcm by pcm_md5, sect
+ */
+
+/* round up to next power of 2
+ */
+uint64_t round_power2(uint64_t n) {
+  n = n - 1;
+  while (n & (n - 1)) {
+    n = n & (n - 1);
+  }
+  return n << 1;
+}
+
+/*
+ * validate superblock
+ */
+bool mmcfs_superblock_valid(mmcfs_superblock_t *superblock) {
+  md5_context_t md5_ctx;
+  uint8_t digest[16];
+  if (memcmp(superblock->magic, mmcfs_superblock_magic,
+             sizeof(mmcfs_superblock_magic)) == 0) {
+    esp_rom_md5_init(&md5_ctx);
+    esp_rom_md5_update(&md5_ctx, superblock, 512 - 16);
+    esp_rom_md5_final(digest, &md5_ctx);
+    if (memcmp(digest, superblock->md5, sizeof(digest)) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * print mmcfs info
+ */
+void mmcfs_info(mmcfs_t *fs) {
+  const char *TAG = pcTaskGetName(NULL);
   ESP_LOGI(TAG, "log start @ %llu sector (%llu bytes offset)", fs->log_start,
            fs->log_start * 512);
   ESP_LOGI(TAG, "log size %llu sectors (%llu bytes)", fs->log_sect,
@@ -487,7 +1279,7 @@ esp_err_t init_fs() {
     return ESP_ERR_NO_MEM;
   }
 
-  err = sdmmc_read_sectors(card, superblock, SUPERBLOCK_SECTOR, 1);
+  err = dev_read(superblock, SUPERBLOCK_SECTOR, 1);
   if (err != ESP_OK) {
     free(superblock);
     superblock = NULL;
@@ -496,6 +1288,14 @@ esp_err_t init_fs() {
 
   if (mmcfs_superblock_valid(superblock)) {
     fs = &superblock->mmcfs;
+    mmcfs_geometry_t *g = &superblock->geometry;
+    if (superblock->version < MMCFS_VERSION_GEOMETRY) {
+      ESP_LOGI(TAG, "version %llu format, not aligned to allocation units",
+               superblock->version);
+    } else if (dev->erase_sectors && dev->erase_sectors != g->card_au_sect) {
+      ESP_LOGI(TAG, "formatted for %u sector allocation units, card has %u",
+               g->card_au_sect, dev->erase_sectors);
+    }
     return ESP_OK;
   }
 
@@ -508,15 +1308,43 @@ esp_err_t init_fs() {
   uint64_t log_sect = 2 * bucket_sect;
   uint64_t bucket_start = 4 * 1024 * 1024 / 512;
   uint64_t bucket_count = 4096;
+  // data area on an allocation unit boundary, at most 64MiB by spec
+  uint64_t au_sect = dev->erase_sectors;
+  if (au_sect == 0 || au_sect > 64 * 1024 * 1024 / 512) {
+    au_sect = DEFAULT_AU_SECT;
+  }
   uint64_t block_start = 64 * 1024 * 1024 / 512;
-  uint64_t avail_sect_for_blocks = card->csd.capacity - block_start;
+  block_start = (block_start + au_sect - 1) / au_sect * au_sect;
+  uint64_t avail_sect_for_blocks = dev->capacity - block_start;
   uint64_t block_sect =
       round_power2(avail_sect_for_blocks) / MMCFS_MAX_BITARRAY_SIZE;
+  if (block_sect == 0) {
+    block_sect = 1;
+  }
+
+  // both powers of 2 unless the unit is not (some SDXC ones are 12, 24
+  // MiB..). Then the smallest block no smaller, as the bitmap has room for
+  // no more, that divides the unit or is a multiple of it.
+  if (au_sect % block_sect && block_sect % au_sect) {
+    uint64_t n = au_sect / block_sect; // blocks per unit
+    while (n > 1 && au_sect % n) {
+      n--;
+    }
+    uint64_t sect = n ? au_sect / n
+                      : (block_sect + au_sect - 1) / au_sect * au_sect;
+    ESP_LOGI(TAG,
+             "blocks of %llu sectors would straddle allocation units of "
+             "%llu, %llu instead",
+             block_sect, au_sect, sect);
+    block_sect = sect;
+  }
 
   /** reserve the last sector */
   uint64_t block_count = (avail_sect_for_blocks - 1) / block_sect;
 
-  superblock->version = 0;
+  superblock->version = MMCFS_VERSION_GEOMETRY;
+  superblock->geometry.au_sect = au_sect;
+  superblock->geometry.card_au_sect = dev->erase_sectors;
   superblock->mmcfs.log_start = log_start;
   superblock->mmcfs.log_sect = log_sect;
   superblock->mmcfs.bucket_start = bucket_start;
@@ -531,7 +1359,7 @@ esp_err_t init_fs() {
   memset(bucket, 0, bucket_sect * 512);
 
   // erasing log
-  err = sdmmc_write_sectors(card, bucket, log_start, bucket_sect);
+  err = dev_write(bucket, log_start, bucket_sect);
   if (err != ESP_OK) {
     free(bucket);
     free(superblock);
@@ -540,7 +1368,20 @@ esp_err_t init_fs() {
   }
 
   // erasing not log, it is not bitwise NOT-ed, which means the log is invalid
-  err = sdmmc_write_sectors(card, bucket, log_start + bucket_sect, bucket_sect);
+  err = dev_write(bucket, log_start + bucket_sect, bucket_sect);
+  if (err != ESP_OK) {
+    free(bucket);
+    free(superblock);
+    superblock = NULL;
+    return err;
+  }
+
+  // erasing checkpoint and log header, old ones may look valid for an
+  // identical format
+  err = dev_write(bucket, CHECKPOINT_SECTOR, 1);
+  if (err == ESP_OK) {
+    err = dev_write(bucket, LOG_SECTOR, 1);
+  }
   if (err != ESP_OK) {
     free(bucket);
     free(superblock);
@@ -552,8 +1393,7 @@ esp_err_t init_fs() {
   for (uint16_t i = 0; i < bucket_count; i++) {
     bucket[0] = i >> 4;
     bucket[1] = i << 4;
-    err = sdmmc_write_sectors(card, bucket, bucket_start + i * bucket_sect,
-                              bucket_sect);
+    err = dev_write(bucket, bucket_start + i * bucket_sect, bucket_sect);
     if (err != ESP_OK) {
       free(bucket);
       free(superblock);
@@ -571,7 +1411,7 @@ esp_err_t init_fs() {
   assert(mmcfs_superblock_valid(superblock));
 
   // write superblock
-  err = sdmmc_write_sectors(card, superblock, SUPERBLOCK_SECTOR, 1);
+  err = dev_write(superblock, SUPERBLOCK_SECTOR, 1);
   if (err) {
     free(superblock);
     superblock = NULL;
@@ -581,317 +1421,2236 @@ esp_err_t init_fs() {
   fs = &superblock->mmcfs;
 
   mmcfs_info(fs);
+  ESP_LOGI(TAG, "aligned to %llu sector allocation units, card reported %u",
+           au_sect, dev->erase_sectors);
   return ESP_OK;
 }
 
 /*
- * read data into iobuf, as well as outbuf if provided.
+ * write a logged bucket again if the bucket on card differs, scratch is a
+ * bucket sized dma buffer. Mounting.
  */
-esp_err_t mmcfs_read_buf_buckets(int buf_index, mmcfs_bucket_t *outbuf) {
-  const int buf_sect = sizeof(iobuf) / 512;
-  esp_err_t err = sdmmc_read_sectors(
-      card, iobuf, fs->bucket_start + buf_index * buf_sect, buf_sect);
-  if (err) {
+static esp_err_t replay_bucket(uint16_t index, const mmcfs_bucket_t *logged,
+                               mmcfs_bucket_t *scratch) {
+  size_t sect = mmcfs_bucket_sector_count();
+  size_t start = fs->bucket_start + index * sect;
+
+  esp_err_t err = dev_read(scratch, start, sect);
+  if (err != ESP_OK) {
     return err;
   }
 
-  if (outbuf) {
-    memcpy(outbuf, iobuf, sizeof(iobuf));
+  if (memcmp(logged, scratch, sizeof(mmcfs_bucket_t)) == 0) {
+    return ESP_OK;
+  }
+
+  ESP_LOGI(TAG, "bucket %u differs from log, replaying", index);
+  err = dev_write(logged, start, sect);
+  if (err != ESP_OK) {
+    return err;
   }
 
+  stats.log_replayed = true;
   return ESP_OK;
 }
 
 /*
- * init file allocation bit map (bit_array)
+ * single bucket log of older firmware, replayed and invalidated (its NOT-ed
+ * half zeroed), so it never overrides a later transaction. Mounting.
  */
-static esp_err_t init_falloc_bitmap() {
-  esp_err_t err;
-
-  int mp3_count = 0;
-  int mp3_block_count = 0;
-  int pcm_count = 0;
-  int pcm_block_count = 0;
-
-  mmcfs_bucket_t *outbuf = (mmcfs_bucket_t *)heap_caps_malloc(
-      sizeof(iobuf), MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
-  if (outbuf == NULL) {
-    return ESP_ERR_NO_MEM;
+static esp_err_t legacy_log_replay() {
+  mmcfs_bucket_t *log = (mmcfs_bucket_t *)iobuf;
+  esp_err_t err = dev_read(iobuf, fs->log_start, fs->log_sect);
+  if (err != ESP_OK) {
+    return err;
   }
 
-  int buf_sect = sizeof(iobuf) / 512;
-  int bucket_per_buf = buf_sect / fs->bucket_sect;
-  int buf_count = fs->bucket_count / bucket_per_buf;
-
-  for (int i = 0; i < buf_count; i++) {
-    err = mmcfs_read_buf_buckets(i, outbuf);
-    if (err) {
-      free(outbuf);
-      return err;
+  uint32_t *c0 = (uint32_t *)&log[0];
+  uint32_t *c1 = (uint32_t *)&log[1];
+  for (int i = 0; i < sizeof(mmcfs_bucket_t) / sizeof(uint32_t); i++) {
+    if (c1[i] != ~c0[i]) {
+      return ESP_OK;
     }
+  }
 
-    // iterate bucket
-    for (int j = 0; j < bucket_per_buf; j++) {
-      mmcfs_bucket_t *bucket = &outbuf[j];
-      // for (int k = 0; k < sizeof(mmcfs_bucket_t) /
-      // sizeof(mmcfs_file_t); k++) {
-      for (int k = 0; k < mmcfs_bucket_max_files(); k++) {
-        mmcfs_file_t *f = &bucket->files[k];
-        if (mmcfs_file_is_null(f))
-          break;
+  // null file keeps bucket index too, so the first file always tells
+  err = replay_bucket(mmcfs_bucket_index(&log->files[0].self), &log[0],
+                      &log[1]);
+  if (err != ESP_OK) {
+    return err;
+  }
 
-        // if (f->type == 0) break;
+  memset(&log[1], 0, sizeof(mmcfs_bucket_t));
+  return dev_write(&log[1], fs->log_start + mmcfs_bucket_sector_count(),
+                   mmcfs_bucket_sector_count());
+}
 
-        uint32_t conflict;
-        err = set_bits(f->block_start, f->block_end, &conflict);
-        // TODO handle err
+/*
+ * replay the last transaction, see note on bucket and write log. Replaying a
+ * valid log is idempotent, so a power loss while replaying is no different.
+ * Mounting.
+ */
+static esp_err_t log_replay() {
+  md5_context_t md5_ctx;
+  uint8_t digest[16];
+  size_t sect = mmcfs_bucket_sector_count();
 
-        if (last_access < f->access) {
-          last_access = f->access;
-        }
+  esp_err_t err = legacy_log_replay();
+  if (err != ESP_OK) {
+    return err;
+  }
 
-        if (f->type == 1) {
-          mp3_count++;
-          mp3_block_count += f->block_end - f->block_start;
-        }
+  mmcfs_log_t *log = (mmcfs_log_t *)iobuf;
+  err = dev_read(log, LOG_SECTOR, 1);
+  if (err != ESP_OK) {
+    return err;
+  }
 
-        if (f->type == 2) {
-          pcm_count++;
-          pcm_block_count += f->block_end - f->block_start;
+  if (memcmp(log->magic, mmcfs_log_magic, 16) != 0 ||
+      memcmp(log->superblock_md5, superblock->md5, 16) != 0 ||
+      log->count > MMCFS_LOG_MAX_BUCKETS) {
+    return ESP_OK;
+  }
+
+  memcpy(digest, log->md5, 16);
+  log_seal(log);
+  if (memcmp(digest, log->md5, 16) != 0) {
+    return ESP_OK;
+  }
+
+  mmcfs_bucket_t *buckets = txn_staged();
+  err = dev_read(buckets, LOG_SECTOR + 1, log->count * sect);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, buckets, log->count * sizeof(mmcfs_bucket_t));
+  esp_rom_md5_final(digest, &md5_ctx);
+  if (memcmp(digest, log->buckets_md5, 16) != 0) {
+    return ESP_OK;
+  }
+
+  for (int i = 0; i < log->count; i++) {
+    err = replay_bucket(log->index[i], &buckets[i],
+                        &buckets[MMCFS_LOG_MAX_BUCKETS]);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  return ESP_OK;
+}
+
+/*
+ * read the buf_index-th 16KiB of bucket table into buf
+ */
+static esp_err_t mmcfs_read_buf_buckets(int buf_index, mmcfs_bucket_t *buf) {
+  const int buf_sect = SCAN_BUF_SIZE / 512;
+  return dev_read(buf, fs->bucket_start + buf_index * buf_sect, buf_sect);
+}
+
+typedef struct {
+  int mp3_count;
+  int mp3_block_count;
+  int pcm_count;
+  int pcm_block_count;
+} scan_counts_t;
+
+/*
+ * set bits of all files in given buckets, from bucket `first` on
+ */
+static void scan_buckets(const mmcfs_bucket_t *buckets, int first, int count,
+                         scan_counts_t *counts) {
+  for (int j = 0; j < count; j++) {
+    const mmcfs_bucket_t *bucket = &buckets[j];
+    filter_take(first + j, bucket);
+    for (int k = 0; k < mmcfs_bucket_max_files(); k++) {
+      const mmcfs_file_t *f = &bucket->files[k];
+      if (mmcfs_file_is_null(f))
+        break;
+
+      uint32_t conflict;
+      esp_err_t err = set_bits(f->block_start, f->block_end, &conflict);
+      if (err == ESP_ERR_INVALID_STATE) {
+        // overlaps another file, still reserve the rest of it
+        ESP_LOGI(TAG, "file blocks %u-%u conflict at %u", f->block_start,
+                 f->block_end, conflict);
+        for (uint32_t i = f->block_start; i < f->block_end;) {
+          uint32_t start = bitmap_find_clear(&bit_array, i, f->block_end);
+          i = bitmap_find_set(&bit_array, start, f->block_end);
+          set_bits(start, i, NULL);
         }
+        stats.scan_conflicts++;
+      } else if (err != ESP_OK) {
+        ESP_LOGI(TAG, "file blocks %u-%u out of range", f->block_start,
+                 f->block_end);
+        stats.scan_conflicts++;
+      }
+
+      if (last_access < f->access) {
+        last_access = f->access;
+      }
+      lru_add(f, first + j);
+
+      if (f->type == 1) {
+        counts->mp3_count++;
+        counts->mp3_block_count += f->block_end - f->block_start;
+      }
+
+      if (f->type == 2) {
+        counts->pcm_count++;
+        counts->pcm_block_count += f->block_end - f->block_start;
+      }
+
+      if (f->type == 3) {
+        counts->pcm_block_count += f->block_end - f->block_start;
+      }
+    }
+  }
+
+  if (mount_opts.scan_parse_cost_us) {
+    int64_t until = esp_timer_get_time() + mount_opts.scan_parse_cost_us;
+    while (esp_timer_get_time() < until)
+      ;
+  }
+}
+
+/*
+ * bucket table scan pipeline. The reader task fills the two buffers in turn,
+ * the mounting task parses one while the other is being read.
+ */
+typedef struct {
+  int index;
+  int buf;
+  esp_err_t err;
+} scan_msg_t;
+
+typedef struct {
+  mmcfs_bucket_t *bufs[2];
+  int buf_count;
+  QueueHandle_t free_q; // buffer numbers ready to be read into
+  QueueHandle_t full_q; // scan_msg_t
+  SemaphoreHandle_t done;
+} scan_ctx_t;
+
+static void scan_reader(void *arg) {
+  scan_ctx_t *ctx = (scan_ctx_t *)arg;
+
+  for (int i = 0; i < ctx->buf_count; i++) {
+    scan_msg_t msg = {.index = i};
+    xQueueReceive(ctx->free_q, &msg.buf, portMAX_DELAY);
+    msg.err = mmcfs_read_buf_buckets(i, ctx->bufs[msg.buf]);
+    xQueueSend(ctx->full_q, &msg, portMAX_DELAY);
+    if (msg.err != ESP_OK)
+      break;
+  }
+
+  xSemaphoreGive(ctx->done);
+  vTaskDelete(NULL);
+}
+
+static esp_err_t scan_pipelined(mmcfs_bucket_t *bufs[2], int buf_count,
+                                int bucket_per_buf, scan_counts_t *counts) {
+  esp_err_t err = ESP_OK;
+  scan_ctx_t ctx = {
+      .bufs = {bufs[0], bufs[1]},
+      .buf_count = buf_count,
+      .free_q = xQueueCreate(2, sizeof(int)),
+      .full_q = xQueueCreate(2, sizeof(scan_msg_t)),
+      .done = xSemaphoreCreateBinary(),
+  };
+
+  if (ctx.free_q == NULL || ctx.full_q == NULL || ctx.done == NULL) {
+    err = ESP_ERR_NO_MEM;
+    goto out;
+  }
+
+  for (int b = 0; b < 2; b++) {
+    xQueueSend(ctx.free_q, &b, 0);
+  }
+
+  if (xTaskCreate(scan_reader, "mmcfs_scan", 2048, &ctx,
+                  uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+    err = ESP_ERR_NO_MEM;
+    goto out;
+  }
+
+  for (int i = 0; i < buf_count; i++) {
+    scan_msg_t msg;
+    int64_t t = esp_timer_get_time();
+    xQueueReceive(ctx.full_q, &msg, portMAX_DELAY);
+    stats.scan_read_us += esp_timer_get_time() - t;
+
+    if (msg.err != ESP_OK) {
+      err = msg.err;
+      break;
+    }
+
+    t = esp_timer_get_time();
+    scan_buckets(ctx.bufs[msg.buf], msg.index * bucket_per_buf,
+                 bucket_per_buf, counts);
+    stats.scan_parse_us += esp_timer_get_time() - t;
+
+    xQueueSend(ctx.free_q, &msg.buf, portMAX_DELAY);
+  }
+
+  // reader must be gone before buffers and queues are
+  xSemaphoreTake(ctx.done, portMAX_DELAY);
+
+out:
+  if (ctx.free_q)
+    vQueueDelete(ctx.free_q);
+  if (ctx.full_q)
+    vQueueDelete(ctx.full_q);
+  if (ctx.done)
+    vSemaphoreDelete(ctx.done);
+  return err;
+}
+
+static esp_err_t scan_sequential(mmcfs_bucket_t *buf, int buf_count,
+                                 int bucket_per_buf, scan_counts_t *counts) {
+  for (int i = 0; i < buf_count; i++) {
+    int64_t t = esp_timer_get_time();
+    esp_err_t err = mmcfs_read_buf_buckets(i, buf);
+    stats.scan_read_us += esp_timer_get_time() - t;
+    if (err) {
+      return err;
+    }
+
+    t = esp_timer_get_time();
+    scan_buckets(buf, i * bucket_per_buf, bucket_per_buf, counts);
+    stats.scan_parse_us += esp_timer_get_time() - t;
+  }
+  return ESP_OK;
+}
+
+/*
+ * init file allocation bit map (bit_array) by scanning all buckets
+ */
+static esp_err_t init_falloc_bitmap() {
+  esp_err_t err;
+  scan_counts_t counts = {0};
+  mmcfs_bucket_t *bufs[2] = {NULL, NULL};
+
+  int bucket_per_buf = SCAN_BUF_SIZE / 512 / fs->bucket_sect;
+  int buf_count = fs->bucket_count / bucket_per_buf;
+  bool pipelined = !mount_opts.sequential_scan;
+
+  for (int b = 0; b < (pipelined ? 2 : 1); b++) {
+    bufs[b] = (mmcfs_bucket_t *)heap_caps_malloc(
+        SCAN_BUF_SIZE, MALLOC_CAP_DMA | MALLOC_CAP_32BIT);
+    if (bufs[b] == NULL) {
+      // one buffer is enough to scan
+      pipelined = false;
+      break;
+    }
+  }
+
+  if (bufs[0] == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  int64_t t = esp_timer_get_time();
+  if (pipelined) {
+    err = scan_pipelined(bufs, buf_count, bucket_per_buf, &counts);
+  } else {
+    err = scan_sequential(bufs[0], buf_count, bucket_per_buf, &counts);
+  }
+  stats.scan_us = esp_timer_get_time() - t;
+
+  heap_caps_free(bufs[0]);
+  heap_caps_free(bufs[1]);
+
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  stats.mount_scanned = true;
+  lru_built = true;
+  last_access++;
+
+  ESP_LOGI(TAG, "%d mp3 files found, %d blocks used.", counts.mp3_count,
+           counts.mp3_block_count);
+  ESP_LOGI(TAG, "%d pcm files found, %d blocks used.", counts.pcm_count,
+           counts.pcm_block_count);
+  ESP_LOGI(TAG, "%s scan took %ums, %ums waiting for reads, %ums parsing",
+           pipelined ? "pipelined" : "sequential", stats.scan_us / 1000,
+           stats.scan_read_us / 1000, stats.scan_parse_us / 1000);
+
+  return ESP_OK;
+}
+
+static uint32_t checkpoint_bitmap_sect() {
+  return (BITMAP_WORDS(mmcfs_block_count()) * sizeof(uint32_t) + 511) / 512;
+}
+
+static void checkpoint_seal() {
+  md5_context_t md5_ctx;
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, &ckpt, sizeof(mmcfs_checkpoint_t) - 16);
+  esp_rom_md5_final(ckpt.md5, &md5_ctx);
+}
+
+static bool checkpoint_header_valid() {
+  md5_context_t md5_ctx;
+  uint8_t digest[16];
+
+  if (memcmp(ckpt.magic, mmcfs_checkpoint_magic, 16) != 0)
+    return false;
+
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, &ckpt, sizeof(mmcfs_checkpoint_t) - 16);
+  esp_rom_md5_final(digest, &md5_ctx);
+  return memcmp(digest, ckpt.md5, 16) == 0;
+}
+
+/*
+ * load bit_array and last_access from a CLEAN checkpoint, skipping the
+ * bucket scan. Returns ESP_ERR_NOT_FOUND if there is no usable checkpoint.
+ */
+static esp_err_t checkpoint_load() {
+  md5_context_t md5_ctx;
+  uint8_t digest[16];
+
+  esp_err_t err = dev_read(&ckpt, CHECKPOINT_SECTOR, 1);
+  if (err != ESP_OK) {
+    memset(&ckpt, 0, sizeof(ckpt));
+    return err;
+  }
+
+  if (!checkpoint_header_valid()) {
+    memset(&ckpt, 0, sizeof(ckpt));
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  if (memcmp(ckpt.superblock_md5, superblock->md5, 16) != 0 ||
+      ckpt.block_count != mmcfs_block_count() ||
+      ckpt.bitmap_sect != checkpoint_bitmap_sect()) {
+    ESP_LOGI(TAG, "checkpoint does not belong to this format");
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  if (ckpt.state != MMCFS_CHECKPOINT_CLEAN) {
+    ESP_LOGI(TAG, "checkpoint generation %llu is stale", ckpt.generation);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  uint32_t bytes = BITMAP_WORDS(mmcfs_block_count()) * sizeof(uint32_t);
+  err = dev_read(iobuf, CHECKPOINT_SECTOR + 1, ckpt.bitmap_sect);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, iobuf, ckpt.bitmap_sect * 512);
+  esp_rom_md5_final(digest, &md5_ctx);
+  if (memcmp(digest, ckpt.bitmap_md5, 16) != 0) {
+    ESP_LOGI(TAG, "checkpoint bitmap corrupted");
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  memcpy(bit_words, iobuf, bytes);
+  bitmap_recount(&bit_array);
+  if (bitmap_used(&bit_array) != ckpt.used_blocks) {
+    bitmap_reset(&bit_array);
+    return ESP_ERR_INVALID_CRC;
+  }
+
+  last_access = ckpt.last_access;
+  ckpt_clean = true;
+
+  ESP_LOGI(TAG, "checkpoint generation %llu loaded, %u blocks used",
+           ckpt.generation, ckpt.used_blocks);
+  return ESP_OK;
+}
+
+/*
+ * write bit_array and last_access as a new CLEAN checkpoint. Bitmap sectors
+ * go first, so a torn write leaves the (DIRTY) header pointing nowhere valid.
+ *
+ * Blocks reserved by open files are left out. meta_lock held (or mounting).
+ */
+static esp_err_t checkpoint_write() {
+  md5_context_t md5_ctx;
+
+  if (bucket_unsure) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  uint32_t sect = checkpoint_bitmap_sect();
+  uint32_t bytes = BITMAP_WORDS(mmcfs_block_count()) * sizeof(uint32_t);
+
+  memset(iobuf, 0, sect * 512);
+  lock(alloc_lock);
+  memcpy(iobuf, bit_words, bytes);
+  uint32_t used = bitmap_used(&bit_array);
+  uint32_t dest_start = compact_dest_start;
+  uint32_t dest_end = compact_dest_end;
+  uint32_t erasing_start = discard_start;
+  uint32_t erasing_end = discard_end;
+  unlock(alloc_lock);
+
+  // blocks reserved by files being written or moved, or being discarded,
+  // are not on card
+  bitmap_t snap = {(uint32_t *)iobuf, mmcfs_block_count(), used};
+  open_files_exclude(&snap);
+  ESP_ERROR_CHECK(bitmap_clear_range(&snap, dest_start, dest_end, NULL));
+  ESP_ERROR_CHECK(
+      bitmap_clear_range(&snap, erasing_start, erasing_end, NULL));
+  used = bitmap_used(&snap);
+
+  esp_err_t err = dev_write(iobuf, CHECKPOINT_SECTOR + 1, sect);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  memcpy(ckpt.magic, mmcfs_checkpoint_magic, 16);
+  memcpy(ckpt.superblock_md5, superblock->md5, 16);
+  ckpt.generation++;
+  ckpt.last_access = last_access;
+  ckpt.state = MMCFS_CHECKPOINT_CLEAN;
+  ckpt.block_count = mmcfs_block_count();
+  ckpt.used_blocks = used;
+  ckpt.bitmap_sect = sect;
+
+  esp_rom_md5_init(&md5_ctx);
+  esp_rom_md5_update(&md5_ctx, iobuf, sect * 512);
+  esp_rom_md5_final(ckpt.bitmap_md5, &md5_ctx);
+  checkpoint_seal();
+
+  err = dev_write(&ckpt, CHECKPOINT_SECTOR, 1);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  ckpt_clean = true;
+  return ESP_OK;
+}
+
+/*
+ * mark checkpoint on card DIRTY, once, before the first bucket write after
+ * it was written.
+ */
+static esp_err_t checkpoint_invalidate() {
+  if (!ckpt_clean) {
+    return ESP_OK;
+  }
+
+  ckpt.state = MMCFS_CHECKPOINT_DIRTY;
+  checkpoint_seal();
+
+  esp_err_t err = dev_write(&ckpt, CHECKPOINT_SECTOR, 1);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  ckpt_clean = false;
+  return ESP_OK;
+}
+
+/*
+ * build free extent index from bit_array
+ */
+static esp_err_t init_falloc_index() {
+  uint32_t count = mmcfs_block_count();
+  esp_err_t err = falloc_init(count);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  uint32_t start = 0;
+  while (start < count) {
+    start = bitmap_find_clear(&bit_array, start, count);
+    uint32_t end = bitmap_find_set(&bit_array, start, count);
+
+    if (end > start) {
+      err = falloc_free(start, end - start);
+      if (err != ESP_OK) {
+        falloc_deinit();
+        return err;
+      }
+    }
+    start = end;
+  }
+
+  falloc_stats_t stats;
+  falloc_stats(&stats);
+  ESP_LOGI(TAG,
+           "%u blocks free in %u extents, largest %u blocks, fragmentation "
+           "%u permille",
+           stats.free_blocks, stats.free_extents, stats.largest_extent,
+           stats.fragmentation);
+  return ESP_OK;
+}
+
+uint32_t mmcfs_block_size() { return fs->block_sect * 512; }
+
+int convert_bytes_to_blocks(uint64_t size) {
+  int block_size = fs->block_sect * 512;
+  return (size % block_size == 0) ? size / block_size : size / block_size + 1;
+}
+
+static uint32_t pcm_chunk_blocks() {
+  return convert_bytes_to_blocks((uint64_t)CONFIG_MMCFS_PCM_CHUNK_KB * 1024);
+}
+
+/*
+ * return starting block index, zero-based, or -1 (0xffffffff).
+ *
+ * best-fit from the free extent index, so small files do not cut into the
+ * large free extents that pcm files need.
+ */
+uint32_t allocate_blocks(uint32_t blocks) {
+  lock(alloc_lock);
+  uint32_t start = falloc_alloc(blocks);
+  if (start == FALLOC_NONE) {
+    unlock(alloc_lock);
+    return -1;
+  }
+
+  uint32_t conflict;
+  ESP_ERROR_CHECK(set_bits(start, start + blocks, &conflict));
+  unlock(alloc_lock);
+
+  ESP_LOGI(TAG, "allocating %u blocks, start from %u", blocks, start);
+  return start;
+}
+
+/*
+ * mark units wholly in the data area that blocks [start, end) are in
+ */
+static void discard_mark(uint32_t start, uint32_t end) {
+  if (discard_words == NULL)
+    return;
+
+  uint64_t unit = discard_unit_sect;
+  uint64_t data_end = fs->block_start + fs->block_count * fs->block_sect;
+  uint64_t lo = fs->block_start + (uint64_t)start * fs->block_sect;
+  uint64_t hi = fs->block_start + (uint64_t)end * fs->block_sect;
+
+  uint64_t first = lo / unit;
+  uint64_t first_data = (fs->block_start + unit - 1) / unit;
+  if (first < first_data)
+    first = first_data;
+  uint64_t last = (hi - 1) / unit + 1;
+  if (last > data_end / unit)
+    last = data_end / unit;
+
+  for (uint64_t u = first; u < last && u < discard_pending.nbits; u++) {
+    if (!bitmap_test(&discard_pending, u))
+      bitmap_set_range(&discard_pending, u, u + 1, NULL);
+  }
+  stats.discard_pending =
+      bitmap_used(&discard_pending) + (discard_end > discard_start);
+  if (discard_wake && first < last) {
+    xSemaphoreGive(discard_wake);
+  }
+}
+
+/*
+ * return blocks from start to end (exclusive) to bit_array and the free
+ * extent index.
+ */
+static esp_err_t release_blocks(uint32_t start, uint32_t end) {
+  uint32_t conflict;
+
+  if (start == end) {
+    return ESP_OK;
+  }
+
+  lock(alloc_lock);
+  esp_err_t err = clear_bits(start, end, &conflict);
+  if (err == ESP_OK) {
+    err = falloc_free(start, end - start);
+  }
+  if (err == ESP_OK) {
+    discard_mark(start, end);
+  }
+  unlock(alloc_lock);
+  return err;
+}
+
+/*
+ * cross-check bit_array and the free extent index. Every free extent must be
+ * a maximal run of clear bits, and every clear bit must be in one.
+ */
+static esp_err_t check_locked() {
+  uint32_t count = mmcfs_block_count();
+  uint32_t pos = 0;
+  uint32_t len;
+
+  for (uint32_t start = falloc_next_free(0, &len); start != FALLOC_NONE;
+       start = falloc_next_free(start + len, &len)) {
+    pos = bitmap_find_clear(&bit_array, pos, start);
+    if (pos != start) {
+      ESP_LOGI(TAG, "block %u is free but not indexed", pos);
+      return ESP_ERR_INVALID_STATE;
+    }
+
+    pos = bitmap_find_set(&bit_array, start, start + len);
+    if (pos != start + len) {
+      ESP_LOGI(TAG, "block %u is used but indexed as free", pos);
+      return ESP_ERR_INVALID_STATE;
+    }
+
+    if (pos < count && !test_bit(pos)) {
+      ESP_LOGI(TAG, "free extent %u+%u is not maximal", start, len);
+      return ESP_ERR_INVALID_STATE;
+    }
+  }
+
+  pos = bitmap_find_clear(&bit_array, pos, count);
+  if (pos != count) {
+    ESP_LOGI(TAG, "block %u is free but not indexed", pos);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (bitmap_count(&bit_array, 0, count) != bitmap_used(&bit_array)) {
+    ESP_LOGI(TAG, "bitmap used counter is off");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t mmcfs_check() {
+  lock(meta_lock);
+  lock(alloc_lock);
+  esp_err_t err = check_locked();
+  unlock(alloc_lock);
+  unlock(meta_lock);
+  return err;
+}
+
+/*
+ * takes fingerprints of the whole bucket table after mounting from
+ * checkpoint, 16KiB at a time, so lookups soon need not read buckets
+ * either. Low priority, meta_lock is held for one read.
+ */
+static volatile bool filter_stopping = false;
+static SemaphoreHandle_t filter_done = NULL;
+
+static void filter_task(void *arg) {
+  int bucket_per_buf = SCAN_BUF_SIZE / 512 / fs->bucket_sect;
+  int buf_count = fs->bucket_count / bucket_per_buf;
+  int64_t t = esp_timer_get_time();
+
+  for (int b = 0; b < buf_count && !filter_stopping; b++) {
+    lock(meta_lock);
+    int first = b * bucket_per_buf;
+    bool taken = true;
+    for (int j = 0; j < bucket_per_buf; j++) {
+      taken = taken && filter_has(first + j);
+    }
+
+    esp_err_t err = ESP_OK;
+    if (!taken) {
+      mmcfs_bucket_t *buckets = (mmcfs_bucket_t *)iobuf;
+      err = mmcfs_read_buf_buckets(b, buckets);
+      for (int j = 0; j < bucket_per_buf && err == ESP_OK; j++) {
+        filter_take(first + j, &buckets[j]);
+      }
+    }
+    unlock(meta_lock);
+
+    if (err != ESP_OK) {
+      ESP_LOGI(TAG, "digest filter incomplete, %s", esp_err_to_name(err));
+      break;
+    }
+    vTaskDelay(1);
+  }
+
+  ESP_LOGI(TAG, "digest filter has %d buckets, %lld ms", filter_buckets,
+           (esp_timer_get_time() - t) / 1000);
+  stats.filter_ready = filter_buckets == fs->bucket_count;
+  xSemaphoreGive(filter_done);
+  vTaskDelete(NULL);
+}
+
+static void filter_start() {
+  filter_done = xSemaphoreCreateBinary();
+  filter_stopping = false;
+  if (filter_done == NULL ||
+      xTaskCreate(filter_task, "mmcfs_filter", 2048, NULL, 1, NULL) !=
+          pdPASS) {
+    ESP_LOGI(TAG, "digest filter task not started");
+    if (filter_done) {
+      vSemaphoreDelete(filter_done);
+      filter_done = NULL;
+    }
+  }
+}
+
+static void filter_stop() {
+  if (filter_done == NULL) {
+    return;
+  }
+
+  filter_stopping = true;
+  xSemaphoreTake(filter_done, portMAX_DELAY);
+  vSemaphoreDelete(filter_done);
+  filter_done = NULL;
+}
+
+static void discard_init() {
+  discard_unit_sect = 0;
+#ifdef CONFIG_MMCFS_DISCARD
+  if (mount_opts.no_discard || dev->erase == NULL)
+    return;
+
+  // what the card tells, or what the format was aligned to
+  uint32_t unit = dev->erase_sectors ? dev->erase_sectors
+                                     : superblock->geometry.card_au_sect;
+  if (unit == 0)
+    unit = CONFIG_MMCFS_DISCARD_KB * 2;
+  if (unit < fs->block_sect)
+    unit = fs->block_sect;
+  while (dev->capacity / unit > DISCARD_MAX_UNITS)
+    unit *= 2;
+
+  uint32_t units = dev->capacity / unit;
+  discard_words = (uint32_t *)calloc(BITMAP_WORDS(units), sizeof(uint32_t));
+  if (discard_words == NULL) {
+    ESP_LOGI(TAG, "no memory for discard, freed space not erased");
+    return;
+  }
+  bitmap_init(&discard_pending, discard_words, units);
+  discard_unit_sect = unit;
+  discard_chunk_sect = CONFIG_MMCFS_DISCARD_CHUNK_KB * 2;
+  discard_playing_ms = CONFIG_MMCFS_DISCARD_PLAYING_MS;
+  stats.discard_unit_sect = unit;
+#endif
+}
+
+static void discard_deinit() {
+  free(discard_words);
+  discard_words = NULL;
+  memset(&discard_pending, 0, sizeof(discard_pending));
+  discard_unit_sect = 0;
+  discard_start = 0;
+  discard_end = 0;
+}
+
+/*
+ * erase one pending unit that is wholly free, 1 if done, 0 if there is none
+ */
+static int discard_step() {
+  uint64_t unit = discard_unit_sect;
+  uint64_t sector;
+
+  lock(discard_lock);
+  lock(alloc_lock);
+  for (;;) {
+    uint32_t u = bitmap_find_set(&discard_pending, 0, discard_pending.nbits);
+    if (u == discard_pending.nbits) {
+      unlock(alloc_lock);
+      unlock(discard_lock);
+      return 0;
+    }
+    bitmap_clear_range(&discard_pending, u, u + 1, NULL);
+    stats.discard_pending = bitmap_used(&discard_pending);
+
+    // blocks the unit is in, partly or wholly
+    sector = u * unit;
+    uint32_t b0 = (sector - fs->block_start) / fs->block_sect;
+    uint32_t b1 =
+        (sector + unit - fs->block_start + fs->block_sect - 1) / fs->block_sect;
+    // splitting a free extent may find no index node, skipped then
+    if (bitmap_find_set(&bit_array, b0, b1) == b1 &&
+        falloc_reserve(b0, b1 - b0) == ESP_OK) {
+      ESP_ERROR_CHECK(set_bits(b0, b1, NULL));
+      discard_start = b0;
+      discard_end = b1;
+      stats.discard_pending++; // till erased
+      break;
+    }
+    stats.discard_skipped++;
+  }
+  unlock(alloc_lock);
+
+  // a unit may take the card long, a frame read waits behind a chunk only
+  int64_t t = esp_timer_get_time();
+  esp_err_t err = ESP_OK;
+  for (uint64_t s = 0; s < unit && err == ESP_OK; s += discard_chunk_sect) {
+    uint64_t n = unit - s < discard_chunk_sect ? unit - s : discard_chunk_sect;
+    err = dev_erase(sector + s, n);
+  }
+  op_record(MMCFS_OP_DISCARD, t, err == ESP_OK ? 0 : -EIO);
+
+  lock(alloc_lock);
+  ESP_ERROR_CHECK(clear_bits(discard_start, discard_end, NULL));
+  ESP_ERROR_CHECK(falloc_free(discard_start, discard_end - discard_start));
+  discard_start = 0;
+  discard_end = 0;
+  stats.discard_pending = bitmap_used(&discard_pending);
+  unlock(alloc_lock);
+  unlock(discard_lock);
+
+  if (err != ESP_OK) {
+    ESP_LOGI(TAG, "discard of sector %llu failed, %s", sector,
+             esp_err_to_name(err));
+    return -EIO;
+  }
+  stats.discard_units++;
+  return 1;
+}
+
+/*
+ * sleep ms, or till stopped
+ */
+static void discard_sleep(uint32_t ms) {
+  int64_t until = esp_timer_get_time() + (int64_t)ms * 1000;
+  int64_t now;
+  while (!discard_stopping && (now = esp_timer_get_time()) < until) {
+    xSemaphoreTake(discard_wake, pdMS_TO_TICKS((until - now + 999) / 1000));
+  }
+}
+
+/*
+ * one unit after another while idle, one per CONFIG_MMCFS_DISCARD_PLAYING_MS
+ * while anything is being played, as an erase may hold the card a while
+ */
+static void discard_task(void *arg) {
+  while (!discard_stopping) {
+    int ret = discard_step();
+    if (ret > 0) {
+      discard_sleep(pcm_playing() ? discard_playing_ms : 1);
+      continue;
+    }
+    if (ret < 0) {
+      // not tried again till something else is freed
+      lock(alloc_lock);
+      bitmap_reset(&discard_pending);
+      stats.discard_pending = 0;
+      unlock(alloc_lock);
+    }
+    xSemaphoreTake(discard_wake, pdMS_TO_TICKS(DISCARD_IDLE_MS));
+  }
+
+  xSemaphoreGive(discard_done);
+  vTaskDelete(NULL);
+}
+
+static void discard_stop_cleanup() {
+  // release_blocks gives discard_wake under alloc_lock
+  lock(alloc_lock);
+  if (discard_done) {
+    vSemaphoreDelete(discard_done);
+    discard_done = NULL;
+  }
+  if (discard_wake) {
+    vSemaphoreDelete(discard_wake);
+    discard_wake = NULL;
+  }
+  discard_stopping = false;
+  unlock(alloc_lock);
+}
+
+static void discard_start_task() {
+  if (discard_words == NULL)
+    return;
+
+  discard_done = xSemaphoreCreateBinary();
+  discard_wake = xSemaphoreCreateBinary();
+  discard_stopping = false;
+  if (discard_done == NULL || discard_wake == NULL ||
+      xTaskCreate(discard_task, "mmcfs_discard", 2048, NULL, 1, NULL) !=
+          pdPASS) {
+    ESP_LOGI(TAG, "discard task not started");
+    discard_stop_cleanup();
+  }
+}
+
+static void discard_stop() {
+  if (discard_done == NULL) {
+    return;
+  }
+
+  discard_stopping = true;
+  xSemaphoreGive(discard_wake);
+  xSemaphoreTake(discard_done, portMAX_DELAY);
+  discard_stop_cleanup();
+}
+
+/*
+ * mount mmcfs on given sector device, formatting it if there is no valid
+ * superblock.
+ */
+esp_err_t mmcfs_mount(blkdev_t *blkdev) {
+  esp_err_t err;
+  int64_t t = esp_timer_get_time();
+
+  assert(dev == NULL);
+
+  // created once, never deleted
+  if (meta_lock == NULL) {
+    meta_lock = xSemaphoreCreateMutex();
+    discard_lock = xSemaphoreCreateMutex();
+    alloc_lock = xSemaphoreCreateMutex();
+    readers_lock = xSemaphoreCreateMutex();
+    dev_lock = xSemaphoreCreateMutex();
+    stats_lock = xSemaphoreCreateMutex();
+    if (!meta_lock || !discard_lock || !alloc_lock || !readers_lock ||
+        !dev_lock || !stats_lock) {
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  dev = blkdev;
+  memset(&stats, 0, sizeof(stats));
+
+  err = init_fs();
+  if (err == ESP_OK) {
+    err = pool_init();
+  }
+  if (err != ESP_OK) {
+    free(superblock);
+    superblock = NULL;
+    fs = NULL;
+    dev = NULL;
+    return err;
+  }
+
+  err = log_replay();
+  if (err != ESP_OK) {
+    mmcfs_unmount();
+    return err;
+  }
+
+  bcache_init();
+  lru_init();
+  filter_init();
+
+  bitmap_init(&bit_array, bit_words, mmcfs_block_count());
+  if (mount_opts.force_scan) {
+    ESP_LOGI(TAG, "checkpoint ignored, scanning buckets");
+    err = ESP_FAIL;
+  } else if (stats.log_replayed) {
+    // checkpoint is DIRTY anyway, don't trust it
+    ESP_LOGI(TAG, "log replayed, scanning buckets");
+    err = ESP_FAIL;
+  } else {
+    err = checkpoint_load();
+    if (err != ESP_OK) {
+      ESP_LOGI(TAG, "no clean checkpoint (%s), scanning buckets",
+               esp_err_to_name(err));
+    }
+  }
+
+  if (err != ESP_OK) {
+    bitmap_reset(&bit_array);
+    last_access = 0;
+
+    err = init_falloc_bitmap();
+    if (err == ESP_OK) {
+      // next mount need not scan again
+      esp_err_t ckpt_err = checkpoint_write();
+      if (ckpt_err != ESP_OK) {
+        ESP_LOGI(TAG, "failed to write checkpoint, %s",
+                 esp_err_to_name(ckpt_err));
+      }
+    }
+  }
+
+  if (err == ESP_OK) {
+    err = init_falloc_index();
+  }
+
+  if (err != ESP_OK) {
+    mmcfs_unmount();
+    return err;
+  }
+
+  stats.filter_ready = filter && filter_buckets == fs->bucket_count;
+  if (filter && !stats.filter_ready) {
+    filter_start();
+  }
+  discard_init();
+  discard_start_task();
+
+  stats.mount_us = esp_timer_get_time() - t;
+  return ESP_OK;
+}
+
+void mmcfs_set_mount_opts(const mmcfs_mount_opts_t *opts) {
+  if (opts) {
+    mount_opts = *opts;
+  } else {
+    memset(&mount_opts, 0, sizeof(mount_opts));
+  }
+}
+
+void mmcfs_get_stats(mmcfs_stats_t *out) {
+  if (stats_lock == NULL) {
+    memset(out, 0, sizeof(mmcfs_stats_t));
+    return;
+  }
+  lock(stats_lock);
+  *out = stats;
+  unlock(stats_lock);
+}
+
+/*
+ * drop all in-memory states. Files being created are NOT committed.
+ */
+void mmcfs_unmount() {
+  mmcfs_compact_stop();
+  discard_stop();
+  filter_stop();
+  open_files_drop();
+  pcm_invalidate(NULL);
+  bcache_deinit();
+  lru_deinit();
+  filter_deinit();
+  discard_deinit();
+  pool_deinit();
+  free(superblock);
+  superblock = NULL;
+  fs = NULL;
+  dev = NULL;
+  last_access = 0;
+  bitmap_init(&bit_array, bit_words, MMCFS_MAX_BITARRAY_SIZE);
+  falloc_deinit();
+  memset(&ckpt, 0, sizeof(ckpt));
+  ckpt_clean = false;
+  bucket_unsure = false;
+  compact_dest_start = 0;
+  compact_dest_end = 0;
+}
+
+#ifdef ESP_PLATFORM
+/*
+ * all-in-one function to do them all
+ */
+esp_err_t init_mmcfs() {
+  blkdev_t *blkdev = blkdev_sdmmc_init();
+  if (blkdev == NULL)
+    return ESP_FAIL;
+
+  esp_err_t err = mmcfs_mount(blkdev);
+  if (err == ESP_OK && CONFIG_MMCFS_COMPACT_KBPS > 0) {
+    esp_err_t cerr = mmcfs_compact_start(CONFIG_MMCFS_COMPACT_KBPS);
+    if (cerr != ESP_OK) {
+      ESP_LOGI(TAG, "compaction not started, %s", esp_err_to_name(cerr));
+    }
+  }
+  return err;
+}
+#endif
+
+static int stat_locked(const md5_digest_t *digest, mmcfs_finfo_t *finfo) {
+  int index = mmcfs_bucket_lookup(digest, NULL, NULL);
+  if (index == -ENOENT) {
+    return index;
+  } else if (index < 0) {
+    ESP_LOGI(TAG, "mmcfs_stat failed, %d", index);
+    return index;
+  }
+
+  mmcfs_file_t *mp3_file = (mmcfs_file_t *)malloc(sizeof(mmcfs_file_t));
+  if (mp3_file == NULL) {
+    return -ENOMEM;
+  }
+
+  memcpy(mp3_file, &((mmcfs_bucket_t *)iobuf)->files[index],
+         sizeof(mmcfs_file_t));
+
+  index = mmcfs_bucket_lookup(&mp3_file->link, NULL, NULL);
+  if (index < 0 && index != -ENOENT) {
+    ESP_LOGI(TAG, "mmcfs_stat failed, %d", index);
+    free(mp3_file);
+    return index;
+  }
+
+  if (finfo) {
+    memset(finfo, 0, sizeof(mmcfs_finfo_t));
+    finfo->mp3_state = 2;
+    finfo->pcm_state = index < 0 ? 0 : 2;
+  }
+
+  free(mp3_file);
+  return 0;
+}
+
+int mmcfs_stat(const md5_digest_t *digest, mmcfs_finfo_t *finfo) {
+  int64_t t = esp_timer_get_time();
+  lock(meta_lock);
+  int ret = stat_locked(digest, finfo);
+  unlock(meta_lock);
+  op_record(MMCFS_OP_STAT, t, ret == -ENOENT ? 0 : ret);
+  return ret;
+}
+
+// buckets read through between two needed in a batch lookup
+#define STAT_MAX_GAP 4
+
+typedef struct {
+  uint16_t bucket;
+  int i;
+} stat_req_t;
+
+static int stat_req_cmp(const void *a, const void *b) {
+  const stat_req_t *x = (const stat_req_t *)a;
+  const stat_req_t *y = (const stat_req_t *)b;
+  if (x->bucket != y->bucket)
+    return x->bucket < y->bucket ? -1 : 1;
+  return x->i - y->i;
+}
+
+/*
+ * one bucket choice of a batch lookup. Digests not found yet are sorted by
+ * bucket, so each bucket is searched once for all of them, and buckets not
+ * cached are read in runs, across small gaps. Sets found[i], and
+ * links[i] if given, for digests found. meta_lock.
+ */
+static int lookup_round(const md5_digest_t *digests, int count, int choice,
+                        stat_req_t *reqs, bool *found, md5_digest_t *links) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    if (found[i])
+      continue;
+    const md5_digest_t *d = &digests[i];
+    uint16_t b = choice ? mmcfs_bucket_alt(d) : mmcfs_bucket_index(d);
+    if (choice == 0)
+      stats.bucket_lookups++;
+    if (filter_absent(b, d))
+      continue;
+    reqs[n].bucket = b;
+    reqs[n++].i = i;
+  }
+  qsort(reqs, n, sizeof(stat_req_t), stat_req_cmp);
+
+  mmcfs_bucket_t *buckets = (mmcfs_bucket_t *)iobuf;
+  int per_read = sizeof(iobuf) / sizeof(mmcfs_bucket_t);
+  int first = 0, loaded = 0; // buckets in iobuf
+
+  for (int r = 0; r < n;) {
+    uint16_t b = reqs[r].bucket;
+    const mmcfs_bucket_t *bucket;
+    if (b >= first && b < first + loaded) {
+      bucket = &buckets[b - first];
+    } else if ((bucket = bcache_lookup(b)) != NULL) {
+      stats.bucket_cache_hits++;
+    } else {
+      // with the following ones if close, a command costs more than a few
+      // buckets of transfer
+      int run = 1;
+      for (int s = r + 1; s < n; s++) {
+        int end = reqs[s].bucket - b + 1;
+        if (end > per_read || end > run + STAT_MAX_GAP)
+          break;
+        run = end;
+      }
+
+      stats.bucket_cache_misses += run;
+      esp_err_t err = dev_read(iobuf, mmcfs_bucket_start_sector(b),
+                               run * mmcfs_bucket_sector_count());
+      if (err != ESP_OK) {
+        return -EIO;
+      }
+      for (int j = 0; j < run; j++) {
+        bcache_put(b + j, &buckets[j]);
+        filter_take(b + j, &buckets[j]);
+      }
+      first = b;
+      loaded = run;
+      bucket = &buckets[0];
+    }
+
+    for (; r < n && reqs[r].bucket == b; r++) {
+      int i = reqs[r].i;
+      stats.bucket_probes++;
+      int k = mmcfs_bucket_find_file(bucket, &digests[i]);
+      if (k >= 0) {
+        found[i] = true;
+        if (links)
+          links[i] = bucket->files[k].link;
+      } else if (filter_has(b)) {
+        stats.filter_false++;
+      }
+    }
+  }
+  return 0;
+}
+
+static int lookup_many(const md5_digest_t *digests, int count,
+                       stat_req_t *reqs, bool *found, md5_digest_t *links) {
+  for (int c = 0; c < 2; c++) {
+    int ret = lookup_round(digests, count, c, reqs, found, links);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+int mmcfs_stat_many(const md5_digest_t *digests, int count,
+                    mmcfs_finfo_t *finfo) {
+  if (count <= 0)
+    return 0;
+
+  stat_req_t *reqs = (stat_req_t *)malloc(count * sizeof(stat_req_t));
+  md5_digest_t *links = (md5_digest_t *)malloc(count * sizeof(md5_digest_t));
+  bool *mp3 = (bool *)calloc(count, sizeof(bool));
+  bool *pcm = (bool *)calloc(count, sizeof(bool));
+  int ret = -ENOMEM;
+  if (!reqs || !links || !mp3 || !pcm)
+    goto out;
+
+  lock(meta_lock);
+  ret = lookup_many(digests, count, reqs, mp3, links);
+  if (ret == 0) {
+    // pcm of mp3s found only
+    for (int i = 0; i < count; i++)
+      pcm[i] = !mp3[i];
+    ret = lookup_many(links, count, reqs, pcm, NULL);
+  }
+  unlock(meta_lock);
+
+  if (ret < 0) {
+    ESP_LOGI(TAG, "mmcfs_stat_many failed, %d", ret);
+    goto out;
+  }
+
+  for (int i = 0; i < count; i++) {
+    memset(&finfo[i], 0, sizeof(mmcfs_finfo_t));
+    if (mp3[i]) {
+      finfo[i].mp3_state = 2;
+      finfo[i].pcm_state = pcm[i] ? 2 : 0;
+      ret++;
+    }
+  }
+
+out:
+  free(reqs);
+  free(links);
+  free(mp3);
+  free(pcm);
+  return ret;
+}
+
+int mmcfs_remove_file(const md5_digest_t *digest) {
+  lock(meta_lock);
+  int ret = stat_locked(digest, NULL);
+  if (ret == 0) {
+    txn_begin();
+    ret = mmcfs_bucket_remove_file(digest, true);
+  }
+  if (ret == 0) {
+    ret = txn_commit();
+  }
+
+  if (ret == 0) {
+    esp_err_t err = checkpoint_write();
+    if (err != ESP_OK) {
+      ESP_LOGI(TAG, "failed to write checkpoint, %s", esp_err_to_name(err));
+    }
+  }
+  unlock(meta_lock);
+  return ret;
+}
+
+/*
+ * check if a bucket is full, if so, remove oldest file
+ * if the oldest file is mp3, also remove corresponding pcm
+ * if the oldest file is pcm, just remove pcm (without updating corresponding
+ * mp3). In transaction.
+ */
+int mmcfs_pour_full_bucket(uint16_t index) {
+  mmcfs_bucket_t *buc;
+  int ret = txn_bucket(index, &buc);
+  if (ret < 0) {
+    return ret;
+  }
+
+  int max_files = mmcfs_bucket_max_files();
+  if (mmcfs_file_is_null(&buc->files[max_files - 1]))
+    return 0;
+
+  // extents go with their pcm, whose access is kept up to date
+  uint32_t access = -1;
+  int i = max_files - 1;
+  for (int j = 0; j < max_files; j++) {
+    if (buc->files[j].type == MMCFS_FILE_EXTENT)
+      continue;
+    if (buc->files[j].access < access) {
+      i = j;
+      access = buc->files[j].access;
+    }
+  }
+
+  md5_digest_t target = buc->files[i].self;
+  return mmcfs_bucket_remove_file(&target, true);
+}
+
+/*
+ * files in bucket, and access of the oldest one that may be poured
+ */
+static int bucket_fill(const mmcfs_bucket_t *bucket, uint32_t *oldest) {
+  int n = 0;
+  *oldest = -1;
+  for (; n < mmcfs_bucket_max_files(); n++) {
+    const mmcfs_file_t *f = &bucket->files[n];
+    if (mmcfs_file_is_null(f))
+      break;
+    if (!mmcfs_file_is_extent(f) && f->access < *oldest)
+      *oldest = f->access;
+  }
+  return n;
+}
+
+/*
+ * bucket a new file goes to, with room made in it. The emptier of its two
+ * choices, the first one on a tie; if both are full, the one with the older
+ * file to pour. Extents go to the bucket of their pcm. In transaction.
+ */
+static int bucket_place(const md5_digest_t *digest, mmcfs_file_type_t type,
+                        const md5_digest_t *link, uint16_t *out) {
+  mmcfs_bucket_t *buc;
+
+  if (type == MMCFS_FILE_EXTENT) {
+    int k = txn_lookup(link, &buc);
+    if (k < 0) {
+      return k;
+    }
+    *out = txn_bucket_index(buc);
+    return mmcfs_pour_full_bucket(*out);
+  }
+
+  uint16_t choice[2] = {mmcfs_bucket_index(digest), mmcfs_bucket_alt(digest)};
+  int fill[2];
+  uint32_t oldest[2] = {0};
+  int choices = mount_opts.one_choice ? 1 : 2;
+  int max_files = mmcfs_bucket_max_files();
+  for (int c = 0; c < choices; c++) {
+    // a full bucket is read for its oldest file
+    fill[c] = txn_staged_bucket(choice[c]) ? -1 : filter_fill(choice[c]);
+    if (fill[c] >= 0 && fill[c] < max_files) {
+      continue;
+    }
+
+    const mmcfs_bucket_t *peek;
+    int ret = txn_peek(choice[c], &peek);
+    if (ret < 0) {
+      return ret;
+    }
+    fill[c] = bucket_fill(peek, &oldest[c]);
+  }
+
+  int c = 0;
+  if (choices == 2) {
+    if (fill[0] == max_files && fill[1] == max_files) {
+      c = oldest[1] < oldest[0];
+    } else {
+      c = fill[1] < fill[0];
+    }
+  }
+  if (fill[c] == max_files) {
+    stats.bucket_pours++;
+  }
+  if (c) {
+    stats.bucket_second++;
+  }
+
+  *out = choice[c];
+  return mmcfs_pour_full_bucket(*out);
+}
+
+/*
+ * create a file inside a bucket, in transaction
+ */
+int mmcfs_create_file_ll(const md5_digest_t *mp3_digest,
+                         const md5_digest_t *pcm_digest, uint32_t block_start,
+                         uint32_t block_end, uint32_t size,
+                         mmcfs_file_type_t type, mmcfs_file_subtype_t subtype) {
+  uint16_t bucket;
+  int ret = bucket_place(mp3_digest, type, pcm_digest, &bucket);
+  if (ret < 0) {
+    return ret;
+  }
+
+  mmcfs_bucket_t *buc;
+  ret = txn_bucket(bucket, &buc);
+  if (ret < 0) {
+    return ret;
+  }
+
+  // shift one place forward
+  int max_files = mmcfs_bucket_max_files();
+  for (int i = max_files - 1; i > 0; i--) {
+    buc->files[i] = buc->files[i - 1];
+  }
+
+  // now buc->files[0] is empty
+  memset(&buc->files[0], 0, sizeof(mmcfs_file_t));
+  buc->files[0].self = *mp3_digest;
+  buc->files[0].link = *pcm_digest;
+  buc->files[0].access = last_access;
+  buc->files[0].block_start = block_start;
+  buc->files[0].block_end = block_end;
+  buc->files[0].size = size;
+  buc->files[0].type = type;
+  buc->files[0].subtype = subtype;
+
+  // extents are not in the lru index
+  if (type != MMCFS_FILE_EXTENT) {
+    ret = txn_add(&buc->files[0], bucket);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  last_access++;
+  return 0;
+}
+
+/*
+ * write-combining buffer of one stream (mp3 or pcm). Sequential appends are
+ * gathered and written CONFIG_MMCFS_WRITE_COMBINE_KB at a time, the tail is
+ * written (zero padded to sector) on commit and dropped on abort.
+ */
+typedef struct {
+  uint8_t *buf; // dma capable, NULL if every append is bounced through pool
+  uint32_t size;
+  uint32_t fill; // bytes in buf, or if NULL in the partial sector on card
+  size_t sector; // where buf[0] goes
+} wc_stream_t;
+
+static void wc_init(wc_stream_t *wc, size_t sector) {
+  wc->size = CONFIG_MMCFS_WRITE_COMBINE_KB * 1024;
+  wc->buf = wc->size ? (uint8_t *)heap_caps_malloc(wc->size, MALLOC_CAP_DMA)
+                     : NULL;
+  if (wc->buf == NULL) {
+    wc->size = 0;
+  }
+  wc->fill = 0;
+  wc->sector = sector;
+}
+
+static void wc_deinit(wc_stream_t *wc) {
+  heap_caps_free(wc->buf);
+  wc->buf = NULL;
+}
+
+static esp_err_t wc_flush(wc_stream_t *wc) {
+  if (wc->fill == 0) {
+    return ESP_OK;
+  }
+  // bounced appends are on card, the partial sector padded
+  if (wc->buf == NULL) {
+    wc->sector++;
+    wc->fill = 0;
+    return ESP_OK;
+  }
+
+  uint32_t sectors = (wc->fill + 511) / 512;
+  memset(&wc->buf[wc->fill], 0, sectors * 512 - wc->fill);
+
+  esp_err_t err = dev_write(wc->buf, wc->sector, sectors);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  wc->sector += sectors;
+  wc->fill = 0;
+  return ESP_OK;
+}
+
+/*
+ * append len bytes, of any length
+ */
+static esp_err_t wc_write(wc_stream_t *wc, const void *data, size_t len) {
+  // nothing to combine with, caller's buffer goes to card as is
+  if (wc->fill == 0 && len >= wc->size && len % 512 == 0 &&
+      mmcfs_buf_is_dma(data)) {
+    esp_err_t err = dev_write(data, wc->sector, len / 512);
+    if (err == ESP_OK) {
+      wc->sector += len / 512;
+      stats.bytes_direct += len;
+    }
+    return err;
+  }
+
+  // written padded, a partial sector is read back to be continued
+  if (wc->buf == NULL) {
+    uint8_t *buf = pool_get();
+    esp_err_t err = wc->fill ? dev_read(buf, wc->sector, 1) : ESP_OK;
+    while (len && err == ESP_OK) {
+      size_t n = POOL_BUF_SIZE - wc->fill;
+      if (n > len)
+        n = len;
+
+      memcpy(&buf[wc->fill], data, n);
+      stats.bytes_copied += n;
+      data = (const uint8_t *)data + n;
+      len -= n;
+
+      uint32_t end = wc->fill + n;
+      uint32_t sectors = (end + 511) / 512;
+      memset(&buf[end], 0, sectors * 512 - end);
+      err = dev_write(buf, wc->sector, sectors);
+      if (err == ESP_OK) {
+        wc->sector += end / 512;
+        wc->fill = end % 512;
+        memmove(buf, &buf[end - wc->fill], wc->fill);
+      }
+    }
+    pool_put(buf);
+    return err;
+  }
+
+  while (len) {
+    size_t n = wc->size - wc->fill;
+    if (n > len)
+      n = len;
+
+    memcpy(&wc->buf[wc->fill], data, n);
+    stats.bytes_copied += n;
+    wc->fill += n;
+    data = (const uint8_t *)data + n;
+    len -= n;
+
+    if (wc->fill == wc->size) {
+      esp_err_t err = wc_flush(wc);
+      if (err != ESP_OK) {
+        return err;
+      }
+    }
+  }
+  return ESP_OK;
+}
+
+typedef struct {
+  uint32_t start;
+  uint32_t blocks; // reserved
+  uint32_t size;   // written
+} pcm_extent_t;
+
+struct mmcfs_file_context {
+  bool finalized;
+
+  md5_digest_t digest;
+  md5_digest_t calculated_mp3_digest;
+  md5_digest_t calculated_pcm_digest;
+
+  uint32_t mp3_size;
+  uint32_t mp3_start;
+  uint32_t mp3_blocks;
+
+  // pcm extents reserved so far, frames go to the last one. The first is
+  // reserved for pcm_estimated_size, at most a chunk; they grow as written
+  // and are trimmed at commit.
+  uint32_t pcm_estimated_size;
+  int pcm_extents;
+  pcm_extent_t pcm_ext[MMCFS_PCM_MAX_EXTENTS];
+
+  uint32_t mp3_written;
+  uint32_t pcm_written;
+
+  md5_context_t mp3_md5_ctx;
+  md5_context_t pcm_md5_ctx;
+
+  wc_stream_t mp3_wc;
+  wc_stream_t pcm_wc;
+};
+
+/*
+ * files being written, up to CONFIG_MMCFS_MAX_OPEN_FILES. create_file
+ * allocates a context and reserves blocks; commit or abort (or an error in
+ * writing) frees the context, the handle is invalid after that.
+ */
+static mmcfs_file_handle_t open_files[CONFIG_MMCFS_MAX_OPEN_FILES] = {NULL};
+
+static int open_files_find(mmcfs_file_handle_t file) {
+  for (int i = 0; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    if (open_files[i] == file)
+      return i;
+  }
+  return -1;
+}
+
+static bool open_files_writing(const md5_digest_t *digest) {
+  for (int i = 0; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    if (open_files[i] && memcmp(&open_files[i]->digest, digest,
+                                sizeof(md5_digest_t)) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * clear blocks reserved by open files in a copy of bit_array
+ */
+static void open_files_exclude(bitmap_t *bm) {
+  for (int i = 0; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    mmcfs_file_handle_t f = open_files[i];
+    if (f == NULL)
+      continue;
+
+    ESP_ERROR_CHECK(bitmap_clear_range(bm, f->mp3_start,
+                                       f->mp3_start + f->mp3_blocks, NULL));
+    for (int j = 0; j < f->pcm_extents; j++) {
+      pcm_extent_t *e = &f->pcm_ext[j];
+      ESP_ERROR_CHECK(
+          bitmap_clear_range(bm, e->start, e->start + e->blocks, NULL));
+    }
+  }
+}
+
+/*
+ * drop all open files, unmounting
+ */
+static void open_files_drop() {
+  for (int i = 0; i < CONFIG_MMCFS_MAX_OPEN_FILES; i++) {
+    mmcfs_file_handle_t f = open_files[i];
+    if (f == NULL)
+      continue;
+
+    wc_deinit(&f->mp3_wc);
+    wc_deinit(&f->pcm_wc);
+    free(f);
+    open_files[i] = NULL;
+  }
+}
+
+/*
+ * space reclaim, when no free extent is large enough for a new file. Least
+ * recently used files are removed (an mp3 with its pcm) one transaction at a
+ * time until one is. Among the RECLAIM_CANDIDATES least recently used, the
+ * one leaving the longest free run is taken, so files next to free space go
+ * first. Files being played are skipped. meta_lock held.
+ */
+#define RECLAIM_CANDIDATES 8
+
+/*
+ * rebuild lru index from buckets on card, through iobuf
+ */
+static esp_err_t lru_scan() {
+  int bucket_per_buf = SCAN_BUF_SIZE / 512 / fs->bucket_sect;
+  int buf_count = fs->bucket_count / bucket_per_buf;
+
+  lru_count = 0;
+  lru_partial = false;
+  for (int b = 0; b < buf_count; b++) {
+    mmcfs_bucket_t *buckets = (mmcfs_bucket_t *)iobuf;
+    esp_err_t err = mmcfs_read_buf_buckets(b, buckets);
+    if (err != ESP_OK) {
+      return err;
+    }
+
+    for (int j = 0; j < bucket_per_buf; j++) {
+      filter_take(b * bucket_per_buf + j, &buckets[j]);
+      for (int k = 0; k < mmcfs_bucket_max_files(); k++) {
+        if (mmcfs_file_is_null(&buckets[j].files[k]))
+          break;
+        lru_add(&buckets[j].files[k], b * bucket_per_buf + j);
       }
     }
   }
 
-  free(outbuf);
-
-  last_access++;
-
-  ESP_LOGI(TAG, "%d mp3 files found, %d blocks used.", mp3_count,
-           mp3_block_count);
-  ESP_LOGI(TAG, "%d pcm files found, %d blocks used.", pcm_count,
-           pcm_block_count);
-
+  lru_built = true;
   return ESP_OK;
 }
 
-uint32_t mmcfs_block_size() { return fs->block_sect * 512; }
-
-int convert_bytes_to_blocks(uint64_t size) {
-  int block_size = fs->block_sect * 512;
-  return (size % block_size == 0) ? size / block_size : size / block_size + 1;
+/*
+ * length of the free run file blocks [start, end) would end up in
+ */
+static uint32_t reclaim_run(uint32_t start, uint32_t end) {
+  uint32_t run = end - start;
+  uint32_t len;
+
+  lock(alloc_lock);
+  uint32_t left = start > 0 ? falloc_find(start - 1, &len) : FALLOC_NONE;
+  if (left != FALLOC_NONE) {
+    run += start - left;
+  }
+  if (end < mmcfs_block_count() && falloc_find(end, &len) != FALLOC_NONE) {
+    run += len;
+  }
+  unlock(alloc_lock);
+  return run;
 }
 
 /*
- * return starting block index, zero-based, or -1 (0xffffffff).
+ * index of the entry to reclaim, or -1
  */
-uint32_t allocate_blocks(uint32_t blocks) {
-  uint32_t count = 0;
-  for (uint32_t i = 0; i < 16 * 1024; i++) {
-    if (test_bit(i)) {
-      count = 0;
-    } else {
-      count++;
+static int reclaim_pick() {
+  int cand[RECLAIM_CANDIDATES];
+  int n = 0;
+
+  // the least recently used ones, sorted
+  for (int i = 0; i < lru_count; i++) {
+    if (n == RECLAIM_CANDIDATES && lru[cand[n - 1]].used <= lru[i].used)
+      continue;
+    int j = n < RECLAIM_CANDIDATES ? n++ : n - 1;
+    for (; j > 0 && lru[cand[j - 1]].used > lru[i].used; j--) {
+      cand[j] = cand[j - 1];
     }
+    cand[j] = i;
+  }
 
-    if (count == blocks) {
-      uint32_t start = i - blocks + 1;
-      ESP_LOGI(TAG, "allocating %u blocks, start from %u", blocks, start);
-
-      for (uint32_t i = start; i < start + blocks; i++) {
-        set_bit(i);
-      }
-      return start;
+  int best = -1;
+  uint32_t best_run = 0;
+  for (int c = 0; c < n; c++) {
+    lru_entry_t *e = &lru[cand[c]];
+    uint32_t run = reclaim_run(e->block_start, e->block_end);
+    if (best < 0 || run > best_run) {
+      best = cand[c];
+      best_run = run;
     }
   }
-  return -1;
+  return best;
 }
 
 /*
- * all-in-one function to do them all
+ * remove one victim, adding the bytes freed
  */
-esp_err_t init_mmcfs() {
-  esp_err_t err;
+static int reclaim_one(uint64_t *bytes) {
+  if (lru_size == 0) {
+    return -ENOSPC;
+  }
+  if (!lru_built || (lru_count == 0 && lru_partial)) {
+    if (lru_scan() != ESP_OK) {
+      return -EIO;
+    }
+  }
 
-  err = init_mmc();
-  if (err != ESP_OK)
-    return err;
+  for (int tries = lru_count; tries > 0; tries--) {
+    int i = reclaim_pick();
+    if (i < 0) {
+      break;
+    }
 
-  err = init_fs();
-  if (err != ESP_OK)
-    return err;
+    lru_entry_t victim = lru[i];
+
+    txn_begin();
+    mmcfs_bucket_t *buc;
+    int ret = txn_bucket(victim.bucket, &buc);
+    if (ret < 0) {
+      return ret;
+    }
 
-  // TODO apply log if necessary
+    int k = lru_find_file(buc, &victim);
+    if (k < 0) {
+      // gone already
+      lru_remove(victim.bucket, victim.block_start, victim.block_end);
+      continue;
+    }
 
-  return init_falloc_bitmap();
-}
+    mmcfs_file_t f = buc->files[k];
+    const md5_digest_t *pcm = mmcfs_file_is_mp3(&f) ? &f.link : &f.self;
+    if (pcm_reading(pcm)) {
+      lru_touch(&f, victim.bucket);
+      continue;
+    }
 
-int mmcfs_stat(const md5_digest_t *digest, mmcfs_finfo_t *finfo) {
-  esp_err_t err;
+    // the pair, by its mp3 if there is one
+    if (mmcfs_file_is_mp3(&f)) {
+      ret = mmcfs_bucket_remove_file(&f.self, true);
+    } else {
+      ret = mmcfs_bucket_remove_file(&f.link, true);
+      if (ret == 0) {
+        ret = mmcfs_bucket_remove_file(&f.self, false);
+      }
+    }
+    if (ret == 0) {
+      ret = txn_commit();
+    }
+    if (ret < 0) {
+      return ret;
+    }
 
-  err = sdmmc_read_sectors(card, iobuf, mmcfs_bucket_start_sector(digest),
-                           mmcfs_bucket_sector_count());
-  if (err != ESP_OK) {
-    ESP_LOGI(TAG, "mmcfs_stat failed, %s", esp_err_to_name(err));
-    return -EIO;
+    for (int r = 0; r < txn.removed_count; r++) {
+      uint32_t blocks = txn.removed[r].block_end - txn.removed[r].block_start;
+      *bytes += (uint64_t)blocks * mmcfs_block_size();
+    }
+    for (int r = 0; r < txn.removed_count; r++) {
+      stats.reclaim_files += txn.removed[r].type != MMCFS_FILE_EXTENT;
+    }
+    return 0;
   }
+  return -ENOSPC;
+}
 
-  int index = mmcfs_bucket_find_file((mmcfs_bucket_t *)iobuf, digest);
-  if (index < 0) {
-    return -ENOENT;
+/*
+ * allocate_blocks, reclaiming space if needed. -1 if even that fails.
+ */
+static uint32_t allocate_reclaiming(uint32_t blocks) {
+  uint32_t start = allocate_blocks(blocks);
+  if (start != -1) {
+    return start;
   }
 
-  mmcfs_file_t *mp3_file = (mmcfs_file_t *)malloc(sizeof(mmcfs_file_t));
-  if (mp3_file == NULL) {
-    return -ENOMEM;
+  // a unit being erased is free space too, nothing is evicted for it
+  lock(discard_lock);
+  start = allocate_blocks(blocks);
+  if (start != -1) {
+    unlock(discard_lock);
+    return start;
   }
 
-  memcpy(mp3_file, &((mmcfs_bucket_t *)iobuf)->files[index],
-         sizeof(mmcfs_file_t));
+  int64_t t = esp_timer_get_time();
+  uint64_t bytes = 0;
+  int ret = 0;
+  while (start == -1 && (ret = reclaim_one(&bytes)) == 0) {
+    start = allocate_blocks(blocks);
+  }
+  unlock(discard_lock);
+
+  op_record(MMCFS_OP_RECLAIM, t, start == -1 ? -ENOSPC : 0);
+  uint32_t us = esp_timer_get_time() - t;
+  stats.reclaim_runs++;
+  stats.reclaim_bytes += bytes;
+  stats.reclaim_us += us;
+  if (stats.reclaim_max_us < us) {
+    stats.reclaim_max_us = us;
+  }
 
-  err = sdmmc_read_sectors(card, iobuf,
-                           mmcfs_bucket_start_sector(&mp3_file->link),
-                           mmcfs_bucket_sector_count());
-  if (err != ESP_OK) {
-    ESP_LOGI(TAG, "mmcfs_stat failed, %s", esp_err_to_name(err));
-    free(mp3_file);
-    return -EIO;
+  ESP_LOGI(TAG, "reclaimed %llu bytes in %u us for %u blocks, %s", bytes, us,
+           blocks, start == -1 ? "failed" : "done");
+  if (ret < 0) {
+    ESP_LOGI(TAG, "reclaim stopped, %d", ret);
   }
+  return start;
+}
 
-  index = mmcfs_bucket_find_file((mmcfs_bucket_t *)iobuf, &mp3_file->link);
-  if (finfo) {
-    memset(finfo, 0, sizeof(mmcfs_finfo_t));
-    finfo->mp3_state = 2;
-    finfo->pcm_state = index < 0 ? 0 : 2;
+/*
+ * compaction. Files are moved, one per step, from the end of the data area
+ * into the lowest free extent before them that holds them whole, so free
+ * space gathers in large extents without removing anything. Data is copied
+ * into the reserved destination first, without meta_lock and one pool
+ * buffer at a time so playback reads get the card in between; then the
+ * record is changed in a transaction and the old blocks freed. A power loss
+ * leaves the record on one copy and the other in free space.
+ *
+ * Only files with free space next to them are moved, so the blocks they
+ * leave join a free extent instead of making a new hole. Files being played
+ * are not moved.
+ */
+#define COMPACT_IDLE_MS 10000
+#define COMPACT_FRAGMENTATION 250 // permille, task idles below this
+
+static volatile bool compact_stopping = false;
+static SemaphoreHandle_t compact_done = NULL;
+static uint32_t compact_kbps = 0;
+
+/*
+ * lowest free extent starting before `before` holding `blocks`, or
+ * FALLOC_NONE
+ */
+static uint32_t compact_fit(uint32_t blocks, uint32_t before) {
+  uint32_t len;
+  uint32_t found = FALLOC_NONE;
+
+  lock(alloc_lock);
+  for (uint32_t start = falloc_next_free(0, &len);
+       start != FALLOC_NONE && start < before;
+       start = falloc_next_free(start + len, &len)) {
+    if (len >= blocks) {
+      found = start;
+      break;
+    }
   }
+  unlock(alloc_lock);
+  return found;
+}
 
-  free(mp3_file);
-  return 0;
+/*
+ * the unit being erased is next to start..end, it is free space once erased
+ */
+static bool discard_next_to(uint32_t start, uint32_t end) {
+  lock(alloc_lock);
+  bool next = discard_end > discard_start &&
+              (discard_end == start || discard_start == end);
+  unlock(alloc_lock);
+  return next;
 }
 
 /*
- * check if a bucket is full, if so, remove oldest file
- * if the oldest file is mp3, also remove corresponding pcm
- * if the oldest file is pcm, just remove pcm (without updating corresponding
- * mp3)
+ * lru entry starting below `below` to move and its destination, the one
+ * nearest the end of the data area, or -1
  */
-int mmcfs_pour_full_bucket(const md5_digest_t *digest) {
-  int ret = mmcfs_bucket_read(digest, NULL);
-  if (ret < 0) {
-    return ret;
+static int compact_pick(uint32_t below, uint32_t *dest) {
+  int best = -1;
+
+  for (int i = 0; i < lru_count; i++) {
+    lru_entry_t *e = &lru[i];
+    uint32_t blocks = e->block_end - e->block_start;
+    if (e->block_start >= below || blocks == 0 ||
+        (best >= 0 && e->block_start < lru[best].block_start))
+      continue;
+
+    // no free space next to it
+    if (reclaim_run(e->block_start, e->block_end) == blocks &&
+        !discard_next_to(e->block_start, e->block_end))
+      continue;
+
+    uint32_t d = compact_fit(blocks, e->block_start);
+    if (d != FALLOC_NONE) {
+      best = i;
+      *dest = d;
+    }
   }
+  return best;
+}
 
-  int max_files = mmcfs_bucket_max_files();
-  mmcfs_bucket_t *buc = (mmcfs_bucket_t *)iobuf;
-  if (mmcfs_file_is_null(&buc->files[max_files - 1]))
-    return 0;
+/*
+ * copy sectors, at most kbps KiB/s unless 0
+ */
+static int compact_copy(size_t from, size_t to, uint32_t sectors,
+                        uint32_t kbps) {
+  const uint32_t chunk = POOL_BUF_SIZE / 512;
+  int64_t t = esp_timer_get_time();
+
+  for (uint32_t done = 0; done < sectors; done += chunk) {
+    uint32_t n = sectors - done < chunk ? sectors - done : chunk;
+    if (compact_stopping) {
+      return -EINTR;
+    }
 
-  uint32_t access = -1;
-  int i = -1;
-  for (int j = 0; j < max_files; j++) {
-    if (buc->files[j].access < access) {
-      i = j;
-      access = buc->files[j].access;
+    uint8_t *buf = pool_get();
+    esp_err_t err = dev_read(buf, from + done, n);
+    if (err == ESP_OK) {
+      err = dev_write(buf, to + done, n);
+    }
+    pool_put(buf);
+    if (err != ESP_OK) {
+      return -EIO;
     }
-  }
 
-  md5_digest_t target = buc->files[i].self;
-  return mmcfs_bucket_remove_file(&target, true);
+    if (kbps) {
+      int64_t due = t + (int64_t)(done + n) * 512 * 1000000 / (kbps * 1024);
+      int64_t now = esp_timer_get_time();
+      if (due > now) {
+        vTaskDelay(pdMS_TO_TICKS((due - now + 999) / 1000));
+      }
+    }
+  }
+  return 0;
 }
 
 /*
- * create a file inside a bucket
+ * move file to dest. meta_lock and discard_lock held, dropped while copying;
+ * dest and the file are both allocated, so no unit in them is claimed for
+ * erase meanwhile
  */
-int mmcfs_create_file_ll(const md5_digest_t *mp3_digest,
-                         const md5_digest_t *pcm_digest, uint32_t block_start,
-                         uint32_t block_end, uint32_t size,
-                         mmcfs_file_type_t type, mmcfs_file_subtype_t subtype) {
+static int compact_move(const mmcfs_file_t *file, uint16_t bucket,
+                        uint32_t dest, uint32_t kbps) {
+  uint32_t start = file->block_start;
+  uint32_t blocks = file->block_end - start;
+  uint32_t conflict;
+
+  lock(alloc_lock);
+  // dest may split a free extent, and the index have no node for it
+  if (falloc_reserve(dest, blocks) != ESP_OK) {
+    unlock(alloc_lock);
+    return -ENOMEM;
+  }
+  ESP_ERROR_CHECK(set_bits(dest, dest + blocks, &conflict));
+  compact_dest_start = dest;
+  compact_dest_end = dest + blocks;
+  unlock(alloc_lock);
+
+  uint32_t sectors = (file->size + 511) / 512;
+  if (sectors > blocks * fs->block_sect) {
+    sectors = blocks * fs->block_sect;
+  }
 
-  int ret = mmcfs_pour_full_bucket(mp3_digest);
-  if (ret < 0) {
-    return ret;
+  unlock(discard_lock);
+  unlock(meta_lock);
+  int ret = compact_copy(fs->block_start + (size_t)start * fs->block_sect,
+                         fs->block_start + (size_t)dest * fs->block_sect,
+                         sectors, kbps);
+  lock(meta_lock);
+  lock(discard_lock);
+
+  // removed, or opened for playing, while copying
+  mmcfs_bucket_t *buc;
+  if (ret == 0) {
+    txn_begin();
+    ret = txn_bucket(bucket, &buc);
+  }
+  int k = -1;
+  if (ret == 0) {
+    k = mmcfs_bucket_find_file(buc, &file->self);
+    if (k < 0 || buc->files[k].block_start != start ||
+        buc->files[k].block_end != start + blocks || pcm_reading(&file->self))
+      ret = -EAGAIN;
   }
 
-  // read bucket into iobuf
-  ret = mmcfs_bucket_read(mp3_digest, NULL);
-  if (ret < 0) {
-    return ret;
+  if (ret == 0) {
+    buc->files[k].block_start = dest;
+    buc->files[k].block_end = dest + blocks;
+    ret = txn_commit();
   }
 
-  // shift one place forward
-  int max_files = mmcfs_bucket_max_files();
-  mmcfs_bucket_t *buc = (mmcfs_bucket_t *)iobuf;
-  for (int i = max_files - 1; i > 0; i--) {
-    buc[i] = buc[i - 1];
+  if (ret == 0) {
+    lru_move(bucket, start, start + blocks, dest);
+    ESP_ERROR_CHECK(release_blocks(start, start + blocks));
+  } else if (!bucket_unsure) {
+    ESP_ERROR_CHECK(release_blocks(dest, dest + blocks));
   }
 
-  // now buc->files[0] is empty
-  memset(&buc->files[0], 0, sizeof(mmcfs_file_t));
-  buc->files[0].self = *mp3_digest;
-  buc->files[0].link = *pcm_digest;
-  buc->files[0].access = last_access;
-  buc->files[0].block_start = block_start;
-  buc->files[0].block_end = block_end;
-  buc->files[0].size = size;
-  buc->files[0].type = type;
-  buc->files[0].subtype = subtype;
+  lock(alloc_lock);
+  compact_dest_start = 0;
+  compact_dest_end = 0;
+  unlock(alloc_lock);
 
-  ret = mmcfs_bucket_update(NULL);
-  if (ret < 0) {
-    return ret;
+  if (ret == 0) {
+    esp_err_t err = checkpoint_write();
+    if (err != ESP_OK) {
+      ESP_LOGI(TAG, "failed to write checkpoint, %s", esp_err_to_name(err));
+    }
+
+    stats.compact_files++;
+    stats.compact_bytes += (uint64_t)sectors * 512;
+  } else if (ret == -EAGAIN) {
+    stats.compact_aborted++;
   }
+  return ret;
+}
 
-  last_access++;
-  return 0;
+int mmcfs_compact_step(uint32_t kbps) {
+  int ret = 0;
+
+  lock(meta_lock);
+  if (lru_size == 0 || bucket_unsure) {
+    goto out;
+  }
+  if (!lru_built || (lru_count == 0 && lru_partial)) {
+    if (lru_scan() != ESP_OK) {
+      ret = -EIO;
+      goto out;
+    }
+  }
+
+  uint32_t below = UINT32_MAX;
+  uint32_t dest = 0;
+  int i;
+  while ((i = compact_pick(below, &dest)) >= 0) {
+    lru_entry_t e = lru[i];
+    ret = mmcfs_bucket_read(e.bucket, &bbuf);
+    if (ret < 0) {
+      goto out;
+    }
+
+    int k = lru_find_file(&bbuf, &e);
+    if (k < 0) {
+      lru_remove(e.bucket, e.block_start, e.block_end);
+      continue;
+    }
+
+    mmcfs_file_t file = bbuf.files[k];
+    if (pcm_reading(&file.self)) {
+      below = e.block_start;
+      continue;
+    }
+
+    // dest was free space when picked, so it is again once any erase in
+    // flight is done
+    lock(discard_lock);
+    ret = compact_move(&file, e.bucket, dest, kbps);
+    unlock(discard_lock);
+    if (ret == 0) {
+      ret = 1;
+    } else if (ret == -EAGAIN) {
+      // try again next step
+      ret = 1;
+    }
+    goto out;
+  }
+
+out:
+  unlock(meta_lock);
+  return ret;
 }
 
-struct mmcfs_file_context {
-  bool finalized;
+static void compact_task(void *arg) {
+  while (!compact_stopping) {
+    falloc_stats_t fa;
+    lock(alloc_lock);
+    falloc_stats(&fa);
+    unlock(alloc_lock);
 
-  md5_digest_t digest;
-  md5_digest_t calculated_mp3_digest;
-  md5_digest_t calculated_pcm_digest;
+    int ret = 0;
+    if (fa.fragmentation >= COMPACT_FRAGMENTATION) {
+      ret = mmcfs_compact_step(compact_kbps);
+    }
+    if (ret > 0) {
+      continue;
+    }
+    if (ret < 0 && ret != -EINTR) {
+      ESP_LOGI(TAG, "compaction failed, %d", ret);
+    }
 
-  uint32_t mp3_size;
-  uint32_t mp3_start;
-  uint32_t mp3_blocks;
-  uint32_t pcm_estimated_size;
-  uint32_t pcm_actual_size;
-  uint32_t pcm_start;
-  uint32_t pcm_estimated_blocks;
-  uint32_t pcm_actual_blocks;
+    xSemaphoreTake(compact_wake, pdMS_TO_TICKS(COMPACT_IDLE_MS));
+  }
 
-  uint32_t mp3_written;
-  uint32_t pcm_written;
+  xSemaphoreGive(compact_done);
+  vTaskDelete(NULL);
+}
 
-  md5_context_t mp3_md5_ctx;
-  md5_context_t pcm_md5_ctx;
-};
+static void compact_stop_cleanup() {
+  // txn_commit gives compact_wake under meta_lock
+  lock(meta_lock);
+  if (compact_done) {
+    vSemaphoreDelete(compact_done);
+    compact_done = NULL;
+  }
+  if (compact_wake) {
+    vSemaphoreDelete(compact_wake);
+    compact_wake = NULL;
+  }
+  compact_stopping = false;
+  unlock(meta_lock);
+}
 
-/*
- * create_file must starts from wctx = NULL
- * s0 -> s1, allocate a file creation context, allocate bits (blocks)
- * all writing must happen in s1 state, if error, file handle is invalid
- * s1 -> s0 by commit, and wctx recycled, also unused blocks
- */
-static mmcfs_file_handle_t _file = NULL;
+esp_err_t mmcfs_compact_start(uint32_t kbps) {
+  if (compact_done) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  compact_done = xSemaphoreCreateBinary();
+  compact_wake = xSemaphoreCreateBinary();
+  compact_kbps = kbps;
+  compact_stopping = false;
+  if (compact_done == NULL || compact_wake == NULL ||
+      xTaskCreate(compact_task, "mmcfs_compact", 3072, NULL, 1, NULL) !=
+          pdPASS) {
+    compact_stop_cleanup();
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void mmcfs_compact_stop() {
+  if (compact_done == NULL) {
+    return;
+  }
+
+  compact_stopping = true;
+  xSemaphoreGive(compact_wake);
+  xSemaphoreTake(compact_done, portMAX_DELAY);
+  compact_stop_cleanup();
+}
 
 /*
- * Create a file handle, allocating blocks for writing.
+ * Create a file handle, allocating blocks for writing. meta_lock held.
  *
  * minimal 96kbps (12KiB/s)
  */
-int mmcfs_create_file(md5_digest_t *digest, uint32_t mp3_size,
-                      mmcfs_file_handle_t *out) {
+static int create_file_locked(md5_digest_t *digest, uint32_t mp3_size,
+                              mmcfs_file_handle_t *out) {
 
-  assert(_file == NULL);
+  if (open_files_writing(digest)) {
+    return -EEXIST;
+  }
 
-  int ret = mmcfs_bucket_read(digest, &bbuf);
-  if (ret < 0) {
-    return ret;
+  int slot = open_files_find(NULL);
+  if (slot < 0) {
+    return -EMFILE;
   }
 
-  int index = mmcfs_bucket_find_file(&bbuf, digest);
+  int index = mmcfs_bucket_lookup(digest, &bbuf, NULL);
   if (index >= 0) {
     ESP_LOGI(TAG, "mmcfs_create_file failed, target exist");
     return -EEXIST;
@@ -899,78 +3658,235 @@ int mmcfs_create_file(md5_digest_t *digest, uint32_t mp3_size,
     return index;
   }
 
+  // an empty mp3 still has a block, as there is no allocating none
   int mp3_blocks = convert_bytes_to_blocks(mp3_size);
-  int pcm_estimated_size = mp3_size / (12 * 1024) * 48000 * 4;
-  int pcm_estimated_blocks = convert_bytes_to_blocks(pcm_estimated_size);
+  if (mp3_blocks == 0) {
+    mp3_blocks = 1;
+  }
+  uint32_t pcm_estimated_size = mp3_size / (12 * 1024) * 48000 * 4;
+  uint32_t pcm_blocks = convert_bytes_to_blocks(pcm_estimated_size);
+  if (pcm_blocks > pcm_chunk_blocks()) {
+    pcm_blocks = pcm_chunk_blocks();
+  }
+  if (pcm_blocks < convert_bytes_to_blocks(FRAME_BUF_SIZE)) {
+    pcm_blocks = convert_bytes_to_blocks(FRAME_BUF_SIZE);
+  }
 
-  uint32_t mp3_start = allocate_blocks(mp3_blocks);
+  uint32_t mp3_start = allocate_reclaiming(mp3_blocks);
   if (mp3_start == -1) {
-    return -1; // this is critical error !!! TODO
+    return -ENOSPC;
   }
 
-  uint32_t pcm_start = allocate_blocks(pcm_estimated_blocks);
+  uint32_t pcm_start = allocate_reclaiming(pcm_blocks);
   if (pcm_start == -1) {
-    assert(ESP_OK == clear_bits(mp3_start, mp3_start + mp3_blocks, NULL));
-    return -1; // this is also critical error !!! TODO
+    ESP_ERROR_CHECK(release_blocks(mp3_start, mp3_start + mp3_blocks));
+    return -ENOSPC;
   }
 
   mmcfs_file_context_t *file =
       (mmcfs_file_context_t *)malloc(sizeof(mmcfs_file_context_t));
+  if (file == NULL) {
+    ESP_ERROR_CHECK(release_blocks(mp3_start, mp3_start + mp3_blocks));
+    ESP_ERROR_CHECK(release_blocks(pcm_start, pcm_start + pcm_blocks));
+    return -ENOMEM;
+  }
 
-  if (file) {
-    file->finalized = false;
-    memcpy(&file->digest, digest, sizeof(md5_digest_t));
-    file->mp3_size = mp3_size;
-    file->mp3_start = mp3_start;
-    file->mp3_blocks = mp3_blocks;
-    file->pcm_estimated_size = pcm_estimated_size;
-    file->pcm_actual_size = 0;
-    file->pcm_start = pcm_start;
-    file->pcm_estimated_blocks = pcm_estimated_blocks;
-    file->pcm_actual_blocks = 0;
+  file->finalized = false;
+  memcpy(&file->digest, digest, sizeof(md5_digest_t));
+  file->mp3_size = mp3_size;
+  file->mp3_start = mp3_start;
+  file->mp3_blocks = mp3_blocks;
+  file->pcm_estimated_size = pcm_estimated_size;
+  file->pcm_extents = 1;
+  file->pcm_ext[0].start = pcm_start;
+  file->pcm_ext[0].blocks = pcm_blocks;
+  file->pcm_ext[0].size = 0;
 
-    file->mp3_written = 0;
-    file->pcm_written = 0;
+  file->mp3_written = 0;
+  file->pcm_written = 0;
 
-    esp_rom_md5_init(&file->mp3_md5_ctx);
-    esp_rom_md5_init(&file->pcm_md5_ctx);
-  }
+  esp_rom_md5_init(&file->mp3_md5_ctx);
+  esp_rom_md5_init(&file->pcm_md5_ctx);
 
-  _file = file;
+  wc_init(&file->mp3_wc, fs->block_start + mp3_start * fs->block_sect);
+  wc_init(&file->pcm_wc, fs->block_start + pcm_start * fs->block_sect);
+
+  open_files[slot] = file;
   *out = file;
   return 0;
 }
 
-void mmcfs_abort_file(mmcfs_file_handle_t file) {
-  assert(file == _file);
-  assert(ESP_OK ==
-         clear_bits(file->mp3_start, file->mp3_start + file->mp3_blocks, NULL));
-  assert(ESP_OK == clear_bits(file->pcm_start,
-                              file->pcm_start + file->pcm_estimated_blocks,
-                              NULL));
+int mmcfs_create_file(md5_digest_t *digest, uint32_t mp3_size,
+                      mmcfs_file_handle_t *out) {
+  int64_t t = esp_timer_get_time();
+  lock(meta_lock);
+  int ret = create_file_locked(digest, mp3_size, out);
+  unlock(meta_lock);
+  op_record(MMCFS_OP_CREATE, t, ret);
+  return ret;
+}
+
+/*
+ * meta_lock held, the file leaves open_files and its reservation together
+ */
+static void abort_file_locked(mmcfs_file_handle_t file) {
+  int slot = open_files_find(file);
+  assert(slot >= 0);
+  ESP_ERROR_CHECK(
+      release_blocks(file->mp3_start, file->mp3_start + file->mp3_blocks));
+  for (int i = 0; i < file->pcm_extents; i++) {
+    pcm_extent_t *e = &file->pcm_ext[i];
+    ESP_ERROR_CHECK(release_blocks(e->start, e->start + e->blocks));
+  }
+  wc_deinit(&file->mp3_wc);
+  wc_deinit(&file->pcm_wc);
   free(file);
-  _file = NULL;
+  open_files[slot] = NULL;
 }
 
-int mmcfs_write_mp3(mmcfs_file_handle_t file, char *buf, size_t len) {
-  assert(file == _file);
+void mmcfs_abort_file(mmcfs_file_handle_t file) {
+  lock(meta_lock);
+  abort_file_locked(file);
+  unlock(meta_lock);
+}
+
+/*
+ * the transaction of commit failed. If it may still be on card (see
+ * bucket_unsure) the blocks stay reserved, else released. meta_lock held.
+ */
+static void commit_failed_locked(mmcfs_file_handle_t file) {
+  if (bucket_unsure) {
+    file->mp3_blocks = 0;
+    file->pcm_extents = 0;
+  }
+  abort_file_locked(file);
+}
+
+/*
+ * room for another frame in the last pcm extent: blocks right after it if
+ * they are free, else a new extent. As much is reserved as the file has
+ * already, at least a chunk, so a file takes few extents however long it
+ * gets; space is reclaimed for a chunk only.
+ */
+static int pcm_grow(mmcfs_file_handle_t file) {
+  pcm_extent_t *ext = &file->pcm_ext[file->pcm_extents - 1];
+  uint32_t want = 0;
+  for (int i = 0; i < file->pcm_extents; i++) {
+    want += file->pcm_ext[i].blocks;
+  }
+  if (want < pcm_chunk_blocks()) {
+    want = pcm_chunk_blocks();
+  }
+
+  lock(meta_lock);
+
+  uint32_t end = ext->start + ext->blocks;
+  uint32_t len = 0;
+  lock(alloc_lock);
+  if (end < mmcfs_block_count() && falloc_find(end, &len) == end) {
+    if (len > want) {
+      len = want;
+    }
+    // else a new extent
+    if ((uint64_t)(ext->blocks + len) * mmcfs_block_size() >=
+            ext->size + FRAME_BUF_SIZE &&
+        falloc_reserve(end, len) == ESP_OK) {
+      uint32_t conflict;
+      ESP_ERROR_CHECK(set_bits(end, end + len, &conflict));
+      ext->blocks += len;
+      stats.pcm_grown++;
+    } else {
+      len = 0;
+    }
+  }
+  unlock(alloc_lock);
+
+  uint32_t start = -1;
+  if (len == 0 && file->pcm_extents < MMCFS_PCM_MAX_EXTENTS) {
+    start = allocate_blocks(want);
+    if (start == -1) {
+      want = pcm_chunk_blocks();
+      start = allocate_reclaiming(want);
+    }
+  }
+  unlock(meta_lock);
+
+  if (len) {
+    return 0;
+  }
+  if (start == -1) {
+    return -ENOSPC;
+  }
+
+  // the last extent is done
+  pcm_extent_t *next = &file->pcm_ext[file->pcm_extents++];
+  next->start = start;
+  next->blocks = want;
+  next->size = 0;
+  stats.pcm_extents++;
+
+  if (wc_flush(&file->pcm_wc) != ESP_OK) {
+    return -EIO;
+  }
+  file->pcm_wc.sector = fs->block_start + (size_t)start * fs->block_sect;
+  return 0;
+}
+
+/*
+ * pcm record and its extent records, in transaction
+ */
+static int pcm_create_ll(mmcfs_file_handle_t file) {
+  const md5_digest_t *pcm = &file->calculated_pcm_digest;
+  pcm_extent_t *e = &file->pcm_ext[0];
+  mmcfs_bucket_t *buc;
+
+  int ret = mmcfs_create_file_ll(pcm, &file->digest, e->start,
+                                 e->start + convert_bytes_to_blocks(e->size),
+                                 file->pcm_written, MMCFS_FILE_PCM,
+                                 MMCFS_PCM_48K_16B_STEREO_OOB_NONE);
+  for (int i = 1; i < file->pcm_extents && ret == 0; i++) {
+    md5_digest_t digest;
+    e = &file->pcm_ext[i];
+    mmcfs_extent_digest(pcm, i, &digest);
+    ret = mmcfs_create_file_ll(&digest, pcm, e->start,
+                               e->start + convert_bytes_to_blocks(e->size),
+                               e->size, MMCFS_FILE_EXTENT, 0);
+    if (ret == 0) {
+      ret = txn_lookup(&digest, &buc);
+    }
+    if (ret >= 0) {
+      buc->files[ret].extent_index = i;
+      ret = 0;
+    }
+  }
+
+  if (ret == 0) {
+    ret = txn_lookup(pcm, &buc);
+  }
+  if (ret >= 0) {
+    buc->files[ret].extents = file->pcm_extents - 1;
+    ret = 0;
+  }
+  return ret;
+}
+
+static int write_mp3(mmcfs_file_handle_t file, char *buf, size_t len) {
   assert(file->finalized == false);
 
   assert(0 < len && len <= PIC_BLOCK_SIZE);
-  memcpy(iobuf, buf, len);
 
-  size_t start_sector = fs->block_start;            // point to first block
-  start_sector += file->mp3_start * fs->block_sect; // move to mp3 start
-  start_sector += file->mp3_written / 512;
-  size_t sector_count = (len + 511) / 512;
+  if (file->mp3_written + len > file->mp3_size) {
+    mmcfs_abort_file(file);
+    return -EINVAL;
+  }
 
-  esp_err_t err = sdmmc_write_sectors(card, iobuf, start_sector, sector_count);
+  esp_err_t err = wc_write(&file->mp3_wc, buf, len);
   if (err != ESP_OK) {
     mmcfs_abort_file(file);
     return -EIO;
   }
 
-  esp_rom_md5_update(&file->mp3_md5_ctx, iobuf, len);
+  esp_rom_md5_update(&file->mp3_md5_ctx, buf, len);
 
   file->mp3_written += len;
   // ESP_LOGI(TAG, "mmcfs_write_mp3: %u, %u", len, file->mp3_written);
@@ -980,29 +3896,33 @@ int mmcfs_write_mp3(mmcfs_file_handle_t file, char *buf, size_t len) {
 /*
  *
  */
-int mmcfs_write_pcm(mmcfs_file_handle_t file, char *buf, size_t len) {
+static int write_pcm(mmcfs_file_handle_t file, char *buf, size_t len) {
   esp_err_t err;
 
-  assert(file == _file);
   assert(file->finalized == false);
 
   assert(len == FRAME_BUF_SIZE);
-  memcpy(iobuf, buf, len);
 
-  size_t start_sector = fs->block_start;
-  start_sector += file->pcm_start * fs->block_sect; // move to pcm start
-  start_sector += file->pcm_written / 512;
-  size_t sector_count = FRAME_BUF_SIZE / 512;
+  pcm_extent_t *ext = &file->pcm_ext[file->pcm_extents - 1];
+  if (ext->size + len > (uint64_t)ext->blocks * mmcfs_block_size()) {
+    int ret = pcm_grow(file);
+    if (ret < 0) {
+      mmcfs_abort_file(file);
+      return ret;
+    }
+    ext = &file->pcm_ext[file->pcm_extents - 1];
+  }
 
-  err = sdmmc_write_sectors(card, iobuf, start_sector, sector_count);
+  err = wc_write(&file->pcm_wc, buf, len);
   if (err != ESP_OK) {
     mmcfs_abort_file(file);
     return -EIO;
   }
 
   // only data is included in md5 calculation.
-  esp_rom_md5_update(&file->pcm_md5_ctx, iobuf, FRAME_DAT_SIZE);
+  esp_rom_md5_update(&file->pcm_md5_ctx, (uint8_t *)buf, FRAME_DAT_SIZE);
 
+  ext->size += len;
   file->pcm_written += len;
   // ESP_LOGI(TAG, "mmcfs_write_pcm: %u, %u", len, file->pcm_written);
   return 0;
@@ -1011,22 +3931,24 @@ int mmcfs_write_pcm(mmcfs_file_handle_t file, char *buf, size_t len) {
 /*
  *
  */
-int mmcfs_commit_file(mmcfs_file_handle_t file) {
-  assert(file == _file);
+static int commit_file(mmcfs_file_handle_t file) {
   assert(file->finalized == false);
 
+  // data first, without meta_lock
+  if (wc_flush(&file->mp3_wc) != ESP_OK ||
+      wc_flush(&file->pcm_wc) != ESP_OK) {
+    mmcfs_abort_file(file);
+    return -EIO;
+  }
+
   file->finalized = true;
-  file->pcm_actual_size = file->pcm_written;
-  file->pcm_actual_blocks = file->pcm_written / mmcfs_block_size();
 
   esp_rom_md5_final(file->calculated_mp3_digest.bytes, &file->mp3_md5_ctx);
   esp_rom_md5_final(file->calculated_pcm_digest.bytes, &file->pcm_md5_ctx);
 
-  char *p1 = (char *)iobuf;
+  char p1[9], p2[9], p3[9];
   sprint_md5_digest(&file->digest, p1, 4);
-  char *p2 = p1 + strlen(p1) + 1;
   sprint_md5_digest(&file->calculated_mp3_digest, p2, 4);
-  char *p3 = p2 + strlen(p2) + 1;
   sprint_md5_digest(&file->calculated_pcm_digest, p3, 4);
   bool mp3_digest_match = memcmp(&file->digest, &file->calculated_mp3_digest,
                                  sizeof(md5_digest_t)) == 0;
@@ -1038,100 +3960,558 @@ int mmcfs_commit_file(mmcfs_file_handle_t file) {
            "size: %u (expected), %u (actual), %s; "
            "starting block: %u, blocks: %u\n"
            "\tpcm: %s, size: %u (actual), %u (estimated); starting "
-           "block: %u, blocks: %u (actual), %u (estimated)",
+           "block: %u, %d extents",
            p1, p2, (mp3_digest_match ? "match" : "mismatch"), file->mp3_size,
            file->mp3_written, (mp3_size_match ? "match" : "mismatch"),
-           file->mp3_start, file->mp3_blocks, p3, file->pcm_actual_size,
-           file->pcm_estimated_size, file->pcm_start, file->pcm_actual_blocks,
-           file->pcm_estimated_blocks);
+           file->mp3_start, file->mp3_blocks, p3, file->pcm_written,
+           file->pcm_estimated_size, file->pcm_ext[0].start,
+           file->pcm_extents);
 
   if (!mp3_digest_match || !mp3_size_match) {
     mmcfs_abort_file(file);
     return -EINVAL;
   }
 
+  // both records (and evictions) in one transaction
+  lock(meta_lock);
+  txn_begin();
   int ret = mmcfs_create_file_ll(
       &file->digest, &file->calculated_pcm_digest, file->mp3_start,
       file->mp3_start + file->mp3_blocks, file->mp3_size, MMCFS_FILE_MP3,
       MMCFS_MP3_SUBTYPE_NONE);
-
-  if (ret < 0) {
-    mmcfs_abort_file(file);
-    return ret;
+  if (ret == 0) {
+    ret = pcm_create_ll(file);
+  }
+  if (ret == 0) {
+    ret = txn_commit();
   }
 
-  ret = mmcfs_create_file_ll(
-      &file->calculated_pcm_digest, &file->digest, file->pcm_start,
-      file->pcm_start + file->pcm_actual_blocks, file->pcm_actual_size,
-      MMCFS_FILE_PCM, MMCFS_PCM_48K_16B_STEREO_OOB_NONE);
   if (ret < 0) {
-    mmcfs_abort_file(file);
+    commit_failed_locked(file);
+    unlock(meta_lock);
     return ret;
   }
 
-  uint32_t pcm_unused_start = file->pcm_start + file->pcm_actual_blocks;
-  uint32_t pcm_unused_blocks =
-      file->pcm_estimated_blocks - file->pcm_actual_blocks;
-
-  if (pcm_unused_blocks) {
-    esp_err_t err = clear_bits(pcm_unused_start,
-                               pcm_unused_start + pcm_unused_blocks, NULL);
+  // unused tails
+  for (int i = 0; i < file->pcm_extents; i++) {
+    pcm_extent_t *e = &file->pcm_ext[i];
+    uint32_t used = convert_bytes_to_blocks(e->size);
+    esp_err_t err = release_blocks(e->start + used, e->start + e->blocks);
     if (err != ESP_OK) {
       vTaskDelay(1000 / portTICK_PERIOD_MS);
       assert(err == ESP_OK);
     }
   }
 
+  wc_deinit(&file->mp3_wc);
+  wc_deinit(&file->pcm_wc);
+  open_files[open_files_find(file)] = NULL;
   free(file);
-  _file = NULL;
+
+  esp_err_t err = checkpoint_write();
+  unlock(meta_lock);
+  if (err != ESP_OK) {
+    // not fatal, next mount scans buckets
+    ESP_LOGI(TAG, "failed to write checkpoint, %s", esp_err_to_name(err));
+  }
   return 0;
 }
 
+int mmcfs_write_mp3(mmcfs_file_handle_t file, char *buf, size_t len) {
+  int64_t t = esp_timer_get_time();
+  int ret = write_mp3(file, buf, len);
+  op_record(MMCFS_OP_WRITE_MP3, t, ret);
+  return ret;
+}
+
+int mmcfs_write_pcm(mmcfs_file_handle_t file, char *buf, size_t len) {
+  int64_t t = esp_timer_get_time();
+  int ret = write_pcm(file, buf, len);
+  op_record(MMCFS_OP_WRITE_PCM, t, ret);
+  return ret;
+}
+
+int mmcfs_commit_file(mmcfs_file_handle_t file) {
+  int64_t t = esp_timer_get_time();
+  int ret = commit_file(file);
+  op_record(MMCFS_OP_COMMIT, t, ret);
+  return ret;
+}
+
+struct mmcfs_pcm_reader {
+  md5_digest_t mp3_digest;
+  md5_digest_t pcm_digest;
+
+  // first data sector and number of frames of each extent, and in all,
+  // resolved at open
+  int ext_count;
+  struct {
+    size_t sector;
+    int frames;
+  } ext[MMCFS_PCM_MAX_EXTENTS];
+  int frames;
+
+  // pcm file removed (or fs unmounted) after open
+  bool stale;
+
+  // readahead buffer of ra_size frames, ra_count frames from ra_first are
+  // buffered, ra_first in slot ra_head. ra_size 0 reads frame by frame.
+  uint8_t *ra_buf;
+  int ra_size;
+  int ra_head;
+  int ra_first;
+  int ra_count;
+
+  struct mmcfs_pcm_reader *next;
+};
+
 /*
- * read pcm data into first half or second harf of iobuf (which is 16K)
+ * all open pcm readers, so removing a file can invalidate them
  */
-void mmcfs_pcm_read(const md5_digest_t *digest, int pos, int half, int *len) {
+static mmcfs_pcm_handle_t pcm_readers = NULL;
 
-  int ret = mmcfs_bucket_read(digest, &bbuf);
-  if (ret < 0) {
-    goto zero;
+struct mmcfs_mp3_reader {
+  md5_digest_t mp3_digest;
+  md5_digest_t pcm_digest; // mp3's link, the pcm may be gone
+
+  // first data sector and size in bytes, resolved at open
+  size_t sector;
+  uint32_t size;
+
+  // bytes read so far, md5 of them; -ENOENT once removed (or fs unmounted)
+  // after open, -EIO if the file read to its end is not what its digest says
+  uint32_t pos;
+  md5_context_t md5;
+  int err;
+
+  // readahead buffer of ra_size bytes, ra_count bytes from ra_first
+  uint8_t *ra_buf;
+  uint32_t ra_size;
+  uint32_t ra_first;
+  uint32_t ra_count;
+
+  struct mmcfs_mp3_reader *next;
+};
+
+// all open mp3 readers, in readers_lock too
+static mmcfs_mp3_handle_t mp3_readers = NULL;
+
+/*
+ * invalidate pcm and mp3 readers on given mp3 or pcm digest, or all readers
+ * if NULL
+ */
+static void pcm_invalidate(const md5_digest_t *digest) {
+  lock(readers_lock);
+  for (mmcfs_pcm_handle_t h = pcm_readers; h; h = h->next) {
+    if (digest == NULL ||
+        memcmp(&h->mp3_digest, digest, sizeof(md5_digest_t)) == 0 ||
+        memcmp(&h->pcm_digest, digest, sizeof(md5_digest_t)) == 0) {
+      h->stale = true;
+    }
+  }
+  for (mmcfs_mp3_handle_t h = mp3_readers; h; h = h->next) {
+    if (digest == NULL ||
+        memcmp(&h->mp3_digest, digest, sizeof(md5_digest_t)) == 0 ||
+        memcmp(&h->pcm_digest, digest, sizeof(md5_digest_t)) == 0) {
+      h->err = -ENOENT;
+    }
+  }
+  unlock(readers_lock);
+}
+
+/*
+ * true if a pcm or mp3 reader is open on given mp3 or pcm digest, so the
+ * pair is neither reclaimed nor moved
+ */
+static bool pcm_reading(const md5_digest_t *digest) {
+  bool reading = false;
+  lock(readers_lock);
+  for (mmcfs_pcm_handle_t h = pcm_readers; h && !reading; h = h->next) {
+    reading = memcmp(&h->mp3_digest, digest, sizeof(md5_digest_t)) == 0 ||
+              memcmp(&h->pcm_digest, digest, sizeof(md5_digest_t)) == 0;
   }
+  for (mmcfs_mp3_handle_t h = mp3_readers; h && !reading; h = h->next) {
+    reading = memcmp(&h->mp3_digest, digest, sizeof(md5_digest_t)) == 0 ||
+              memcmp(&h->pcm_digest, digest, sizeof(md5_digest_t)) == 0;
+  }
+  unlock(readers_lock);
+  return reading;
+}
+
+/*
+ * true if any pcm reader is open
+ */
+static bool pcm_playing() {
+  lock(readers_lock);
+  bool playing = pcm_readers != NULL;
+  unlock(readers_lock);
+  return playing;
+}
 
-  int index = mmcfs_bucket_find_file(&bbuf, digest);
-  if (index == -1) {
-    goto zero;
+/*
+ * pcm file record of mp3 digest, into `pcm`. meta_lock held.
+ */
+static int pcm_lookup_locked(const md5_digest_t *digest, mmcfs_file_t *pcm,
+                             uint16_t *bucket) {
+  int index = mmcfs_bucket_lookup(digest, &bbuf, bucket);
+  if (index < 0) {
+    return index;
   }
 
+  // played, least likely to be reclaimed
+  lru_touch(&bbuf.files[index], *bucket);
+
   md5_digest_t pcm_digest = bbuf.files[index].link;
-  ret = mmcfs_bucket_read(&pcm_digest, &bbuf);
-  index = mmcfs_bucket_find_file(&bbuf, &pcm_digest);
-  if (index == -1) {
-    goto zero;
-  }
-
-  mmcfs_file_t *file = &bbuf.files[index];
-  int frames = file->size / 8192;
-  if (pos < frames) {
-    uint32_t file_block_start =
-        fs->block_start + file->block_start * fs->block_sect;
-
-    uint32_t sector_start = file_block_start + pos * 8192 / 512;
-    uint32_t sector_count = 8192 / 512;
-    uint8_t *buf = half == 0 ? iobuf : &iobuf[8192];
-    esp_err_t err = sdmmc_read_sectors(card, buf, sector_start, sector_count);
-    if (err == ESP_OK) {
-      return;
+  index = mmcfs_bucket_lookup(&pcm_digest, &bbuf, bucket);
+  if (index < 0) {
+    return index;
+  }
+
+  if (!mmcfs_file_is_pcm(&bbuf.files[index])) {
+    return -ENOENT;
+  }
+
+  lru_touch(&bbuf.files[index], *bucket);
+  *pcm = bbuf.files[index];
+  return 0;
+}
+
+/*
+ * extent table of pcm record, from its bucket. meta_lock held.
+ */
+static int pcm_extents_locked(const mmcfs_file_t *pcm, uint16_t bucket,
+                              mmcfs_pcm_handle_t h) {
+  int frames = pcm->size / FRAME_BUF_SIZE;
+
+  h->ext_count = 1 + pcm->extents;
+  if (h->ext_count > MMCFS_PCM_MAX_EXTENTS) {
+    return -EIO;
+  }
+  if (pcm->extents) {
+    int ret = mmcfs_bucket_read(bucket, &bbuf);
+    if (ret < 0) {
+      return ret;
     }
   }
 
-  if (len) {
-    *len = frames;
+  for (int i = 1; i < h->ext_count; i++) {
+    md5_digest_t digest;
+    mmcfs_extent_digest(&pcm->self, i, &digest);
+    int index = mmcfs_bucket_find_file(&bbuf, &digest);
+    if (index < 0) {
+      return -EIO;
+    }
+
+    mmcfs_file_t *e = &bbuf.files[index];
+    h->ext[i].sector = fs->block_start + e->block_start * fs->block_sect;
+    h->ext[i].frames = e->size / FRAME_BUF_SIZE;
+    frames -= h->ext[i].frames;
+  }
+
+  if (frames < 0) {
+    return -EIO;
+  }
+  h->ext[0].sector = fs->block_start + pcm->block_start * fs->block_sect;
+  h->ext[0].frames = frames;
+  return 0;
+}
+
+/*
+ * data sector of frame pos, and frames from there to the end of its extent
+ */
+static size_t pcm_frame_sector(mmcfs_pcm_handle_t h, int pos, int *run) {
+  int i = 0;
+  while (i < h->ext_count - 1 && pos >= h->ext[i].frames) {
+    pos -= h->ext[i++].frames;
+  }
+  *run = h->ext[i].frames - pos;
+  return h->ext[i].sector + pos * (FRAME_BUF_SIZE / 512);
+}
+
+/*
+ * resolve mp3 digest to its pcm extent, this is the only place doing bucket
+ * lookups for playback.
+ */
+int mmcfs_pcm_open(const md5_digest_t *digest, mmcfs_pcm_handle_t *out) {
+  mmcfs_pcm_handle_t h =
+      (mmcfs_pcm_handle_t)malloc(sizeof(struct mmcfs_pcm_reader));
+  if (h == NULL) {
+    return -ENOMEM;
+  }
+
+  // lookup and insert under meta_lock, so a removal in between can't be
+  // missed by pcm_invalidate
+  lock(meta_lock);
+  mmcfs_file_t pcm;
+  uint16_t bucket;
+  int ret = pcm_lookup_locked(digest, &pcm, &bucket);
+  if (ret == 0) {
+    ret = pcm_extents_locked(&pcm, bucket, h);
+  }
+  if (ret < 0) {
+    unlock(meta_lock);
+    free(h);
+    return ret;
+  }
+
+  h->mp3_digest = *digest;
+  h->pcm_digest = pcm.self;
+  h->frames = pcm.size / FRAME_BUF_SIZE;
+  h->stale = false;
+
+  lock(readers_lock);
+  h->next = pcm_readers;
+  pcm_readers = h;
+  unlock(readers_lock);
+  unlock(meta_lock);
+
+  h->ra_size = CONFIG_MMCFS_PCM_READAHEAD_FRAMES;
+  if (h->ra_size > h->frames) {
+    h->ra_size = h->frames;
+  }
+  h->ra_buf = NULL;
+  if (h->ra_size > 1) {
+    h->ra_buf = (uint8_t *)heap_caps_malloc(h->ra_size * FRAME_BUF_SIZE,
+                                            MALLOC_CAP_DMA);
+  }
+  if (h->ra_buf == NULL) {
+    h->ra_size = 0;
+  }
+  h->ra_head = 0;
+  h->ra_first = 0;
+  h->ra_count = 0;
+
+  *out = h;
+  return 0;
+}
+
+void mmcfs_pcm_close(mmcfs_pcm_handle_t h) {
+  if (h == NULL)
+    return;
+
+  lock(readers_lock);
+  for (mmcfs_pcm_handle_t *p = &pcm_readers; *p; p = &(*p)->next) {
+    if (*p == h) {
+      *p = h->next;
+      break;
+    }
+  }
+  unlock(readers_lock);
+  heap_caps_free(h->ra_buf);
+  free(h);
+}
+
+int mmcfs_pcm_frames(mmcfs_pcm_handle_t h) { return h->frames; }
+
+/*
+ * fill whole buffer with frames from `first` in one multi-block read
+ */
+static int ra_fill(mmcfs_pcm_handle_t h, int first) {
+  int count = h->frames - first;
+  if (count > h->ra_size)
+    count = h->ra_size;
+
+  h->ra_head = 0;
+  h->ra_first = first;
+  h->ra_count = 0;
+  if (count <= 0)
+    return 0;
+
+  // one read stays in one extent
+  int run;
+  size_t sector_start = pcm_frame_sector(h, first, &run);
+  if (count > run)
+    count = run;
+
+  int64_t t = esp_timer_get_time();
+  esp_err_t err =
+      dev_read(h->ra_buf, sector_start, count * (FRAME_BUF_SIZE / 512));
+  uint32_t us = esp_timer_get_time() - t;
+
+  stats.pcm_ra_refills++;
+  stats.pcm_ra_refill_us += us;
+  if (stats.pcm_ra_refill_max_us < us)
+    stats.pcm_ra_refill_max_us = us;
+
+  if (err != ESP_OK) {
+    return -EIO;
   }
 
-zero:
-  memset(half == 0 ? iobuf : &iobuf[8192], 0, 8192);
+  h->ra_count = count;
+  return 0;
+}
+
+/*
+ * frame pos in readahead buffer, filled first on a miss. The frame stays
+ * valid until ra_put.
+ */
+static const uint8_t *ra_get(mmcfs_pcm_handle_t h, int pos) {
+  if (pos < h->ra_first || pos >= h->ra_first + h->ra_count) {
+    // seek, or first read
+    stats.pcm_ra_misses++;
+    if (ra_fill(h, pos) < 0) {
+      return NULL;
+    }
+  } else {
+    stats.pcm_ra_hits++;
+
+    // frames before pos are played
+    int played = pos - h->ra_first;
+    h->ra_head += played;
+    h->ra_first = pos;
+    h->ra_count -= played;
+  }
+
+  return &h->ra_buf[h->ra_head * FRAME_BUF_SIZE];
+}
+
+/*
+ * done with frame pos. When it is the last one buffered, the buffer is
+ * refilled with the following frames right away, before the player asks for
+ * them.
+ */
+static void ra_put(mmcfs_pcm_handle_t h, int pos) {
+  if (h->ra_first == pos && h->ra_count == 1) {
+    // a failed refill is retried as a miss on next read
+    ra_fill(h, pos + 1);
+  }
+}
+
+// compaction and reclaim set it from other tasks
+static bool pcm_stale(mmcfs_pcm_handle_t h) {
+  lock(readers_lock);
+  bool stale = h->stale;
+  unlock(readers_lock);
+  return stale;
+}
+
+static int pcm_check(mmcfs_pcm_handle_t h, int pos) {
+  if (pcm_stale(h)) {
+    return -ENOENT;
+  }
+
+  if (pos < 0 || pos >= h->frames) {
+    return -ERANGE;
+  }
+  return 0;
+}
+
+/*
+ * read one frame into dst, no bucket access. dst must be dma capable if
+ * there is no readahead buffer.
+ */
+static int pcm_read_frame(mmcfs_pcm_handle_t h, int pos, uint8_t *dst) {
+  int ret = pcm_check(h, pos);
+  if (ret < 0) {
+    return ret;
+  }
+
+  if (h->ra_size) {
+    const uint8_t *frame = ra_get(h, pos);
+    if (frame == NULL) {
+      return -EIO;
+    }
+    memcpy(dst, frame, FRAME_BUF_SIZE);
+    stats.bytes_copied += FRAME_BUF_SIZE;
+    ra_put(h, pos);
+    return 0;
+  }
+
+  int run;
+  size_t sector_start = pcm_frame_sector(h, pos, &run);
+  esp_err_t err = dev_read(dst, sector_start, FRAME_BUF_SIZE / 512);
+  if (err != ESP_OK) {
+    return -EIO;
+  }
+  return 0;
+}
+
+int mmcfs_pcm_read(mmcfs_pcm_handle_t h, int pos, char buf[FRAME_BUF_SIZE]) {
+  int64_t t = esp_timer_get_time();
+  int ret;
+  if (h->ra_size || mmcfs_buf_is_dma(buf)) {
+    ret = pcm_read_frame(h, pos, (uint8_t *)buf);
+    if (ret == 0 && h->ra_size == 0) {
+      stats.bytes_direct += FRAME_BUF_SIZE;
+    }
+  } else {
+    uint8_t *dst = pool_get();
+    ret = pcm_read_frame(h, pos, dst);
+    if (ret == 0) {
+      memcpy(buf, dst, FRAME_BUF_SIZE);
+      stats.bytes_copied += FRAME_BUF_SIZE;
+    }
+    pool_put(dst);
+  }
+  op_record(MMCFS_OP_PCM_READ, t, ret);
+  return ret;
+}
+
+/*
+ * one cached reader per mixer channel, reopened when the track changes
+ */
+static mmcfs_pcm_handle_t mix_readers[2] = {NULL, NULL};
+
+static mmcfs_pcm_handle_t mix_reader(int chan, const md5_digest_t *digest) {
+  mmcfs_pcm_handle_t h = mix_readers[chan];
+  if (h && !pcm_stale(h) &&
+      memcmp(&h->mp3_digest, digest, sizeof(md5_digest_t)) == 0) {
+    return h;
+  }
+
+  mmcfs_pcm_close(h);
+  mix_readers[chan] = NULL;
+
+  if (mmcfs_pcm_open(digest, &h) < 0) {
+    return NULL;
+  }
+
+  mix_readers[chan] = h;
+  return h;
+}
+
+/*
+ * pcm data of given channel, in place in the reader's readahead buffer if it
+ * has one, otherwise read into `buf`. NULL if nothing can be read, len is
+ * then set to the length of track (if the track exists). A frame got from
+ * readahead buffer must be released with mmcfs_pcm_mix_put.
+ */
+static const uint8_t *mmcfs_pcm_mix_get(int chan, const md5_digest_t *digest,
+                                        int pos, uint8_t *buf, int *len) {
+  mmcfs_pcm_handle_t h = mix_reader(chan, digest);
+  if (h == NULL) {
+    return NULL;
+  }
+
+  const uint8_t *frame = NULL;
+  if (pcm_check(h, pos) == 0) {
+    int64_t t = esp_timer_get_time();
+    if (h->ra_size) {
+      frame = ra_get(h, pos);
+    } else if (pcm_read_frame(h, pos, buf) == 0) {
+      frame = buf;
+    }
+    op_record(MMCFS_OP_PCM_READ, t, frame ? 0 : -EIO);
+  }
+
+  if (frame == NULL && len) {
+    *len = h->frames;
+  }
+  return frame;
+}
+
+static void mmcfs_pcm_mix_put(int chan, int pos) {
+  mmcfs_pcm_handle_t h = mix_readers[chan];
+  if (h && h->ra_size) {
+    ra_put(h, pos);
+  }
 }
 
+/*
+ * with readahead, frames are mixed (or copied) straight from the readers'
+ * buffers. Without, they are read into buf if it is dma capable, or into a
+ * pool buffer. Called from one task only.
+ */
 void mmcfs_pcm_mix(const md5_digest_t *digest1, int pos1, int *len1,
                    const md5_digest_t *digest2, int pos2, int *len2,
                    char buf[8192]) {
@@ -1140,29 +4520,210 @@ void mmcfs_pcm_mix(const md5_digest_t *digest1, int pos1, int *len1,
     return;
   }
 
-  if (digest1 != NULL && digest2 != NULL) {
-    mmcfs_pcm_read(digest1, pos1, 0, len1);
-    mmcfs_pcm_read(digest2, pos2, 1, len2);
-    int16_t *pcm1 = (int16_t *)iobuf;
-    int16_t *pcm2 = (int16_t *)(&iobuf[8192]);
+  bool both = digest1 != NULL && digest2 != NULL;
+  uint8_t *pbuf = both || !mmcfs_buf_is_dma(buf) ? pool_get() : NULL;
+
+  if (both) {
+    const uint8_t *f1 = mmcfs_pcm_mix_get(0, digest1, pos1, pbuf, len1);
+    const uint8_t *f2 =
+        mmcfs_pcm_mix_get(1, digest2, pos2, &pbuf[8192], len2);
+    const int16_t *pcm1 = (const int16_t *)f1;
+    const int16_t *pcm2 = (const int16_t *)f2;
     int16_t *pcm3 = (int16_t *)buf;
 
-    int rms = 0;
-    for (int i = 0; i < 4096; i++) {
-      pcm3[i] = (pcm1[i] + pcm2[i]) / 2;
+    if (f1 && f2) {
+      for (int i = 0; i < 4096; i++) {
+        pcm3[i] = (pcm1[i] + pcm2[i]) / 2;
+      }
+    } else if (f1 || f2) {
+      const int16_t *pcm = f1 ? pcm1 : pcm2;
+      for (int i = 0; i < 4096; i++) {
+        pcm3[i] = pcm[i] / 2;
+      }
+    } else {
+      memset(buf, 0, 8192);
     }
+
+    if (f1)
+      mmcfs_pcm_mix_put(0, pos1);
+    if (f2)
+      mmcfs_pcm_mix_put(1, pos2);
+    pool_put(pbuf);
     return;
   }
 
-  if (digest1 != NULL) {
-    mmcfs_pcm_read(digest1, pos1, 0, len1);
-    memcpy(buf, iobuf, 8192);
-    return;
+  uint8_t *dst = pbuf ? pbuf : (uint8_t *)buf;
+  int chan = digest1 != NULL ? 0 : 1;
+  int pos = digest1 != NULL ? pos1 : pos2;
+  const uint8_t *frame =
+      digest1 != NULL ? mmcfs_pcm_mix_get(0, digest1, pos1, dst, len1)
+                      : mmcfs_pcm_mix_get(1, digest2, pos2, dst, len2);
+
+  if (frame == NULL) {
+    memset(buf, 0, 8192);
+  } else if (frame == (const uint8_t *)buf) {
+    stats.bytes_direct += 8192;
+  } else {
+    memcpy(buf, frame, 8192);
+    stats.bytes_copied += 8192;
+    mmcfs_pcm_mix_put(chan, pos);
+  }
+
+  if (pbuf) {
+    pool_put(pbuf);
+  }
+}
+
+/*
+ * mp3 readers. The file is read in order, ra_size bytes per card command,
+ * and checked against its digest as it is read.
+ */
+int mmcfs_mp3_open(const md5_digest_t *digest, mmcfs_mp3_handle_t *out) {
+  mmcfs_mp3_handle_t h =
+      (mmcfs_mp3_handle_t)malloc(sizeof(struct mmcfs_mp3_reader));
+  if (h == NULL) {
+    return -ENOMEM;
+  }
+
+  // as pcm_open, a removal can't slip in before the reader is listed
+  lock(meta_lock);
+  int index = mmcfs_bucket_lookup(digest, &bbuf, NULL);
+  if (index >= 0 && !mmcfs_file_is_mp3(&bbuf.files[index])) {
+    index = -ENOENT;
+  }
+  if (index < 0) {
+    unlock(meta_lock);
+    free(h);
+    return index;
+  }
+
+  mmcfs_file_t *f = &bbuf.files[index];
+  h->mp3_digest = *digest;
+  h->pcm_digest = f->link;
+  h->sector = fs->block_start + f->block_start * fs->block_sect;
+  h->size = f->size;
+  h->pos = 0;
+  esp_rom_md5_init(&h->md5);
+  h->err = 0;
+
+  lock(readers_lock);
+  h->next = mp3_readers;
+  mp3_readers = h;
+  unlock(readers_lock);
+  unlock(meta_lock);
+
+  // a sector even for an empty mp3, the esp heap has nothing for 0 bytes
+  uint32_t size = h->size ? (h->size + 511) / 512 * 512 : 512;
+  h->ra_size = CONFIG_MMCFS_MP3_READAHEAD_KB * 1024;
+  if (h->ra_size > size) {
+    h->ra_size = size;
+  }
+  h->ra_buf = (uint8_t *)heap_caps_malloc(h->ra_size, MALLOC_CAP_DMA);
+  if (h->ra_buf == NULL) {
+    mmcfs_mp3_close(h);
+    return -ENOMEM;
   }
+  h->ra_first = 0;
+  h->ra_count = 0;
+
+  *out = h;
+  return 0;
+}
 
-  if (digest2 != NULL) {
-    mmcfs_pcm_read(digest2, pos2, 0, len2);
-    memcpy(buf, iobuf, 8192);
+void mmcfs_mp3_close(mmcfs_mp3_handle_t h) {
+  if (h == NULL)
     return;
+
+  lock(readers_lock);
+  for (mmcfs_mp3_handle_t *p = &mp3_readers; *p; p = &(*p)->next) {
+    if (*p == h) {
+      *p = h->next;
+      break;
+    }
+  }
+  unlock(readers_lock);
+  heap_caps_free(h->ra_buf);
+  free(h);
+}
+
+uint32_t mmcfs_mp3_size(mmcfs_mp3_handle_t h) { return h->size; }
+
+/*
+ * next ra_size bytes (or what is left) into the buffer, one multi-block read
+ */
+static int mp3_ra_fill(mmcfs_mp3_handle_t h) {
+  uint32_t count = h->size - h->pos;
+  if (count > h->ra_size)
+    count = h->ra_size;
+
+  // pos is on a sector boundary, the buffer is always consumed whole
+  esp_err_t err =
+      dev_read(h->ra_buf, h->sector + h->pos / 512, (count + 511) / 512);
+  stats.mp3_ra_refills++;
+  if (err != ESP_OK) {
+    h->ra_count = 0;
+    return -EIO;
+  }
+
+  h->ra_first = h->pos;
+  h->ra_count = count;
+  return 0;
+}
+
+static int mp3_read(mmcfs_mp3_handle_t h, uint8_t *buf, size_t len) {
+  lock(readers_lock);
+  int err = h->err;
+  unlock(readers_lock);
+  if (err < 0) {
+    return err;
+  }
+
+  if (len > h->size - h->pos) {
+    len = h->size - h->pos;
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    if (h->pos == h->ra_first + h->ra_count) {
+      int ret = mp3_ra_fill(h);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+
+    size_t n = h->ra_first + h->ra_count - h->pos;
+    if (n > len - done) {
+      n = len - done;
+    }
+    memcpy(&buf[done], &h->ra_buf[h->pos - h->ra_first], n);
+    esp_rom_md5_update(&h->md5, &buf[done], n);
+    h->pos += n;
+    done += n;
   }
+  stats.bytes_copied += done;
+  stats.mp3_bytes_read += done;
+
+  if (done && h->pos == h->size) {
+    md5_digest_t digest;
+    esp_rom_md5_final(digest.bytes, &h->md5);
+    if (memcmp(&digest, &h->mp3_digest, sizeof(md5_digest_t)) != 0) {
+      char p1[9], p2[9];
+      sprint_md5_digest(&h->mp3_digest, p1, 4);
+      sprint_md5_digest(&digest, p2, 4);
+      ESP_LOGI(TAG, "mp3 %s read back as %s, corrupted", p1, p2);
+      stats.mp3_bad++;
+      lock(readers_lock);
+      h->err = -EIO;
+      unlock(readers_lock);
+      return -EIO;
+    }
+  }
+  return done;
+}
+
+int mmcfs_mp3_read(mmcfs_mp3_handle_t h, char *buf, size_t len) {
+  int64_t t = esp_timer_get_time();
+  int ret = mp3_read(h, (uint8_t *)buf, len);
+  op_record(MMCFS_OP_MP3_READ, t, ret);
+  return ret;
 }
@@ -1,5 +1,6 @@
 #include "errno.h"
 #include "roadhill.h"
+#include "blkdev.h"
 
 /****************************
 
@@ -23,15 +24,20 @@ Layout:
 
 @1024       superblock, 512 bytes. Once created, never re-written.
 @512KB      header, 1024 bytes, with last 16 bytes as md5
-@1MB-2KB    writelog, 2048 bytes, dual bucket
+@1MB-2KB    legacy writelog, 2048 bytes, dual bucket (superblock's log_start).
+            Older firmware wrote it, now only replayed once on mount.
+@1MB        transaction log (sector 2048), 512 bytes header followed by up
+            to MMCFS_LOG_MAX_BUCKETS buckets
+@2MB        allocation checkpoint, 512 bytes header followed by bitmap
 @4MB        4 megabytes, include 4096 buckets, each bucket has
             16 records, each record has 64 bytes.
-@64MB       data block starts
+@64MB       data block starts (v2: rounded up to the card's allocation unit)
 
 metadata table @4MB
 header @0B and @512KB
 
-write log is dual buckets, 2 * 1024 in size. @1M
+legacy write log is dual buckets, 2 * 1024 in size, just below 1M.
+transaction log @1M, see mmcfs_log_t.
 
 header describes:
 
@@ -42,7 +48,7 @@ header describes:
     1. size
     2. number of buckets
     3. where starts
-5. writelog offset (twice the size of a bucket)
+5. legacy writelog offset (twice the size of a bucket)
 6. data
     1. starts
     2. block size
@@ -68,18 +74,82 @@ typedef struct mmcfs {
   uint64_t block_count;
 } mmcfs_t;
 
+/*
+ * card geometry the format was laid out for, version 2 on. The data area
+ * starts on an allocation unit boundary and blocks divide the allocation
+ * unit (or are whole units), so no block straddles two. Zero in version 0
+ * superblocks, which were laid out without it.
+ */
+typedef struct __attribute__((packed)) {
+  uint32_t au_sect;      // allocation unit aligned to
+  uint32_t card_au_sect; // what the card reported, 0 if nothing
+} mmcfs_geometry_t;
+
+#define MMCFS_VERSION_GEOMETRY 2
+
 // superblock is located at sector 2 (aka, 1024 bytes)
 typedef struct __attribute__((packed)) {
   uint8_t magic[16];
   uint64_t version;
   mmcfs_t mmcfs;
-  uint8_t zero_padding[512 - 16 * 2 - sizeof(uint64_t) - sizeof(mmcfs_t)];
+  mmcfs_geometry_t geometry;
+  uint8_t zero_padding[512 - 16 * 2 - sizeof(uint64_t) - sizeof(mmcfs_t) -
+                       sizeof(mmcfs_geometry_t)];
   uint8_t md5[16];
 } mmcfs_superblock_t;
 
 _Static_assert(sizeof(mmcfs_superblock_t) == 512,
                "mmc_superblock_t size incorrect");
 
+/*
+ * allocation checkpoint, header at sector 4096 (2MiB) followed by bitmap
+ * sectors. A CLEAN checkpoint equals what a full bucket scan would produce,
+ * so mount loads it instead. It is marked DIRTY before any bucket write and
+ * rewritten (generation + 1) after a successful commit.
+ */
+#define MMCFS_CHECKPOINT_CLEAN (0x4e41454c)
+#define MMCFS_CHECKPOINT_DIRTY (0x59545249)
+
+typedef struct __attribute__((packed)) {
+  uint8_t magic[16];
+  uint8_t superblock_md5[16]; // checkpoint belongs to this format
+  uint64_t generation;
+  uint64_t last_access;
+  uint32_t state;
+  uint32_t block_count;
+  uint32_t used_blocks;
+  uint32_t bitmap_sect;
+  uint8_t bitmap_md5[16];
+  uint8_t zero_padding[512 - 16 * 4 - sizeof(uint64_t) * 2 -
+                       sizeof(uint32_t) * 4];
+  uint8_t md5[16];
+} mmcfs_checkpoint_t;
+
+_Static_assert(sizeof(mmcfs_checkpoint_t) == 512,
+               "mmcfs_checkpoint_t size incorrect");
+
+/*
+ * write log at sector 2048 (1MiB), header followed by the buckets changed by
+ * one metadata transaction (a commit, a removal). All of them go to card in
+ * one write before any is written in place, so mount replays either the
+ * whole transaction or none of it. Room for MMCFS_TXN_MAX_BUCKETS, the most
+ * a transaction changes.
+ */
+#define MMCFS_LOG_MAX_BUCKETS (8)
+
+typedef struct __attribute__((packed)) {
+  uint8_t magic[16];
+  uint8_t superblock_md5[16]; // log belongs to this format
+  uint32_t count;             // buckets following header
+  uint16_t index[MMCFS_LOG_MAX_BUCKETS];
+  uint8_t buckets_md5[16];
+  uint8_t zero_padding[512 - 16 * 4 - sizeof(uint32_t) -
+                       sizeof(uint16_t) * MMCFS_LOG_MAX_BUCKETS];
+  uint8_t md5[16];
+} mmcfs_log_t;
+
+_Static_assert(sizeof(mmcfs_log_t) == 512, "mmcfs_log_t size incorrect");
+
 /**
  * 4G   -> 32KiB    * 64k = 2GB
  * 8G   -> 64KiB    * 64K = 4GB
@@ -99,6 +169,7 @@ typedef enum __attribute__((packed)) {
   MMCFS_FILE_UNUSED = 0,
   MMCFS_FILE_MP3 = 1,
   MMCFS_FILE_PCM = 2,
+  MMCFS_FILE_EXTENT = 3, // more blocks of a pcm file
   MMCFS_FILE_MAX = 0xff
 } mmcfs_file_type_t;
 
@@ -168,24 +239,57 @@ typedef struct __attribute__((packed)) {
   uint8_t pcm_sect;
   uint8_t oob_sect;
 
-  uint32_t zero[3];
+  // a pcm file may be in up to MMCFS_PCM_MAX_EXTENTS extents. The pcm
+  // record has the first one, and size of the whole file; `extents` more
+  // are MMCFS_FILE_EXTENT records in the same bucket, self is the pcm
+  // digest with extent_index (1..) xor'ed into its last byte, link the pcm,
+  // size what is in the extent. Frames run through the extents in order.
+  uint8_t extents;
+  uint8_t extent_index;
+  uint16_t zero16;
+  uint32_t zero[2];
 } mmcfs_file_t;
 
 _Static_assert(sizeof(mmcfs_file_t) == 64, "mmc_file_t size incorrect");
 
+#define MMCFS_PCM_MAX_EXTENTS 4
+
+/*
+ * buckets a commit changes at most: the mp3 and the pcm each go to one,
+ * pouring its oldest file out, each further extent pours one more out of
+ * the pcm's, and a poured mp3 takes its pcm (extents and all) out of one
+ * more bucket
+ */
+#define MMCFS_TXN_MAX_BUCKETS (2 * 2 + MMCFS_PCM_MAX_EXTENTS - 1)
+
+_Static_assert(MMCFS_TXN_MAX_BUCKETS <= MMCFS_LOG_MAX_BUCKETS,
+               "log too small for a commit");
+
 typedef struct {
   mmcfs_file_t files[16];
 } mmcfs_bucket_t;
 
 _Static_assert(sizeof(mmcfs_bucket_t) == 1024, "mmc_bucket_t size incorrect");
 
+/*
+ * data buffers the card can DMA to and from. Buffers passed to
+ * mmcfs_write_mp3/pcm, mmcfs_pcm_read and mmcfs_pcm_mix that are dma capable
+ * (and 4-byte aligned) are handed to the card as is, others are bounced
+ * through an internal buffer.
+ */
+void *mmcfs_buf_alloc(size_t size);
+void mmcfs_buf_free(void *buf);
+bool mmcfs_buf_is_dma(const void *buf);
+
 typedef struct mmcfs_file_context mmcfs_file_context_t;
 typedef mmcfs_file_context_t *mmcfs_file_handle_t;
+// up to CONFIG_MMCFS_MAX_OPEN_FILES at once, -EMFILE beyond that
 int mmcfs_create_file(md5_digest_t *digest, uint32_t mp3_size,
                       mmcfs_file_handle_t *out);
 int mmcfs_write_mp3(mmcfs_file_handle_t file, char *buf, size_t len);
 int mmcfs_write_pcm(mmcfs_file_handle_t file, char *buf, size_t len);
 int mmcfs_commit_file(mmcfs_file_handle_t file);
+void mmcfs_abort_file(mmcfs_file_handle_t file);
 
 typedef struct {
   int mp3_state; // 0, none (maybe link only), 1, partial, 2, full
@@ -196,6 +300,218 @@ typedef struct {
 
 int mmcfs_stat(const md5_digest_t *digest, mmcfs_finfo_t *finfo);
 
+/*
+ * stat of a whole tracklist, each bucket needed is read once. finfo[i] is
+ * zeroed for tracks not cached. Returns the number cached, or error.
+ */
+int mmcfs_stat_many(const md5_digest_t *digests, int count,
+                    mmcfs_finfo_t *finfo);
+
+/*
+ * remove an mp3 and its pcm, -ENOENT if there is none. Open pcm readers of
+ * it go stale.
+ */
+int mmcfs_remove_file(const md5_digest_t *digest);
+
+/*
+ * compaction, moves files toward the start of the data area so free space
+ * ends up in large extents. A step moves at most one file, copying at most
+ * kbps KiB/s (0 for no limit), and returns 1 if there may be more to do, 0
+ * if not. The task runs steps at low priority while free space is
+ * fragmented, until stopped or unmounted.
+ */
+int mmcfs_compact_step(uint32_t kbps);
+esp_err_t mmcfs_compact_start(uint32_t kbps);
+void mmcfs_compact_stop(void);
+
+/*
+ * pcm reader, resolved from mp3 digest once at open. Reads do no bucket
+ * lookups. Sequential reads are served from a readahead buffer of
+ * CONFIG_MMCFS_PCM_READAHEAD_FRAMES frames, refilled with one multi-block
+ * read as soon as its last frame is served. A reader goes stale (reads
+ * return -ENOENT) if the file is removed.
+ */
+typedef struct mmcfs_pcm_reader *mmcfs_pcm_handle_t;
+int mmcfs_pcm_open(const md5_digest_t *digest, mmcfs_pcm_handle_t *out);
+int mmcfs_pcm_frames(mmcfs_pcm_handle_t h);
+int mmcfs_pcm_read(mmcfs_pcm_handle_t h, int pos, char buf[FRAME_BUF_SIZE]);
+void mmcfs_pcm_close(mmcfs_pcm_handle_t h);
+
+/*
+ * mp3 reader, to transcode a cached mp3 again without downloading it. The
+ * file is read from the start to the end, reads return bytes read (less than
+ * asked only at the end), 0 at the end, or error. Reads are served from a
+ * readahead buffer of CONFIG_MMCFS_MP3_READAHEAD_KB, refilled with one
+ * multi-block read. The file is checked against its digest as it is read,
+ * the read reaching the end returns -EIO if it does not match. While open,
+ * the mp3 and its pcm are neither reclaimed nor moved; a reader goes stale
+ * (-ENOENT) if they are removed.
+ */
+typedef struct mmcfs_mp3_reader *mmcfs_mp3_handle_t;
+int mmcfs_mp3_open(const md5_digest_t *digest, mmcfs_mp3_handle_t *out);
+uint32_t mmcfs_mp3_size(mmcfs_mp3_handle_t h);
+int mmcfs_mp3_read(mmcfs_mp3_handle_t h, char *buf, size_t len);
+void mmcfs_mp3_close(mmcfs_mp3_handle_t h);
+
+/*
+ * digest1 and digest2 are read through one cached reader each
+ */
 void mmcfs_pcm_mix(const md5_digest_t *digest1, int pos1, int *len1,
                    const md5_digest_t *digest2, int pos2, int *len2,
                    char buf[8192]);
+
+/*
+ * mount options, take effect on next mmcfs_mount
+ */
+typedef struct {
+  bool force_scan;      // ignore checkpoint, rebuild bitmap from buckets
+  bool sequential_scan; // do not overlap bucket reads with parsing
+
+  // benchmark only, busy-wait this long per 16KiB of buckets parsed, to
+  // model a slower cpu on host
+  uint32_t scan_parse_cost_us;
+
+  // benchmark only, put new files in their first choice bucket only, as
+  // older firmware did
+  bool one_choice;
+
+  // benchmark only, no digest filter (CONFIG_MMCFS_DIGEST_FILTER)
+  bool no_filter;
+
+  // benchmark only, freed space is not discarded (CONFIG_MMCFS_DISCARD)
+  bool no_discard;
+} mmcfs_mount_opts_t;
+
+void mmcfs_set_mount_opts(const mmcfs_mount_opts_t *opts);
+
+/*
+ * operations timed, bucket_update is a metadata transaction written to log
+ * and buckets, reclaim an allocation that had to remove files first,
+ * discard the erase of a unit of free space
+ */
+typedef enum {
+  MMCFS_OP_STAT,
+  MMCFS_OP_CREATE,
+  MMCFS_OP_WRITE_MP3,
+  MMCFS_OP_WRITE_PCM,
+  MMCFS_OP_COMMIT,
+  MMCFS_OP_PCM_READ,
+  MMCFS_OP_BUCKET_UPDATE,
+  MMCFS_OP_RECLAIM,
+  MMCFS_OP_DISCARD,
+  MMCFS_OP_MP3_READ,
+  MMCFS_OP_MAX,
+} mmcfs_op_t;
+
+#define MMCFS_OP_HIST_SIZE 16
+
+/*
+ * latency of an operation, waiting for locks included. hist[0] counts calls
+ * under 16 us, hist[k] from 8 << k us to twice that, the last one also
+ * everything longer.
+ */
+typedef struct {
+  uint32_t count;
+  uint32_t errors;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t hist[MMCFS_OP_HIST_SIZE];
+} mmcfs_op_stats_t;
+
+const char *mmcfs_op_name(mmcfs_op_t op);
+
+typedef struct {
+  // last mount
+  uint32_t mount_us;
+  bool mount_scanned;      // false if bitmap was loaded from checkpoint
+  uint32_t scan_us;        // whole bucket scan
+  uint32_t scan_read_us;   // mounting task waiting for bucket reads
+  uint32_t scan_parse_us;  // mounting task parsing buckets
+  bool log_replayed;       // a bucket torn by power loss was written again
+  uint32_t scan_conflicts; // files with blocks claimed twice or out of range
+
+  // since mount
+  mmcfs_op_stats_t ops[MMCFS_OP_MAX];
+
+  // card commands, sectors transferred and commands failed
+  uint32_t dev_reads;
+  uint32_t dev_writes;
+  uint64_t dev_sectors_read;
+  uint64_t dev_sectors_written;
+  uint32_t dev_erases;
+  uint32_t dev_errors;
+
+  uint32_t bucket_cache_hits;
+  uint32_t bucket_cache_misses; // bucket read from card
+
+  // lookups by digest and buckets searched for them (1 or 2 each); files
+  // put in their second choice bucket, and files poured because both
+  // choices were full
+  uint32_t bucket_lookups;
+  uint32_t bucket_probes;
+  uint32_t bucket_second;
+  uint32_t bucket_pours;
+
+  // most buckets one transaction changed, MMCFS_TXN_MAX_BUCKETS at most
+  uint32_t txn_max_buckets;
+
+  // digest filter has every bucket; buckets searched because it had a
+  // matching fingerprint, the file not being there
+  bool filter_ready;
+  uint32_t filter_false;
+
+  // pcm readahead, a miss is a seek (or first read) that waits for the card
+  uint32_t pcm_ra_hits;
+  uint32_t pcm_ra_misses;
+  uint32_t pcm_ra_refills;
+  uint64_t pcm_ra_refill_us;
+  uint32_t pcm_ra_refill_max_us;
+
+  // mp3 readers: readahead refills, bytes read, and files read to the end
+  // that did not match their digest
+  uint32_t mp3_ra_refills;
+  uint64_t mp3_bytes_read;
+  uint32_t mp3_bad;
+
+  // file data memcpy'ed between caller, iobuf, write combining and readahead
+  // buffers, and data the card transferred from or to caller's buffer as is
+  uint64_t bytes_copied;
+  uint64_t bytes_direct;
+
+  // least recently used files removed to make room for new ones
+  uint32_t reclaim_runs; // allocations that had to reclaim
+  uint32_t reclaim_files;
+  uint64_t reclaim_bytes;
+  uint64_t reclaim_us;
+  uint32_t reclaim_max_us;
+
+  // files moved toward the start of the data area, and moves given up
+  // because the file was removed or played meanwhile
+  uint32_t compact_files;
+  uint64_t compact_bytes;
+  uint32_t compact_aborted;
+
+  // pcm extents grown in place, and extents opened after the first
+  uint32_t pcm_grown;
+  uint32_t pcm_extents;
+
+  // freed space erased in units of discard_unit_sect sectors; units
+  // waiting or being erased, and units skipped because they were in use
+  // again
+  uint32_t discard_unit_sect;
+  uint32_t discard_units;
+  uint32_t discard_pending;
+  uint32_t discard_skipped;
+} mmcfs_stats_t;
+
+// a snapshot, cheap enough to take often
+void mmcfs_get_stats(mmcfs_stats_t *stats);
+
+/*
+ * everything but mount and unmount may be called from different tasks at
+ * the same time; a file handle or pcm reader by one task at a time.
+ */
+esp_err_t mmcfs_mount(blkdev_t *blkdev);
+void mmcfs_unmount(void);
+esp_err_t mmcfs_check(void);
+esp_err_t init_mmcfs(void);
@@ -236,6 +236,8 @@ typedef struct {
 struct pacman_context {
   QueueHandle_t in;
   QueueHandle_t out;
+  // if set, mp3 is read from card (mmcfs_mp3_open) instead of from in
+  struct mmcfs_mp3_reader *mp3;
 };
 
 typedef enum {